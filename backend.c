@@ -0,0 +1,16 @@
+#include "backend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum backend backend_from_env(void) {
+    const char *name = getenv("HELLO_WAYLAND_BACKEND");
+    if (!name || !*name || !strcmp(name, "auto"))
+        return BACKEND_AUTO;
+    if (!strcmp(name, "egl"))
+        return BACKEND_EGL;
+    if (!strcmp(name, "shm"))
+        return BACKEND_SHM;
+    fprintf(stderr, "unknown HELLO_WAYLAND_BACKEND '%s', expected auto, egl or shm\n", name);
+    return BACKEND_AUTO;
+}
@@ -0,0 +1,16 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+// Rendering backend picked with the HELLO_WAYLAND_BACKEND environment variable
+enum backend {
+    // Single-pixel buffers for solid colours when the compositor supports them, EGL otherwise
+    BACKEND_AUTO,
+    // Always render through EGL
+    BACKEND_EGL,
+    // Render on the CPU into wl_shm buffers
+    BACKEND_SHM,
+};
+
+enum backend backend_from_env(void);
+
+#endif // BACKEND_H
@@ -0,0 +1,91 @@
+#include "damage.h"
+#include <EGL/eglext.h>
+#include <string.h>
+
+static char has_buffer_age = 0;
+static PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC swap_buffers_with_damage = NULL;
+
+int rect_empty(struct rect rect) {
+    return rect.width <= 0 || rect.height <= 0;
+}
+
+struct rect rect_union(struct rect a, struct rect b) {
+    if (rect_empty(a))
+        return b;
+    if (rect_empty(b))
+        return a;
+    int x1 = a.x < b.x ? a.x : b.x;
+    int y1 = a.y < b.y ? a.y : b.y;
+    int x2 = a.x + a.width > b.x + b.width ? a.x + a.width : b.x + b.width;
+    int y2 = a.y + a.height > b.y + b.height ? a.y + a.height : b.y + b.height;
+    return (struct rect){x1, y1, x2 - x1, y2 - y1};
+}
+
+struct rect rect_intersect(struct rect a, struct rect b) {
+    int x1 = a.x > b.x ? a.x : b.x;
+    int y1 = a.y > b.y ? a.y : b.y;
+    int x2 = a.x + a.width < b.x + b.width ? a.x + a.width : b.x + b.width;
+    int y2 = a.y + a.height < b.y + b.height ? a.y + a.height : b.y + b.height;
+    if (x2 <= x1 || y2 <= y1)
+        return (struct rect){0, 0, 0, 0};
+    return (struct rect){x1, y1, x2 - x1, y2 - y1};
+}
+
+void damage_add(struct damage *damage, int x, int y, int width, int height) {
+    damage->pending = rect_union(damage->pending, (struct rect){x, y, width, height});
+}
+
+struct rect damage_repaint_region(const struct damage *damage, int age, int width, int height) {
+    struct rect bounds = {0, 0, width, height};
+    if (age <= 0 || age > DAMAGE_HISTORY_LENGTH + 1)
+        return bounds;
+    // A buffer of age n is missing the current changes and those of the n - 1 frames before
+    struct rect region = damage->pending;
+    for (int i = 0; i < age - 1; i++)
+        region = rect_union(region, damage->history[i]);
+    return rect_intersect(region, bounds);
+}
+
+void damage_submitted(struct damage *damage) {
+    memmove(&damage->history[1], &damage->history[0], (DAMAGE_HISTORY_LENGTH - 1) * sizeof(struct rect));
+    damage->history[0] = damage->pending;
+    damage->pending = (struct rect){0, 0, 0, 0};
+}
+
+void damage_init_egl(EGLDisplay egl_display) {
+    const char *extensions = eglQueryString(egl_display, EGL_EXTENSIONS);
+    if (!extensions)
+        return;
+    has_buffer_age = strstr(extensions, "EGL_EXT_buffer_age") != NULL;
+    // Both variants share the same signature and semantics
+    if (strstr(extensions, "EGL_KHR_swap_buffers_with_damage"))
+        swap_buffers_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+    else if (strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+        swap_buffers_with_damage = (PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC)eglGetProcAddress("eglSwapBuffersWithDamageEXT");
+}
+
+int damage_egl_buffer_age(EGLDisplay egl_display, EGLSurface egl_surface) {
+    EGLint age = 0;
+    if (!has_buffer_age || !eglQuerySurface(egl_display, egl_surface, EGL_BUFFER_AGE_EXT, &age))
+        return 0;
+    return age;
+}
+
+void damage_egl_swap(EGLDisplay egl_display, EGLSurface egl_surface, const struct damage *damage, int height) {
+    if (!swap_buffers_with_damage) {
+        eglSwapBuffers(egl_display, egl_surface);
+        return;
+    }
+    // EGL rectangles have their origin at the bottom left
+    const struct rect *rect = &damage->pending;
+    EGLint rects[] = {rect->x, height - rect->y - rect->height, rect->width, rect->height};
+    swap_buffers_with_damage(egl_display, egl_surface, rects, 1);
+}
+
+void damage_surface(struct wl_surface *surface, const struct damage *damage) {
+    const struct rect *rect = &damage->pending;
+    if (wl_surface_get_version(surface) >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+        wl_surface_damage_buffer(surface, rect->x, rect->y, rect->width, rect->height);
+    else
+        wl_surface_damage(surface, rect->x, rect->y, rect->width, rect->height);
+}
@@ -0,0 +1,43 @@
+#ifndef DAMAGE_H
+#define DAMAGE_H
+
+#include <EGL/egl.h>
+#include <wayland-client.h>
+
+struct rect {
+    int x, y, width, height;
+};
+
+// How many past frames of damage are kept, older buffers are repainted in full
+#define DAMAGE_HISTORY_LENGTH 4
+
+// Damage is tracked as one bounding box per frame, in buffer coordinates with the origin at
+// the top left like wl_surface.damage_buffer
+struct damage {
+    // Everything that changed since the last frame was submitted
+    struct rect pending;
+    // history[0] is the damage of the most recently submitted frame
+    struct rect history[DAMAGE_HISTORY_LENGTH];
+};
+
+int rect_empty(struct rect rect);
+struct rect rect_union(struct rect a, struct rect b);
+struct rect rect_intersect(struct rect a, struct rect b);
+
+void damage_add(struct damage *damage, int x, int y, int width, int height);
+// The area that must be repainted in a buffer that was last drawn age frames ago, an age of
+// 0 means the contents are undefined and the whole buffer has to be repainted
+struct rect damage_repaint_region(const struct damage *damage, int age, int width, int height);
+// Moves the pending damage into the history once a frame has been submitted
+void damage_submitted(struct damage *damage);
+
+// Looks up EGL_EXT_buffer_age and EGL_KHR/EXT_swap_buffers_with_damage, call once after eglInitialize
+void damage_init_egl(EGLDisplay egl_display);
+// Buffer age of the back buffer, 0 if unknown or unsupported
+int damage_egl_buffer_age(EGLDisplay egl_display, EGLSurface egl_surface);
+// Swaps with only the pending damage attached when the driver allows it
+void damage_egl_swap(EGLDisplay egl_display, EGLSurface egl_surface, const struct damage *damage, int height);
+// Posts the pending damage, in buffer coordinates when the surface version allows it
+void damage_surface(struct wl_surface *surface, const struct damage *damage);
+
+#endif // DAMAGE_H
@@ -5,49 +5,204 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include "xdg-shell-client.h"
+#include "presentation-time-client.h"
+#include "event-loop.h"
+#include "frame-stats.h"
+#include "frame-scheduler.h"
+#include "shm-buffer.h"
+#include "backend.h"
+#include "damage.h"
+#include "viewporter-client.h"
+#include "single-pixel-buffer-v1-client.h"
+#include "render-thread.h"
+#include "pointer-frame.h"
+#include "startup.h"
+#include "trace.h"
+#include "rect-renderer.h"
 
 static struct wl_display *display;
 static struct wl_compositor *compositor = NULL;
 static struct wl_seat *seat = NULL;
-static struct wl_pointer *pointer = NULL;
+static struct pointer_tracker *pointer_tracker = NULL;
 static struct xdg_wm_base *xdg_wm_base = NULL;
+static struct wl_shm *shm = NULL;
+static struct wp_viewporter *viewporter = NULL;
+static struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager = NULL;
 static EGLDisplay egl_display;
 static EGLContext egl_context;
 static EGLConfig egl_config;
+// Non-NULL while EGL is still coming up on the startup thread
+static struct egl_startup *egl_startup = NULL;
+// Set when surfaces are drawn into wl_shm buffers instead of through EGL
+static char use_shm = 0;
+// Set when solid colours are shown as viewport-scaled single-pixel buffers, with no rendering at all
+static char use_single_pixel = 0;
+// Set when the window is drawn on its own thread, only supported with EGL
+static char use_render_thread = 0;
+// HELLO_WAYLAND_RECTS, the number of grid cells drawn over every window
+static int rect_count = 0;
 static char quit = 0;
+// The surface the shared context is current on, so switching to it again can be skipped
+static EGLSurface current_egl_surface = EGL_NO_SURFACE;
+// One cursor surface is shared by every window
+static struct surface *cursor = NULL;
+static struct wl_list windows;
+static struct window *pointer_focus = NULL;
+// Fires when the oldest hidden window has been hidden for IDLE_GRACE_NS
+static struct event_source *idle_timer = NULL;
+static char idle_timer_armed = 0;
+// Wakes the loop when the earliest held back draw is due
+static struct event_source *draw_timer = NULL;
+
+// How long a window has to stay hidden before its buffers are freed, short enough to matter
+// for a minimised window and long enough to ride out a workspace switch
+#define IDLE_GRACE_NS 2000000000ull
+// EGL is assumed to keep this many buffers per window surface, for the resident estimate
+#define EGL_BUFFERS_PER_SURFACE 3
+
+struct idle_stats {
+    uint64_t released;
+    uint64_t rebuilt;
+    // Estimated, the driver does not say how much it has allocated
+    uint64_t released_bytes;
+};
+
+static struct idle_stats idle_stats;
+
+// HELLO_WAYLAND_WINDOWS opens this many toplevels, all drawn in one pass per dispatch
+#define MAX_WINDOWS 1024
+
+struct scaling_stats {
+    int window_count;
+    // Resident set size before the first window was created
+    long base_resident;
+    uint64_t draws;
+    uint64_t context_switches;
+    struct histogram pass_cpu;
+    struct histogram pass_windows;
+};
+
+static struct scaling_stats scaling_stats = {
+    .pass_cpu = {.name = "draw pass cpu", .unit = "us"},
+    .pass_windows = {.name = "windows per draw pass", .unit = "windows"},
+};
+
+// A cursor is drawn once, so it is set up to avoid EGL
+enum surface_role {
+    SURFACE_ROLE_TOPLEVEL,
+    SURFACE_ROLE_CURSOR,
+};
 
 struct surface {
+    enum surface_role role;
     struct wl_surface *surface;
     struct wl_egl_window *egl_window;
     EGLSurface egl_surface;
+    struct shm_pool *shm_pool;
+    int width, height;
+    // Only used on the single-pixel path, the buffer is kept until the colour changes
+    struct wp_viewport *viewport;
+    struct wl_buffer *solid_buffer;
+    // What is currently on screen, and what changed since the last frame
+    float color[3];
+    struct damage damage;
+    // Drawn over the colour, NULL for none
+    struct rect_batch *rects;
+    // Why the surface has no EGL surface or shm pool right now, the next draw allocates them
+    enum {
+        BUFFERS_ALLOCATED,
+        // Created while EGL was still starting up
+        BUFFERS_DEFERRED,
+        // Hidden for longer than IDLE_GRACE_NS
+        BUFFERS_RELEASED,
+    } buffers;
 };
 
 struct window {
+    struct wl_list link;
     struct surface *surface;
     struct xdg_surface *xdg_surface;
     struct xdg_toplevel *xdg_toplevel;
     int width, height;
     char state;
-    struct surface *cursor;
+    // Set by xdg_toplevel.close, the window is destroyed after the current dispatch
+    char closed;
+    // Set when the window content changed, cleared when it is drawn
+    char dirty;
+    // Non-NULL while a frame is in flight, draws are held back until it completes
+    struct wl_callback *frame_callback;
+    // When the frame callback was requested, one that does not come back for IDLE_GRACE_NS
+    // means the compositor is not showing the window
+    uint64_t frame_requested;
+    // Set while xdg_toplevel.configure reports the window as suspended, nothing is drawn then
+    char suspended;
+    uint64_t suspended_since;
+    // Timestamp of the input event the next frame responds to, 0 if none
+    uint32_t input_time;
+    // Configures are only acked and applied when the next frame is drawn, so a burst of them
+    // during an interactive resize costs one resize and one draw
+    char configure_pending;
+    uint32_t configure_serial;
+    int pending_width, pending_height;
+    // Threaded mode only: the main thread publishes render_state snapshots to the render
+    // thread, which owns the surfaces and everything below
+    struct render_thread *render_thread;
+    uint32_t press_time;
+    uint32_t acked_serial;
+    uint32_t drawn_press_time;
+    // The grid cell under the pointer, -1 for none
+    int hover;
+    // When the dirty window is due to be drawn, 0 if that has not been planned yet
+    struct frame_scheduler *scheduler;
+    uint64_t draw_at;
+};
+
+// Everything the render thread needs to draw a frame
+struct render_state {
+    int width, height;
+    char state;
+    // The newest configure, acked by the render thread right before the frame that applies it
+    uint32_t configure_serial;
+    uint32_t press_time;
+    int hover;
 };
 
+static void resize_surface(struct surface *surface, int width, int height);
+static void arm_idle_timer(uint64_t timeout_ns);
 static void draw_window(struct window *window);
+static void schedule_redraw(struct window *window);
+static void destroy_window(struct window *window);
 
 static void xdg_wm_base_ping(void *data, struct xdg_wm_base *xdg_wm_base, uint32_t serial) {
+    TRACE_LISTENER(xdg_wm_base, 0, xdg_wm_base);
     xdg_wm_base_pong(xdg_wm_base, serial);
 }
 
 static struct xdg_wm_base_listener xdg_wm_base_listener = {&xdg_wm_base_ping};
 
 static void registry_add_object(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
+    TRACE_LISTENER(wl_registry, 0, registry);
     if (!strcmp(interface, wl_compositor_interface.name)) {
-        compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 1);
+        // version 4 adds damage_buffer
+        compositor = wl_registry_bind(registry, name, &wl_compositor_interface, version < 4 ? version : 4);
     } else if (!strcmp(interface, wl_seat_interface.name)) {
-        seat = wl_registry_bind(registry, name, &wl_seat_interface, 4);
+        seat = wl_registry_bind(registry, name, &wl_seat_interface, version < POINTER_FRAME_SEAT_VERSION ? version : POINTER_FRAME_SEAT_VERSION);
     } else if (!strcmp(interface, xdg_wm_base_interface.name)) {
-        xdg_wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
+        // version 6 adds the suspended state, every listener below handles the events up to it
+        xdg_wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, version < 6 ? version : 6);
         xdg_wm_base_add_listener(xdg_wm_base, &xdg_wm_base_listener, NULL);
+    } else if (!strcmp(interface, wl_shm_interface.name)) {
+        shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    } else if (!strcmp(interface, wp_viewporter_interface.name)) {
+        viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
+    } else if (!strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name)) {
+        single_pixel_buffer_manager = wl_registry_bind(registry, name, &wp_single_pixel_buffer_manager_v1_interface, 1);
+    } else if (!strcmp(interface, wp_presentation_interface.name)) {
+        frame_stats_set_presentation(wl_registry_bind(registry, name, &wp_presentation_interface, 1));
     }
 }
 
@@ -55,68 +210,295 @@ static void registry_remove_object(void *data, struct wl_registry *registry, uin
 
 static struct wl_registry_listener registry_listener = {&registry_add_object, &registry_remove_object};
 
-static void pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface, wl_fixed_t surface_x, wl_fixed_t surface_y) {
-    struct window *window = data;
-    wl_pointer_set_cursor(wl_pointer, serial, window->cursor->surface, 10, 10);
-}
-
-static void pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface) {}
-
-static void pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time, wl_fixed_t surface_x, wl_fixed_t surface_y) {}
-
-static void pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state) {
-    struct window *window = data;
-    if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
+static void handle_pointer_frame(void *data, struct wl_pointer *wl_pointer, const struct pointer_frame *frame) {
+    // Focus is only looked up on enter and leave, a destroyed window clears it itself and
+    // must not be found again through a surface that is already gone
+    struct window *previous = pointer_focus;
+    if (frame->entered || !frame->focus)
+        pointer_focus = frame->focus ? wl_surface_get_user_data(frame->focus) : NULL;
+    if (frame->entered)
+        wl_pointer_set_cursor(wl_pointer, frame->enter_serial, cursor->surface, 10, 10);
+    if (previous && previous != pointer_focus && previous->hover >= 0) {
+        previous->hover = -1;
+        schedule_redraw(previous);
+    }
+    struct window *window = pointer_focus;
+    if (!window)
+        return;
+    char changed = 0;
+    if (frame->moved && window->surface->rects) {
+        int hover = rect_grid_cell(window->surface->rects, window->width, window->height, wl_fixed_to_int(frame->x), wl_fixed_to_int(frame->y));
+        if (hover != window->hover) {
+            window->hover = hover;
+            if (!window->input_time)
+                window->input_time = frame->time;
+            changed = 1;
+        }
+    }
+    for (int i = 0; i < frame->button_count; i++) {
+        const struct pointer_button *button = &frame->buttons[i];
+        if (button->state != WL_POINTER_BUTTON_STATE_PRESSED)
+            continue;
         window->state = !window->state;
-        draw_window(window);
+        if (!window->input_time)
+            window->input_time = button->time;
+        window->press_time = button->time;
+        changed = 1;
     }
+    // However many events the frame held, the window is redrawn once
+    if (changed)
+        schedule_redraw(window);
 }
 
-static void pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis, wl_fixed_t value) {}
-
-static struct wl_pointer_listener pointer_listener = {&pointer_enter, &pointer_leave, &pointer_motion, &pointer_button, &pointer_axis, NULL, NULL, NULL, NULL};
-
 void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial) {
+    TRACE_LISTENER(xdg_surface, 0, xdg_surface);
     struct window *window = data;
-    xdg_surface_ack_configure(xdg_surface, serial);
-    wl_egl_window_resize(window->surface->egl_window, window->width, window->height, 0, 0);
-    draw_window(window);
+    startup_mark(STARTUP_FIRST_CONFIGURE);
+    window->configure_pending = 1;
+    window->configure_serial = serial;
+    schedule_redraw(window);
 }
 static struct xdg_surface_listener xdg_surface_listener = {&xdg_surface_configure};
 
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height, struct wl_array *states) {
+    TRACE_LISTENER(xdg_toplevel, 0, xdg_toplevel);
     struct window *window = data;
     if (width > 0)
-        window->width = width;
+        window->pending_width = width;
     if (height > 0)
-        window->height = height;
+        window->pending_height = height;
+
+    char suspended = 0;
+    uint32_t *state;
+    wl_array_for_each(state, states) {
+        if (*state == XDG_TOPLEVEL_STATE_SUSPENDED)
+            suspended = 1;
+    }
+    if (suspended && !window->suspended) {
+        window->suspended_since = monotonic_ns();
+        arm_idle_timer(IDLE_GRACE_NS);
+    } else if (!suspended && window->suspended && window->frame_callback) {
+        // A suspended window's frame callback may never come, the next frame must not wait for it
+        wl_callback_destroy(window->frame_callback);
+        window->frame_callback = NULL;
+    }
+    window->suspended = suspended;
 }
 
 void xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel) {
-    quit = 1;
+    TRACE_LISTENER(xdg_toplevel, 1, xdg_toplevel);
+    struct window *window = data;
+    window->closed = 1;
+}
+
+void xdg_toplevel_configure_bounds(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height) {}
+
+void xdg_toplevel_wm_capabilities(void *data, struct xdg_toplevel *xdg_toplevel, struct wl_array *capabilities) {}
+
+static struct xdg_toplevel_listener xdg_toplevel_listener = {&xdg_toplevel_configure, &xdg_toplevel_close, &xdg_toplevel_configure_bounds, &xdg_toplevel_wm_capabilities};
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+    TRACE_LISTENER(wl_callback, 0, callback);
+    struct window *window = data;
+    wl_callback_destroy(callback);
+    window->frame_callback = NULL;
+    // Shown again after its buffers were freed, it needs a fresh frame
+    if (window->surface->buffers == BUFFERS_RELEASED)
+        window->dirty = 1;
 }
 
-static struct xdg_toplevel_listener xdg_toplevel_listener = {&xdg_toplevel_configure, &xdg_toplevel_close};
+static struct wl_callback_listener frame_listener = {&frame_done};
+
+// Every surface shares one context, which only has to be rebound when the target changes
+static void make_current(EGLSurface egl_surface) {
+    if (egl_surface == current_egl_surface)
+        return;
+    eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context);
+    current_egl_surface = egl_surface;
+    scaling_stats.context_switches++;
+}
+
+// Whatever needs EGL first waits here for the startup thread to finish with it
+static void wait_for_egl(void) {
+    if (!egl_startup)
+        return;
+    // Anything queued so far, the first ack_configure among it, goes out before the wait
+    wl_display_flush(display);
+    egl_startup_finish(egl_startup, &egl_display, &egl_config, &egl_context);
+    egl_startup = NULL;
+    damage_init_egl(egl_display);
+}
+
+// Picks the cheapest way to show the surface and allocates what it needs
+static void allocate_buffers(struct surface *surface) {
+    // A cursor is drawn once and never changes, so it skips EGL whenever the compositor can
+    // show it some other way
+    char is_cursor = surface->role == SURFACE_ROLE_CURSOR;
+    if (use_single_pixel || (is_cursor && viewporter && single_pixel_buffer_manager)) {
+        surface->viewport = wp_viewporter_get_viewport(viewporter, surface->surface);
+        return;
+    }
+    if (use_shm || (is_cursor && shm)) {
+        surface->shm_pool = shm_pool_create(shm);
+        return;
+    }
+    wait_for_egl();
+    surface->egl_window = wl_egl_window_create(surface->surface, surface->width, surface->height);
+    surface->egl_surface = eglCreateWindowSurface(egl_display, egl_config, surface->egl_window, NULL);
+    // Pacing comes from frame callbacks, so the swap must never block the event thread
+    make_current(surface->egl_surface);
+    eglSwapInterval(egl_display, 0);
+}
 
-static struct surface *create_surface(int width, int height) {
+static struct surface *create_surface(enum surface_role role, int width, int height) {
     struct surface *surface = malloc(sizeof(struct surface));
     memset(surface, 0, sizeof(struct surface));
+    surface->role = role;
     surface->surface = wl_compositor_create_surface(compositor);
-    surface->egl_window = wl_egl_window_create(surface->surface, width, height);
-    surface->egl_surface = eglCreateWindowSurface(egl_display, egl_config, surface->egl_window, NULL);
+    surface->width = width;
+    surface->height = height;
+    damage_add(&surface->damage, 0, 0, width, height);
+    // The surface and its role can be set up without EGL, so the first configure does not have
+    // to wait for it
+    if (egl_startup)
+        surface->buffers = BUFFERS_DEFERRED;
+    else
+        allocate_buffers(surface);
     return surface;
 }
 
-static void draw_surface(struct surface *surface, float r, float g, float b) {
-    eglMakeCurrent(egl_display, surface->egl_surface, surface->egl_surface, egl_context);
+static void ensure_buffers(struct surface *surface) {
+    if (surface->buffers == BUFFERS_ALLOCATED)
+        return;
+    if (surface->buffers == BUFFERS_RELEASED)
+        idle_stats.rebuilt++;
+    allocate_buffers(surface);
+    surface->buffers = BUFFERS_ALLOCATED;
+    damage_add(&surface->damage, 0, 0, surface->width, surface->height);
+}
+
+// Frees the EGL surface or shm pool of a surface nobody is looking at, draw_surface()
+// allocates them again. Single-pixel buffers are too small to bother.
+static void release_buffers(struct surface *surface) {
+    if (surface->buffers != BUFFERS_ALLOCATED || surface->viewport)
+        return;
+    if (surface->shm_pool) {
+        shm_pool_destroy(surface->shm_pool);
+        surface->shm_pool = NULL;
+    } else {
+        if (surface->egl_surface == current_egl_surface)
+            current_egl_surface = EGL_NO_SURFACE;
+        eglDestroySurface(egl_display, surface->egl_surface);
+        wl_egl_window_destroy(surface->egl_window);
+        surface->egl_surface = EGL_NO_SURFACE;
+        surface->egl_window = NULL;
+    }
+    surface->buffers = BUFFERS_RELEASED;
+    idle_stats.released++;
+    idle_stats.released_bytes += (uint64_t)surface->width * surface->height * 4 * (use_shm ? SHM_POOL_SLOTS : EGL_BUFFERS_PER_SURFACE);
+}
+
+static void resize_surface(struct surface *surface, int width, int height) {
+    if (width != surface->width || height != surface->height)
+        damage_add(&surface->damage, 0, 0, width, height);
+    surface->width = width;
+    surface->height = height;
+    if (surface->egl_window)
+        wl_egl_window_resize(surface->egl_window, width, height, 0, 0);
+}
+
+// Maps a colour channel in [0, 1] onto the full 32-bit range single-pixel buffers use
+static uint32_t single_pixel_channel(float value) {
+    return (uint32_t)((double)value * UINT32_MAX);
+}
+
+// Returns 0 if nothing was committed
+static int draw_surface(struct surface *surface, float r, float g, float b) {
+    ensure_buffers(surface);
+    char color_changed = surface->color[0] != r || surface->color[1] != g || surface->color[2] != b;
+    if (color_changed) {
+        surface->color[0] = r;
+        surface->color[1] = g;
+        surface->color[2] = b;
+        damage_add(&surface->damage, 0, 0, surface->width, surface->height);
+    }
+    // Nothing changed on screen, the commit only carries other state such as an acked configure
+    if (rect_empty(surface->damage.pending)) {
+        wl_surface_commit(surface->surface);
+        return 1;
+    }
+    if (surface->viewport) {
+        // Still the surface's current buffer until the commit below replaces it
+        struct wl_buffer *old_buffer = NULL;
+        if (!surface->solid_buffer || color_changed) {
+            old_buffer = surface->solid_buffer;
+            surface->solid_buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+                single_pixel_buffer_manager,
+                single_pixel_channel(r),
+                single_pixel_channel(g),
+                single_pixel_channel(b),
+                UINT32_MAX);
+        }
+        wl_surface_attach(surface->surface, surface->solid_buffer, 0, 0);
+        wp_viewport_set_destination(surface->viewport, surface->width, surface->height);
+        wl_surface_damage(surface->surface, 0, 0, surface->width, surface->height);
+        wl_surface_commit(surface->surface);
+        if (old_buffer)
+            wl_buffer_destroy(old_buffer);
+        damage_submitted(&surface->damage);
+        return 1;
+    }
+    if (surface->shm_pool) {
+        struct shm_buffer *buffer = shm_pool_acquire(surface->shm_pool, surface->width, surface->height);
+        // Every slot is still on screen or queued in the compositor, the damage waits for the next frame
+        if (!buffer)
+            return 0;
+        struct rect repaint = damage_repaint_region(&surface->damage, buffer->age, buffer->width, buffer->height);
+        shm_fill(buffer->data, buffer->stride, repaint.x, repaint.y, repaint.width, repaint.height, shm_pixel(r, g, b));
+        if (surface->rects)
+            rect_batch_draw_shm(surface->rects, buffer->data, buffer->stride, repaint);
+        wl_surface_attach(surface->surface, buffer->buffer, 0, 0);
+        damage_surface(surface->surface, &surface->damage);
+        wl_surface_commit(surface->surface);
+        damage_submitted(&surface->damage);
+        return 1;
+    }
+    make_current(surface->egl_surface);
+    // Only the parts of the reused back buffer that are out of date get painted again
+    struct rect repaint = damage_repaint_region(&surface->damage, damage_egl_buffer_age(egl_display, surface->egl_surface), surface->width, surface->height);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(repaint.x, surface->height - repaint.y - repaint.height, repaint.width, repaint.height);
     glClearColor(r, g, b, 1.0);
     glClear(GL_COLOR_BUFFER_BIT);
-    eglSwapBuffers(egl_display, surface->egl_surface);
+    if (surface->rects)
+        rect_batch_draw_gl(surface->rects, surface->width, surface->height);
+    glDisable(GL_SCISSOR_TEST);
+    damage_egl_swap(egl_display, surface->egl_surface, &surface->damage, surface->height);
+    damage_submitted(&surface->damage);
+    return 1;
 }
 
 static void destroy_surface(struct surface *surface) {
-    eglDestroySurface(egl_display, surface->egl_surface);
-    wl_egl_window_destroy(surface->egl_window);
+    if (surface->viewport) {
+        if (surface->solid_buffer)
+            wl_buffer_destroy(surface->solid_buffer);
+        wp_viewport_destroy(surface->viewport);
+    } else if (surface->shm_pool) {
+        shm_pool_destroy(surface->shm_pool);
+    } else if (surface->egl_window) {
+        if (surface->egl_surface == current_egl_surface)
+            current_egl_surface = EGL_NO_SURFACE;
+        eglDestroySurface(egl_display, surface->egl_surface);
+        wl_egl_window_destroy(surface->egl_window);
+    }
+    if (surface->rects)
+        rect_batch_destroy(surface->rects);
     wl_surface_destroy(surface->surface);
     free(surface);
 }
@@ -125,7 +507,11 @@ static struct window *create_window(int width, int height) {
     struct window *window = malloc(sizeof(struct window));
     memset(window, 0, sizeof(struct window));
 
-    window->surface = create_surface(width, height);
+    window->surface = create_surface(SURFACE_ROLE_TOPLEVEL, width, height);
+    wl_surface_set_user_data(window->surface->surface, window);
+    if (rect_count)
+        window->surface->rects = rect_batch_create(rect_count);
+    window->hover = -1;
 
     window->xdg_surface = xdg_wm_base_get_xdg_surface(xdg_wm_base, window->surface->surface);
 
@@ -134,61 +520,391 @@ static struct window *create_window(int width, int height) {
     xdg_toplevel_add_listener(window->xdg_toplevel, &xdg_toplevel_listener, window);
     window->width = width;
     window->height = height;
+    window->pending_width = width;
+    window->pending_height = height;
+    window->scheduler = frame_scheduler_create();
 
     wl_surface_commit(window->surface->surface);
 
-    window->cursor = create_surface(30, 30);
-    draw_surface(window->cursor, 1.0, 1.0, 1.0);
-
+    wl_list_insert(windows.prev, &window->link);
     return window;
 }
 
+// Marks the window for the next draw pass, which skips it while a frame is still in flight
+static void schedule_redraw(struct window *window) {
+    if (window->render_thread) {
+        struct render_state *state = render_thread_state(window->render_thread);
+        state->width = window->pending_width;
+        state->height = window->pending_height;
+        state->state = window->state;
+        state->configure_serial = window->configure_serial;
+        state->press_time = window->press_time;
+        state->hover = window->hover;
+        render_thread_publish(window->render_thread);
+        return;
+    }
+    window->dirty = 1;
+}
+
+// The grid follows the surface size, with the cell under the pointer highlighted. Every
+// cell is set on every frame, the batch itself skips the ones that did not change.
+static void update_rects(struct surface *surface, char state, int hover) {
+    rect_grid_layout(surface->rects, surface->width, surface->height);
+    uint32_t cell = state ? shm_pixel(0.0, 0.8, 0.4) : shm_pixel(0.0, 0.4, 0.8);
+    uint32_t highlight = shm_pixel(1.0, 1.0, 1.0);
+    for (int i = 0; i < rect_batch_count(surface->rects); i++)
+        rect_batch_set_color(surface->rects, i, i == hover ? highlight : cell);
+    struct rect changed = rect_batch_take_damage(surface->rects);
+    if (!rect_empty(changed))
+        damage_add(&surface->damage, changed.x, changed.y, changed.width, changed.height);
+}
+
+static int draw_window_state(struct surface *surface, char state, int hover) {
+    if (surface->rects)
+        update_rects(surface, state, hover);
+    if (state)
+        return draw_surface(surface, 0.0, 1.0, 0.5);
+    return draw_surface(surface, 0.0, 0.5, 1.0);
+}
+
+// Acking only the newest serial implicitly acks every configure before it
+static void ack_configure(struct window *window) {
+    if (!window->configure_pending)
+        return;
+    xdg_surface_ack_configure(window->xdg_surface, window->configure_serial);
+    window->width = window->pending_width;
+    window->height = window->pending_height;
+    resize_surface(window->surface, window->width, window->height);
+    window->configure_pending = 0;
+}
+
 static void draw_window(struct window *window) {
-    if (window->state) {
-        draw_surface(window->surface, 0.0, 1.0, 0.5);
-    } else {
-        draw_surface(window->surface, 0.0, 0.5, 1.0);
+    struct surface *surface = window->surface;
+    int width = window->configure_pending ? window->pending_width : surface->width;
+    int height = window->configure_pending ? window->pending_height : surface->height;
+    // Every shm buffer is still held by the compositor. The window stays dirty, with nothing
+    // requested for a commit that cannot be made yet, and the pass the release wakes up draws it.
+    if (surface->shm_pool && !shm_pool_ready(surface->shm_pool, width, height))
+        return;
+    window->dirty = 0;
+    ack_configure(window);
+    // Requested before the swap so it is part of the commit eglSwapBuffers makes
+    window->frame_callback = wl_surface_frame(surface->surface);
+    wl_callback_add_listener(window->frame_callback, &frame_listener, window);
+    window->frame_requested = monotonic_ns();
+    arm_idle_timer(IDLE_GRACE_NS);
+    frame_stats_commit(surface->surface, window->input_time, frame_scheduler_target(window->scheduler));
+    if (!draw_window_state(surface, window->state, window->hover)) {
+        // Only reached when the pool could not get memory. The callback never went out with a
+        // commit, the presentation feedback is rare enough to leave to the next one.
+        wl_callback_destroy(window->frame_callback);
+        window->frame_callback = NULL;
+        window->dirty = 1;
+        return;
+    }
+    window->input_time = 0;
+    startup_mark(STARTUP_FIRST_FRAME);
+}
+
+// Runs on the render thread, which already requested the frame callback
+static void render_window(void *data, const void *snapshot) {
+    struct window *window = data;
+    const struct render_state *state = snapshot;
+    if (state->configure_serial != window->acked_serial) {
+        xdg_surface_ack_configure(window->xdg_surface, state->configure_serial);
+        window->acked_serial = state->configure_serial;
+        resize_surface(window->surface, state->width, state->height);
+    }
+    // Only the first frame after a click measures its latency
+    frame_stats_commit(window->surface->surface, state->press_time != window->drawn_press_time ? state->press_time : 0, 0);
+    window->drawn_press_time = state->press_time;
+    draw_window_state(window->surface, state->state, state->hover);
+    startup_mark(STARTUP_FIRST_FRAME);
+}
+
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Runs after every dispatch: all windows that changed, whose previous frame has been shown
+// and whose scheduled draw time has come are drawn back to back, closed ones are destroyed
+static void draw_windows(void) {
+    uint64_t start = thread_cpu_ns();
+    uint64_t now = monotonic_ns();
+    uint64_t next_draw = 0;
+    int drawn = 0;
+    struct window *window, *tmp;
+    wl_list_for_each_safe(window, tmp, &windows, link) {
+        if (window->closed) {
+            destroy_window(window);
+            continue;
+        }
+        if (!window->dirty)
+            continue;
+        // A suspended window still acks its configures, but keeps its old content until it
+        // is shown again
+        if (window->suspended) {
+            if (window->configure_pending) {
+                ack_configure(window);
+                wl_surface_commit(window->surface->surface);
+            }
+            window->draw_at = 0;
+            continue;
+        }
+        if (window->frame_callback)
+            continue;
+        // Held back until just before the compositor's deadline, input that arrives in the
+        // meantime still makes it into the frame
+        if (!window->draw_at)
+            window->draw_at = now + frame_scheduler_delay(window->scheduler, now);
+        if (window->draw_at > now) {
+            if (!next_draw || window->draw_at < next_draw)
+                next_draw = window->draw_at;
+            continue;
+        }
+        window->draw_at = 0;
+        frame_scheduler_begin(window->scheduler, monotonic_ns());
+        draw_window(window);
+        frame_scheduler_end(window->scheduler, monotonic_ns());
+        drawn++;
+    }
+    if (next_draw)
+        event_source_timer_update(draw_timer, next_draw - now);
+    if (wl_list_empty(&windows))
+        quit = 1;
+    if (!drawn)
+        return;
+    scaling_stats.draws += drawn;
+    histogram_add(&scaling_stats.pass_cpu, (thread_cpu_ns() - start) / 1000);
+    histogram_add(&scaling_stats.pass_windows, drawn);
+}
+
+// Time since the window stopped being shown, 0 while it is shown
+static uint64_t hidden_for(const struct window *window, uint64_t now) {
+    if (window->suspended)
+        return now - window->suspended_since;
+    if (window->frame_callback)
+        return now - window->frame_requested;
+    return 0;
+}
+
+static void arm_idle_timer(uint64_t timeout_ns) {
+    if (!idle_timer || idle_timer_armed)
+        return;
+    event_source_timer_update(idle_timer, timeout_ns);
+    idle_timer_armed = 1;
+}
+
+// Frees the buffers of every window that has been hidden for the grace period, and waits
+// for the next one that might be. The render thread owns its window's surface, so that one
+// keeps its buffers.
+static void handle_idle_timer(void *data) {
+    idle_timer_armed = 0;
+    uint64_t now = monotonic_ns();
+    uint64_t next = 0;
+    struct window *window;
+    wl_list_for_each(window, &windows, link) {
+        uint64_t hidden = hidden_for(window, now);
+        if (!hidden || window->render_thread || window->surface->buffers != BUFFERS_ALLOCATED)
+            continue;
+        if (hidden >= IDLE_GRACE_NS) {
+            release_buffers(window->surface);
+            continue;
+        }
+        if (!next || IDLE_GRACE_NS - hidden < next)
+            next = IDLE_GRACE_NS - hidden;
+    }
+    if (next)
+        arm_idle_timer(next);
+}
+
+// Window buffers that are currently allocated, estimated from their sizes
+static uint64_t buffer_bytes(void) {
+    uint64_t bytes = 0;
+    struct window *window;
+    wl_list_for_each(window, &windows, link) {
+        struct surface *surface = window->surface;
+        if (surface->buffers != BUFFERS_ALLOCATED || surface->viewport)
+            continue;
+        bytes += (uint64_t)surface->width * surface->height * 4 * (surface->shm_pool ? SHM_POOL_SLOTS : EGL_BUFFERS_PER_SURFACE);
     }
+    return bytes;
+}
+
+static void idle_stats_dump(FILE *file) {
+    int hidden = 0;
+    uint64_t now = monotonic_ns();
+    struct window *window;
+    wl_list_for_each(window, &windows, link)
+        hidden += hidden_for(window, now) != 0;
+    fprintf(file, "idle: %d windows hidden, buffers released %llu times (~%llu KiB) and rebuilt %llu times, ~%llu KiB of window buffers resident\n",
+        hidden,
+        (unsigned long long)idle_stats.released,
+        (unsigned long long)idle_stats.released_bytes / 1024,
+        (unsigned long long)idle_stats.rebuilt,
+        (unsigned long long)buffer_bytes() / 1024);
+    fflush(file);
 }
 
 static void destroy_window(struct window *window) {
+    if (window->render_thread)
+        render_thread_destroy(window->render_thread);
+    if (window->frame_callback)
+        wl_callback_destroy(window->frame_callback);
+    if (pointer_focus == window)
+        pointer_focus = NULL;
+    wl_list_remove(&window->link);
     xdg_toplevel_destroy(window->xdg_toplevel);
     xdg_surface_destroy(window->xdg_surface);
     destroy_surface(window->surface);
-    destroy_surface(window->cursor);
+    frame_scheduler_destroy(window->scheduler);
     free(window);
 }
 
+static long resident_bytes(void) {
+    long size, resident;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+    if (fscanf(file, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    fclose(file);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void scaling_stats_dump(FILE *file) {
+    if (scaling_stats.window_count < 2)
+        return;
+    // Buffers are allocated lazily by the first draw, so this includes them once every
+    // window has been shown
+    long growth = resident_bytes() - scaling_stats.base_resident;
+    fprintf(file, "scaling: %d windows, ~%ld KiB resident per window, %llu draws, %llu context switches\n",
+        scaling_stats.window_count,
+        growth > 0 ? growth / 1024 / scaling_stats.window_count : 0,
+        (unsigned long long)scaling_stats.draws,
+        (unsigned long long)scaling_stats.context_switches);
+    histogram_print(&scaling_stats.pass_cpu, file);
+    histogram_print(&scaling_stats.pass_windows, file);
+    fflush(file);
+}
+
+static int window_count_from_env(void) {
+    const char *value = getenv("HELLO_WAYLAND_WINDOWS");
+    int count = value ? atoi(value) : 1;
+    if (count < 1)
+        return 1;
+    return count < MAX_WINDOWS ? count : MAX_WINDOWS;
+}
+
+static void handle_terminate(void *data, int signal_number) {
+    quit = 1;
+}
+
+static void handle_dump_stats(void *data, int signal_number) {
+    startup_dump(stderr);
+    frame_stats_dump(stderr);
+    frame_scheduler_dump(stderr);
+    rect_renderer_dump(stderr);
+    scaling_stats_dump(stderr);
+    idle_stats_dump(stderr);
+}
+
+static void handle_draw_timer(void *data) {
+}
+
+static void handle_toggle_trace(void *data, int signal_number) {
+    trace_toggle();
+}
+
 int main() {
+    startup_mark(STARTUP_MAIN);
+    trace_init();
     display = wl_display_connect(NULL);
+    startup_mark(STARTUP_CONNECTED);
+    enum backend backend = backend_from_env();
+    // Which globals there are is not known yet, so unless the user asked for shm EGL is
+    // started on the chance that it is needed
+    if (backend != BACKEND_SHM)
+        egl_startup = egl_startup_begin(display);
     struct wl_registry *registry = wl_display_get_registry(display);
     wl_registry_add_listener(registry, &registry_listener, NULL);
     wl_display_roundtrip(display);
+    startup_mark(STARTUP_REGISTRY);
+
+    rect_count = rect_count_from_env();
+    // A single-pixel buffer can only show the background
+    use_single_pixel = backend == BACKEND_AUTO && viewporter && single_pixel_buffer_manager && !rect_count;
+    use_shm = backend == BACKEND_SHM;
+    if (use_shm && !shm) {
+        fprintf(stderr, "compositor has no wl_shm, falling back to EGL\n");
+        use_shm = 0;
+        egl_startup = egl_startup_begin(display);
+    }
+    scaling_stats.window_count = window_count_from_env();
+    use_render_thread = render_thread_requested();
+    if (use_render_thread && (use_shm || use_single_pixel)) {
+        fprintf(stderr, "render thread needs the EGL backend, drawing on the main thread\n");
+        use_render_thread = 0;
+    }
+    if (use_render_thread && scaling_stats.window_count > 1) {
+        fprintf(stderr, "render thread only supports a single window, drawing on the main thread\n");
+        use_render_thread = 0;
+    }
 
-    egl_display = eglGetDisplay(display);
-    eglInitialize(egl_display, NULL, NULL);
-
-    eglBindAPI(EGL_OPENGL_API);
-    EGLint attributes[] = {
-        EGL_RED_SIZE, 8,
-        EGL_GREEN_SIZE, 8,
-        EGL_BLUE_SIZE, 8,
-    EGL_NONE};
-    EGLint num_config;
-    eglChooseConfig(egl_display, attributes, &egl_config, 1, &num_config);
-    egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, NULL);
-
-    struct window *window = create_window(300, 300);
-
-    pointer = wl_seat_get_pointer(seat);
-    wl_pointer_add_listener(pointer, &pointer_listener, window);
-
-    while (wl_display_dispatch(display) != -1 && !quit) {}
+    scaling_stats.base_resident = resident_bytes();
+    wl_list_init(&windows);
+    for (int i = 0; i < scaling_stats.window_count; i++)
+        create_window(300, 300);
+    // Drawn after the windows are committed, in case it is the first thing that needs EGL
+    cursor = create_surface(SURFACE_ROLE_CURSOR, 30, 30);
+    draw_surface(cursor, 1.0, 1.0, 1.0);
+    if (use_render_thread) {
+        struct window *window = wl_container_of(windows.next, window, link);
+        // The render thread gets a surface it can draw into right away
+        ensure_buffers(window->surface);
+        // The context can only be current on one thread, from here on that is the render thread
+        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        current_egl_surface = EGL_NO_SURFACE;
+        window->render_thread = render_thread_create(display, window->surface->surface, sizeof(struct render_state), &render_window, window);
+    }
 
-    wl_pointer_destroy(pointer);
-    destroy_window(window);
-    eglDestroyContext(egl_display, egl_context);
-    eglTerminate(egl_display);
+    pointer_tracker = pointer_tracker_create(seat, &handle_pointer_frame, NULL);
+
+    struct event_loop *loop = event_loop_create(display);
+    event_loop_add_signal(loop, SIGINT, &handle_terminate, NULL);
+    event_loop_add_signal(loop, SIGTERM, &handle_terminate, NULL);
+    event_loop_add_signal(loop, SIGUSR1, &handle_dump_stats, NULL);
+    event_loop_add_signal(loop, SIGUSR2, &handle_toggle_trace, NULL);
+    idle_timer = event_loop_add_timer(loop, &handle_idle_timer, NULL);
+    // draw_windows() runs after every dispatch, the timer only has to wake the loop up
+    draw_timer = event_loop_add_timer(loop, &handle_draw_timer, NULL);
+
+    // quit is set by draw_windows() once the last window is closed, so it is checked first
+    while (!quit && event_loop_dispatch(loop, -1) != -1)
+        draw_windows();
+
+    startup_dump(stderr);
+    frame_stats_dump(stderr);
+    frame_scheduler_dump(stderr);
+    rect_renderer_dump(stderr);
+    scaling_stats_dump(stderr);
+    idle_stats_dump(stderr);
+    event_loop_destroy(loop);
+    pointer_tracker_destroy(pointer_tracker);
+    struct window *window, *tmp;
+    wl_list_for_each_safe(window, tmp, &windows, link)
+        destroy_window(window);
+    destroy_surface(cursor);
+    frame_stats_destroy();
+    // EGL may have been started for nothing, it still has to be joined and torn down
+    wait_for_egl();
+    if (egl_display != EGL_NO_DISPLAY) {
+        eglDestroyContext(egl_display, egl_context);
+        eglTerminate(egl_display);
+    }
+    trace_finish();
     wl_display_disconnect(display);
     return 0;
 }
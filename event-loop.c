@@ -0,0 +1,229 @@
+#include "event-loop.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+enum event_source_type {
+    EVENT_SOURCE_FD,
+    EVENT_SOURCE_TIMER,
+    EVENT_SOURCE_SIGNAL,
+};
+
+struct event_source {
+    struct event_loop *loop;
+    enum event_source_type type;
+    int fd;
+    uint32_t events;
+    char removed;
+    void *data;
+    union {
+        event_loop_fd_func_t fd;
+        event_loop_timer_func_t timer;
+        event_loop_signal_func_t signal;
+    } func;
+    int signal_number;
+};
+
+struct event_loop {
+    struct wl_display *display;
+    struct event_source **sources;
+    int source_count, source_capacity;
+    struct pollfd *fds;
+    int fds_capacity;
+    char dispatching;
+};
+
+struct event_loop *event_loop_create(struct wl_display *display) {
+    struct event_loop *loop = malloc(sizeof(struct event_loop));
+    memset(loop, 0, sizeof(struct event_loop));
+    loop->display = display;
+    return loop;
+}
+
+static void free_source(struct event_source *source) {
+    if (source->type != EVENT_SOURCE_FD)
+        close(source->fd);
+    free(source);
+}
+
+void event_loop_destroy(struct event_loop *loop) {
+    for (int i = 0; i < loop->source_count; i++)
+        free_source(loop->sources[i]);
+    free(loop->sources);
+    free(loop->fds);
+    free(loop);
+}
+
+static struct event_source *add_source(struct event_loop *loop, enum event_source_type type, int fd, uint32_t events, void *data) {
+    if (loop->source_count == loop->source_capacity) {
+        loop->source_capacity = loop->source_capacity ? loop->source_capacity * 2 : 8;
+        loop->sources = realloc(loop->sources, loop->source_capacity * sizeof(struct event_source *));
+    }
+    struct event_source *source = malloc(sizeof(struct event_source));
+    memset(source, 0, sizeof(struct event_source));
+    source->loop = loop;
+    source->type = type;
+    source->fd = fd;
+    source->events = events;
+    source->data = data;
+    loop->sources[loop->source_count++] = source;
+    return source;
+}
+
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events, event_loop_fd_func_t func, void *data) {
+    struct event_source *source = add_source(loop, EVENT_SOURCE_FD, fd, events, data);
+    source->func.fd = func;
+    return source;
+}
+
+struct event_source *event_loop_add_timer(struct event_loop *loop, event_loop_timer_func_t func, void *data) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (fd < 0)
+        return NULL;
+    struct event_source *source = add_source(loop, EVENT_SOURCE_TIMER, fd, POLLIN, data);
+    source->func.timer = func;
+    return source;
+}
+
+struct event_source *event_loop_add_signal(struct event_loop *loop, int signal_number, event_loop_signal_func_t func, void *data) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signal_number);
+    // Blocked first, so the signal cannot hit its default action before the signalfd exists
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    int fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (fd < 0)
+        return NULL;
+    struct event_source *source = add_source(loop, EVENT_SOURCE_SIGNAL, fd, POLLIN, data);
+    source->func.signal = func;
+    source->signal_number = signal_number;
+    return source;
+}
+
+int event_source_timer_update(struct event_source *source, uint64_t timeout_ns) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = timeout_ns / 1000000000;
+    its.it_value.tv_nsec = timeout_ns % 1000000000;
+    return timerfd_settime(source->fd, 0, &its, NULL);
+}
+
+static void compact_sources(struct event_loop *loop) {
+    int count = 0;
+    for (int i = 0; i < loop->source_count; i++) {
+        if (loop->sources[i]->removed)
+            free_source(loop->sources[i]);
+        else
+            loop->sources[count++] = loop->sources[i];
+    }
+    loop->source_count = count;
+}
+
+void event_source_remove(struct event_source *source) {
+    struct event_loop *loop = source->loop;
+    source->removed = 1;
+    // Sources are only freed outside of dispatch so callbacks never see a dangling pointer
+    if (!loop->dispatching)
+        compact_sources(loop);
+}
+
+static void dispatch_source(struct event_source *source, uint32_t revents) {
+    switch (source->type) {
+        case EVENT_SOURCE_FD:
+            source->func.fd(source->data, source->fd, revents);
+            break;
+
+        case EVENT_SOURCE_TIMER: {
+            uint64_t expirations;
+            if (read(source->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                source->func.timer(source->data);
+            break;
+        }
+
+        case EVENT_SOURCE_SIGNAL: {
+            struct signalfd_siginfo info;
+            while (read(source->fd, &info, sizeof(info)) == sizeof(info))
+                source->func.signal(source->data, info.ssi_signo);
+            break;
+        }
+    }
+}
+
+int event_loop_dispatch(struct event_loop *loop, int timeout_ms) {
+    struct wl_display *display = loop->display;
+
+    // Anything already queued has to be dispatched before we are allowed to read
+    while (wl_display_prepare_read(display) != 0) {
+        if (wl_display_dispatch_pending(display) < 0)
+            return -1;
+    }
+
+    short display_events = POLLIN;
+    if (wl_display_flush(display) < 0) {
+        if (errno != EAGAIN) {
+            wl_display_cancel_read(display);
+            return -1;
+        }
+        // The socket buffer is full, wake up again as soon as it drains
+        display_events |= POLLOUT;
+    }
+
+    int nfds = loop->source_count + 1;
+    if (nfds > loop->fds_capacity) {
+        loop->fds_capacity = nfds * 2;
+        loop->fds = realloc(loop->fds, loop->fds_capacity * sizeof(struct pollfd));
+    }
+    loop->fds[0].fd = wl_display_get_fd(display);
+    loop->fds[0].events = display_events;
+    loop->fds[0].revents = 0;
+    for (int i = 0; i < loop->source_count; i++) {
+        loop->fds[i + 1].fd = loop->sources[i]->fd;
+        loop->fds[i + 1].events = loop->sources[i]->events;
+        loop->fds[i + 1].revents = 0;
+    }
+
+    int ret;
+    do {
+        ret = poll(loop->fds, nfds, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        wl_display_cancel_read(display);
+        return -1;
+    }
+
+    // Listeners may remove sources too, keep them in place until the fds below are handled
+    loop->dispatching = 1;
+    if (loop->fds[0].revents & POLLIN) {
+        if (wl_display_read_events(display) < 0)
+            ret = -1;
+    } else {
+        wl_display_cancel_read(display);
+    }
+    if (loop->fds[0].revents & POLLOUT)
+        wl_display_flush(display);
+
+    if (ret >= 0 && wl_display_dispatch_pending(display) < 0)
+        ret = -1;
+    if (loop->fds[0].revents & (POLLERR | POLLHUP))
+        ret = -1;
+
+    // Only the sources that were polled get dispatched, ones added by a callback wait a round
+    for (int i = 0; ret >= 0 && i < nfds - 1; i++) {
+        struct event_source *source = loop->sources[i];
+        if (loop->fds[i + 1].revents && !source->removed)
+            dispatch_source(source, loop->fds[i + 1].revents);
+    }
+    loop->dispatching = 0;
+    compact_sources(loop);
+    if (ret < 0)
+        return -1;
+
+    wl_display_flush(display);
+    return 0;
+}
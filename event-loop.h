@@ -0,0 +1,38 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+// A small poll()-based loop that reads from the Wayland socket and any number of extra fds
+// (timers, signals, or anything the caller wants to watch) without ever busy-waiting.
+
+struct event_loop;
+struct event_source;
+
+// events is a mask of POLLIN/POLLOUT/... as reported by poll()
+typedef void (*event_loop_fd_func_t)(void *data, int fd, uint32_t events);
+typedef void (*event_loop_timer_func_t)(void *data);
+typedef void (*event_loop_signal_func_t)(void *data, int signal_number);
+
+struct event_loop *event_loop_create(struct wl_display *display);
+void event_loop_destroy(struct event_loop *loop);
+
+struct event_source *event_loop_add_fd(struct event_loop *loop, int fd, uint32_t events, event_loop_fd_func_t func, void *data);
+// The timer is created disarmed, use event_source_timer_update() to arm it
+struct event_source *event_loop_add_timer(struct event_loop *loop, event_loop_timer_func_t func, void *data);
+// Blocks the signal in the calling thread and delivers it through a signalfd instead. Threads
+// created afterwards inherit the mask, so call this before starting any.
+struct event_source *event_loop_add_signal(struct event_loop *loop, int signal_number, event_loop_signal_func_t func, void *data);
+
+// Arms the timer to fire once after the given number of nanoseconds, 0 disarms it
+int event_source_timer_update(struct event_source *source, uint64_t timeout_ns);
+// Safe to call from inside any callback, including the source's own
+void event_source_remove(struct event_source *source);
+
+// Flushes pending requests, waits up to timeout_ms (-1 for forever) for the display or any
+// source to become ready, then dispatches Wayland events and source callbacks.
+// Returns -1 if the connection to the compositor is lost.
+int event_loop_dispatch(struct event_loop *loop, int timeout_ms);
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,126 @@
+#include "frame-scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Render costs remembered per surface, the slowest of them is what is planned for
+#define COST_SAMPLES 16
+// Kept between the planned end of a draw and the compositor's deadline, for wakeup jitter
+#define SLACK_NS 500000
+// The latch lead never shrinks below this, and shrinks by LEAD_STEP_NS per frame on time
+#define MIN_LEAD_NS 1000000
+#define LEAD_STEP_NS 50000
+// Frames drawn immediately after a miss, before scheduling is tried again
+#define FALLBACK_FRAMES 8
+
+struct frame_scheduler {
+    uint64_t costs[COST_SAMPLES];
+    int next_cost;
+    uint64_t draw_start;
+    uint64_t target;
+};
+
+// One clock for the whole program, as if every surface were on the same output
+static struct {
+    uint32_t refresh;
+    // Smallest gap between presentations, used when feedback carries no refresh period
+    uint32_t estimated_refresh;
+    uint64_t last_present;
+    // How long before a refresh a commit has to reach the compositor to make it
+    uint64_t lead;
+    int fallback;
+    uint64_t on_time, missed, immediate;
+} frame_clock;
+
+struct frame_scheduler *frame_scheduler_create(void) {
+    struct frame_scheduler *scheduler = malloc(sizeof(struct frame_scheduler));
+    memset(scheduler, 0, sizeof(struct frame_scheduler));
+    return scheduler;
+}
+
+void frame_scheduler_destroy(struct frame_scheduler *scheduler) {
+    free(scheduler);
+}
+
+static uint64_t refresh_period(void) {
+    return frame_clock.refresh ? frame_clock.refresh : frame_clock.estimated_refresh;
+}
+
+static uint64_t render_cost(const struct frame_scheduler *scheduler) {
+    uint64_t cost = 0;
+    for (int i = 0; i < COST_SAMPLES; i++) {
+        if (scheduler->costs[i] > cost)
+            cost = scheduler->costs[i];
+    }
+    return cost;
+}
+
+uint64_t frame_scheduler_delay(struct frame_scheduler *scheduler, uint64_t now) {
+    scheduler->target = 0;
+    uint64_t refresh = refresh_period();
+    if (!refresh || !frame_clock.last_present || frame_clock.fallback > 0) {
+        if (frame_clock.fallback > 0)
+            frame_clock.fallback--;
+        frame_clock.immediate++;
+        return 0;
+    }
+    uint64_t needed = frame_clock.lead + render_cost(scheduler) + SLACK_NS;
+    // The first refresh that can still be made, counted from the last one seen
+    uint64_t earliest = now + needed;
+    uint64_t target = frame_clock.last_present;
+    if (earliest > target)
+        target += (earliest - target + refresh - 1) / refresh * refresh;
+    scheduler->target = target;
+    return target - needed - now;
+}
+
+void frame_scheduler_begin(struct frame_scheduler *scheduler, uint64_t now) {
+    scheduler->draw_start = now;
+}
+
+void frame_scheduler_end(struct frame_scheduler *scheduler, uint64_t now) {
+    scheduler->costs[scheduler->next_cost] = now - scheduler->draw_start;
+    scheduler->next_cost = (scheduler->next_cost + 1) % COST_SAMPLES;
+}
+
+uint64_t frame_scheduler_target(const struct frame_scheduler *scheduler) {
+    return scheduler->target;
+}
+
+void frame_scheduler_presented(uint64_t target, uint64_t present_time, uint32_t refresh) {
+    if (!refresh && frame_clock.last_present && present_time > frame_clock.last_present) {
+        uint64_t gap = present_time - frame_clock.last_present;
+        // Anything under a millisecond is two surfaces presented on the same refresh
+        if (gap > 1000000 && (!frame_clock.estimated_refresh || gap < frame_clock.estimated_refresh))
+            frame_clock.estimated_refresh = gap;
+    }
+    frame_clock.refresh = refresh;
+    if (present_time > frame_clock.last_present)
+        frame_clock.last_present = present_time;
+    if (!frame_clock.lead)
+        frame_clock.lead = refresh_period() / 2;
+    if (!target)
+        return;
+    uint64_t period = refresh_period();
+    if (present_time > target + period / 2) {
+        // Landed on a later refresh than planned, the deadline is earlier than assumed
+        frame_clock.missed++;
+        frame_clock.lead += period / 8;
+        if (frame_clock.lead > period)
+            frame_clock.lead = period;
+        frame_clock.fallback = FALLBACK_FRAMES;
+        return;
+    }
+    frame_clock.on_time++;
+    if (frame_clock.lead > MIN_LEAD_NS + LEAD_STEP_NS)
+        frame_clock.lead -= LEAD_STEP_NS;
+}
+
+void frame_scheduler_dump(FILE *file) {
+    fprintf(file, "frame scheduler: refresh %.2f ms, latch lead %.2f ms, %llu frames on time, %llu missed, %llu drawn immediately\n",
+        refresh_period() / 1e6,
+        frame_clock.lead / 1e6,
+        (unsigned long long)frame_clock.on_time,
+        (unsigned long long)frame_clock.missed,
+        (unsigned long long)frame_clock.immediate);
+    fflush(file);
+}
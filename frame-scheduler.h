@@ -0,0 +1,38 @@
+#ifndef FRAME_SCHEDULER_H
+#define FRAME_SCHEDULER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Just-in-time frame scheduling. Drawing as soon as a frame callback arrives shows input that
+// is up to a whole refresh period old by the time the compositor latches the frame. Instead
+// the draw is held back until shortly before the compositor's deadline for the next refresh,
+// so it picks up whatever input arrived in the meantime.
+//
+// The refresh period and phase come from wp_presentation feedback. How long before a refresh
+// the compositor latches commits is learnt: it shrinks while frames land on the refresh they
+// were meant for and grows on every miss. How long a surface takes to draw is measured per
+// surface. After a miss, or without presentation feedback, frames are drawn immediately.
+// Everything is in CLOCK_MONOTONIC nanoseconds.
+
+struct frame_scheduler;
+
+struct frame_scheduler *frame_scheduler_create(void);
+void frame_scheduler_destroy(struct frame_scheduler *scheduler);
+
+// For a surface that has a frame ready to draw at now, how long to wait before drawing it,
+// 0 to draw right away
+uint64_t frame_scheduler_delay(struct frame_scheduler *scheduler, uint64_t now);
+// Bracket the draw, the time in between is the surface's render cost
+void frame_scheduler_begin(struct frame_scheduler *scheduler, uint64_t now);
+void frame_scheduler_end(struct frame_scheduler *scheduler, uint64_t now);
+// The refresh the last delay aimed the frame at, 0 if it was not scheduled
+uint64_t frame_scheduler_target(const struct frame_scheduler *scheduler);
+
+// Presentation feedback for a frame, target is what frame_scheduler_target() returned when it
+// was drawn. refresh is 0 if the compositor does not know it.
+void frame_scheduler_presented(uint64_t target, uint64_t present_time, uint32_t refresh);
+
+void frame_scheduler_dump(FILE *file);
+
+#endif // FRAME_SCHEDULER_H
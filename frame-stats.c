@@ -0,0 +1,166 @@
+#include "frame-stats.h"
+#include "frame-scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int bucket_index(uint64_t value) {
+    if (value < 4)
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    int index = msb * 4 + ((value >> (msb - 2)) & 3) - 4;
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+static uint64_t bucket_lower_bound(int index) {
+    if (index < 4)
+        return index;
+    int msb = (index + 4) / 4;
+    return (uint64_t)(4 + (index & 3)) << (msb - 2);
+}
+
+void histogram_add(struct histogram *histogram, uint64_t value) {
+    if (histogram->count == 0 || value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[bucket_index(value)]++;
+}
+
+void histogram_print(const struct histogram *histogram, FILE *file) {
+    if (histogram->count == 0) {
+        fprintf(file, "%s: no samples\n", histogram->name);
+        return;
+    }
+    fprintf(file, "%s: %llu samples, min %llu, avg %llu, max %llu %s\n",
+        histogram->name,
+        (unsigned long long)histogram->count,
+        (unsigned long long)histogram->min,
+        (unsigned long long)(histogram->sum / histogram->count),
+        (unsigned long long)histogram->max,
+        histogram->unit);
+    uint32_t peak = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histogram->buckets[i] > peak)
+            peak = histogram->buckets[i];
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (!histogram->buckets[i])
+            continue;
+        int bar = histogram->buckets[i] * 40 / peak;
+        fprintf(file, "  >= %10llu %-6s %8u |%.*s\n",
+            (unsigned long long)bucket_lower_bound(i),
+            histogram->unit,
+            histogram->buckets[i],
+            bar > 0 ? bar : 1,
+            "########################################");
+    }
+}
+
+struct frame {
+    uint64_t submit_time;
+    uint32_t input_time;
+    uint64_t target;
+};
+
+static struct wp_presentation *presentation = NULL;
+static clockid_t clock_id = CLOCK_MONOTONIC;
+static uint64_t frames_presented = 0;
+static uint64_t frames_discarded = 0;
+static uint64_t frames_zero_copy = 0;
+static struct histogram submit_to_present = {.name = "submit->present", .unit = "us"};
+static struct histogram input_to_present = {.name = "input->present", .unit = "us"};
+static struct histogram missed_refreshes = {.name = "missed refreshes", .unit = "frames"};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(clock_id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void presentation_clock_id(void *data, struct wp_presentation *wp_presentation, uint32_t clk_id) {
+    clock_id = clk_id;
+}
+
+static struct wp_presentation_listener presentation_listener = {&presentation_clock_id};
+
+static void feedback_sync_output(void *data, struct wp_presentation_feedback *feedback, struct wl_output *output) {}
+
+static void feedback_presented(void *data, struct wp_presentation_feedback *feedback, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+    struct frame *frame = data;
+    uint64_t present_time = (((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000 + tv_nsec;
+
+    frames_presented++;
+    if (clock_id == CLOCK_MONOTONIC)
+        frame_scheduler_presented(frame->target, present_time, refresh);
+    if (flags & WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY)
+        frames_zero_copy++;
+
+    if (present_time >= frame->submit_time) {
+        uint64_t latency = present_time - frame->submit_time;
+        histogram_add(&submit_to_present, latency / 1000);
+        // A frame submitted in time lands on the first refresh after it, any further full
+        // refresh period it had to wait is one the compositor (or we) missed
+        if (refresh)
+            histogram_add(&missed_refreshes, latency / refresh);
+    }
+
+    if (frame->input_time) {
+        // Input timestamps are milliseconds with an undefined base; every compositor in
+        // practice uses CLOCK_MONOTONIC, so this only trusts small positive differences
+        uint32_t latency_ms = (uint32_t)(present_time / 1000000) - frame->input_time;
+        if (clock_id == CLOCK_MONOTONIC && latency_ms < 10000)
+            histogram_add(&input_to_present, (uint64_t)latency_ms * 1000);
+    }
+
+    wp_presentation_feedback_destroy(feedback);
+    free(frame);
+}
+
+static void feedback_discarded(void *data, struct wp_presentation_feedback *feedback) {
+    frames_discarded++;
+    wp_presentation_feedback_destroy(feedback);
+    free(data);
+}
+
+static struct wp_presentation_feedback_listener feedback_listener = {&feedback_sync_output, &feedback_presented, &feedback_discarded};
+
+void frame_stats_set_presentation(struct wp_presentation *new_presentation) {
+    presentation = new_presentation;
+    wp_presentation_add_listener(presentation, &presentation_listener, NULL);
+}
+
+void frame_stats_commit(struct wl_surface *surface, uint32_t input_time, uint64_t target) {
+    if (!presentation)
+        return;
+    struct frame *frame = malloc(sizeof(struct frame));
+    frame->submit_time = now_ns();
+    frame->input_time = input_time;
+    frame->target = target;
+    struct wp_presentation_feedback *feedback = wp_presentation_feedback(presentation, surface);
+    wp_presentation_feedback_add_listener(feedback, &feedback_listener, frame);
+}
+
+void frame_stats_dump(FILE *file) {
+    if (!presentation) {
+        fprintf(file, "frame stats: compositor does not support wp_presentation\n");
+        return;
+    }
+    fprintf(file, "frame stats: %llu presented (%llu zero-copy), %llu discarded\n",
+        (unsigned long long)frames_presented,
+        (unsigned long long)frames_zero_copy,
+        (unsigned long long)frames_discarded);
+    histogram_print(&submit_to_present, file);
+    histogram_print(&missed_refreshes, file);
+    histogram_print(&input_to_present, file);
+    fflush(file);
+}
+
+void frame_stats_destroy(void) {
+    // Feedback still in flight is freed along with the connection, its frames are leaked
+    if (presentation)
+        wp_presentation_destroy(presentation);
+    presentation = NULL;
+}
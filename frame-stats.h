@@ -0,0 +1,32 @@
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <wayland-client.h>
+#include "presentation-time-client.h"
+
+// Log-linear histogram: every power of two is split into four equal steps, so recording a
+// value is a couple of integer ops and the relative error stays under 25% at any scale
+#define HISTOGRAM_BUCKETS 128
+
+struct histogram {
+    const char *name;
+    const char *unit;
+    uint64_t count, sum, min, max;
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void histogram_add(struct histogram *histogram, uint64_t value);
+void histogram_print(const struct histogram *histogram, FILE *file);
+
+// Takes ownership of a bound wp_presentation, without one no frames are recorded
+void frame_stats_set_presentation(struct wp_presentation *presentation);
+// Call right before the commit that submits a frame. input_time is the timestamp of the input
+// event the frame responds to, in the millisecond clock of wl_pointer events, or 0 for none.
+// target is the refresh frame_scheduler aimed the frame at, and 0 if it was not scheduled.
+void frame_stats_commit(struct wl_surface *surface, uint32_t input_time, uint64_t target);
+void frame_stats_dump(FILE *file);
+void frame_stats_destroy(void);
+
+#endif // FRAME_STATS_H
@@ -4,43 +4,269 @@
 #include <GL/gl.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
 #include "wlr-layer-shell-unstable-v1-client.h"
+#include "presentation-time-client.h"
+#include "event-loop.h"
+#include "frame-stats.h"
+#include "frame-scheduler.h"
+#include "shm-buffer.h"
+#include "backend.h"
+#include "damage.h"
+#include "viewporter-client.h"
+#include "single-pixel-buffer-v1-client.h"
+#include "trace.h"
+#include "rect-renderer.h"
+#include "startup.h"
 
 static struct wl_display *display;
 static struct wl_compositor *compositor = NULL;
 static struct wl_subcompositor *subcompositor = NULL;
 static struct zwlr_layer_shell_v1 *layer_shell = NULL;
+static struct wl_shm *shm = NULL;
+static struct wp_viewporter *viewporter = NULL;
+static struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager = NULL;
 static EGLDisplay egl_display;
 static EGLContext egl_context;
 static EGLConfig egl_config;
+// Set when surfaces are drawn into wl_shm buffers instead of through EGL
+static char use_shm = 0;
+// Set when solid colours are shown as viewport-scaled single-pixel buffers, with no rendering at all
+static char use_single_pixel = 0;
 static char running = 1;
+// HELLO_WAYLAND_RECTS, the number of grid cells drawn over the layer surface
+static int rect_count = 0;
+// Wakes the loop when a held back configure is due to be drawn
+static struct event_source *draw_timer = NULL;
+// HELLO_WAYLAND_STRESS, widgets change colour on their own timers and grow in number
+static char stress = 0;
+static int max_widgets = 1;
+static struct event_source *update_timer = NULL;
+static struct event_source *stress_timer = NULL;
+
+static struct {
+    uint64_t widget_commits, panel_commits, mode_switches;
+    // What the last stress step started from
+    uint64_t step_start, step_cpu, step_widget_commits, step_panel_commits;
+} widget_stats;
+
+struct surface {
+    struct wl_surface *surface;
+    struct wl_egl_window *egl_window;
+    EGLSurface egl_surface;
+    struct shm_pool *shm_pool;
+    int width, height;
+    // Only used on the single-pixel path, the buffer is kept until the colour changes
+    struct wp_viewport *viewport;
+    struct wl_buffer *solid_buffer;
+    // What is currently on screen, and what changed since the last frame
+    float color[3];
+    struct damage damage;
+    struct frame_scheduler *scheduler;
+    // Drawn over the colour, NULL for none
+    struct rect_batch *rects;
+};
+
+// HELLO_WAYLAND_WIDGETS subsurfaces are laid out as a grid over the layer surface, each with
+// its own buffers and frame callbacks so that one widget changing never redraws another
+#define MAX_WIDGETS 4096
+#define WIDGET_MARGIN 20
+#define WIDGET_GAP 4
+// A widget that updates more often than this goes desync, so its commits show up on their own
+// instead of waiting for, and costing, a commit of the layer surface
+#define DESYNC_BELOW_NS 100000000ull
+// and goes back to sync once it is slower than this, so its updates stay atomic with the panel
+#define SYNC_ABOVE_NS 250000000ull
+// How often stress mode reports and doubles the number of widgets
+#define STRESS_STEP_NS 1000000000ull
+
+struct widget {
+    struct surface *surface;
+    struct wl_subsurface *subsurface;
+    int x, y;
+    char desync;
+    // The content changed and has not been drawn yet
+    char dirty;
+    // The size changed or the last draw found no free buffer, redrawn without counting as an
+    // update
+    char resized;
+    // Which of the two colours it should show
+    char phase;
+    // Set while a frame is in flight, the next draw waits for it to be done
+    struct wl_callback *frame_callback;
+    // Smoothed time between draws, picks the mode
+    uint64_t last_drawn, interval;
+    // Stress mode only, how often the content changes and when it next does
+    uint64_t period, next_update;
+};
 
 struct window {
     struct {
-        struct wl_surface *surface;
+        struct surface *surface;
         struct zwlr_layer_surface_v1 *layer_surface;
-        struct wl_egl_window *egl_window;
-        EGLSurface egl_surface;
+        // The newest configure, acked and drawn at draw_at
+        char configure_pending;
+        // The last draw found every shm buffer still held by the compositor, it is retried
+        // after the dispatch that brings the release
+        char redraw;
+        uint32_t configure_serial;
+        int pending_width, pending_height;
+        uint64_t draw_at;
     } main;
-    struct {
-        struct wl_surface *surface;
-        struct wl_subsurface *subsurface;
-        struct wl_egl_window *egl_window;
-        EGLSurface egl_surface;
-    } subsurface;
+    // Nothing is drawn before the first configure
+    char configured;
+    // A widget was added or moved, which only takes effect on a commit of the layer surface
+    char layout_changed;
+    struct widget *widgets;
+    int widget_count;
 };
 
-static void draw_surface (EGLSurface surface, float r, float g, float b) {
-    eglMakeCurrent (egl_display, surface, surface, egl_context);
+static struct surface *create_surface (int width, int height) {
+    struct surface *surface = malloc (sizeof (struct surface));
+    memset (surface, 0, sizeof (struct surface));
+    surface->surface = wl_compositor_create_surface (compositor);
+    surface->width = width;
+    surface->height = height;
+    surface->scheduler = frame_scheduler_create ();
+    damage_add (&surface->damage, 0, 0, width, height);
+    if (use_single_pixel) {
+        surface->viewport = wp_viewporter_get_viewport (viewporter, surface->surface);
+        return surface;
+    }
+    if (use_shm) {
+        surface->shm_pool = shm_pool_create (shm);
+        return surface;
+    }
+    surface->egl_window = wl_egl_window_create (surface->surface, width, height);
+    surface->egl_surface = eglCreateWindowSurface (egl_display, egl_config, surface->egl_window, NULL);
+    // Widgets pace themselves with frame callbacks, a swap must never wait for one
+    eglMakeCurrent (egl_display, surface->egl_surface, surface->egl_surface, egl_context);
+    eglSwapInterval (egl_display, 0);
+    return surface;
+}
+
+static void resize_surface (struct surface *surface, int width, int height) {
+    if (width != surface->width || height != surface->height)
+        damage_add (&surface->damage, 0, 0, width, height);
+    surface->width = width;
+    surface->height = height;
+    if (surface->egl_window)
+        wl_egl_window_resize (surface->egl_window, width, height, 0, 0);
+}
+
+// Maps a colour channel in [0, 1] onto the full 32-bit range single-pixel buffers use
+static uint32_t single_pixel_channel (float value) {
+    return (uint32_t)((double)value * UINT32_MAX);
+}
+
+// The grid follows the surface size, a shade darker than the background. Every cell is set
+// on every frame, the batch skips unchanged ones.
+static void update_rects (struct surface *surface, float r, float g, float b) {
+    rect_grid_layout (surface->rects, surface->width, surface->height);
+    uint32_t cell = shm_pixel (r * 0.8f, g * 0.8f, b * 0.8f);
+    for (int i = 0; i < rect_batch_count (surface->rects); i++)
+        rect_batch_set_color (surface->rects, i, cell);
+    struct rect changed = rect_batch_take_damage (surface->rects);
+    if (!rect_empty (changed))
+        damage_add (&surface->damage, changed.x, changed.y, changed.width, changed.height);
+}
+
+// Returns 0 if nothing was committed
+static int draw_surface (struct surface *surface, float r, float g, float b) {
+    char color_changed = surface->color[0] != r || surface->color[1] != g || surface->color[2] != b;
+    if (color_changed) {
+        surface->color[0] = r;
+        surface->color[1] = g;
+        surface->color[2] = b;
+        damage_add (&surface->damage, 0, 0, surface->width, surface->height);
+    }
+    if (surface->rects)
+        update_rects (surface, r, g, b);
+    // Nothing changed on screen, the commit only carries other state such as an acked configure
+    if (rect_empty (surface->damage.pending)) {
+        wl_surface_commit (surface->surface);
+        return 1;
+    }
+    if (surface->viewport) {
+        // Still the surface's current buffer until the commit below replaces it
+        struct wl_buffer *old_buffer = NULL;
+        if (!surface->solid_buffer || color_changed) {
+            old_buffer = surface->solid_buffer;
+            surface->solid_buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer (
+                single_pixel_buffer_manager,
+                single_pixel_channel (r),
+                single_pixel_channel (g),
+                single_pixel_channel (b),
+                UINT32_MAX);
+        }
+        wl_surface_attach (surface->surface, surface->solid_buffer, 0, 0);
+        wp_viewport_set_destination (surface->viewport, surface->width, surface->height);
+        wl_surface_damage (surface->surface, 0, 0, surface->width, surface->height);
+        frame_stats_commit (surface->surface, 0, frame_scheduler_target (surface->scheduler));
+        wl_surface_commit (surface->surface);
+        if (old_buffer)
+            wl_buffer_destroy (old_buffer);
+        damage_submitted (&surface->damage);
+        return 1;
+    }
+    if (surface->shm_pool) {
+        struct shm_buffer *buffer = shm_pool_acquire (surface->shm_pool, surface->width, surface->height);
+        // Every slot is still on screen or queued in the compositor, the damage waits for the next frame
+        if (!buffer)
+            return 0;
+        struct rect repaint = damage_repaint_region (&surface->damage, buffer->age, buffer->width, buffer->height);
+        shm_fill (buffer->data, buffer->stride, repaint.x, repaint.y, repaint.width, repaint.height, shm_pixel (r, g, b));
+        if (surface->rects)
+            rect_batch_draw_shm (surface->rects, buffer->data, buffer->stride, repaint);
+        wl_surface_attach (surface->surface, buffer->buffer, 0, 0);
+        damage_surface (surface->surface, &surface->damage);
+        frame_stats_commit (surface->surface, 0, frame_scheduler_target (surface->scheduler));
+        wl_surface_commit (surface->surface);
+        damage_submitted (&surface->damage);
+        return 1;
+    }
+    eglMakeCurrent (egl_display, surface->egl_surface, surface->egl_surface, egl_context);
+    // Only the parts of the reused back buffer that are out of date get painted again
+    struct rect repaint = damage_repaint_region (&surface->damage, damage_egl_buffer_age (egl_display, surface->egl_surface), surface->width, surface->height);
+    glEnable (GL_SCISSOR_TEST);
+    glScissor (repaint.x, surface->height - repaint.y - repaint.height, repaint.width, repaint.height);
     glClearColor (r, g, b, 1.0);
     glClear (GL_COLOR_BUFFER_BIT);
-    eglSwapBuffers (egl_display, surface);
+    if (surface->rects)
+        rect_batch_draw_gl (surface->rects, surface->width, surface->height);
+    glDisable (GL_SCISSOR_TEST);
+    frame_stats_commit (surface->surface, 0, frame_scheduler_target (surface->scheduler));
+    damage_egl_swap (egl_display, surface->egl_surface, &surface->damage, surface->height);
+    damage_submitted (&surface->damage);
+    return 1;
+}
+
+static void destroy_surface (struct surface *surface) {
+    if (surface->viewport) {
+        if (surface->solid_buffer)
+            wl_buffer_destroy (surface->solid_buffer);
+        wp_viewport_destroy (surface->viewport);
+    } else if (surface->shm_pool) {
+        shm_pool_destroy (surface->shm_pool);
+    } else {
+        eglDestroySurface (egl_display, surface->egl_surface);
+        wl_egl_window_destroy (surface->egl_window);
+    }
+    if (surface->rects)
+        rect_batch_destroy (surface->rects);
+    wl_surface_destroy (surface->surface);
+    frame_scheduler_destroy (surface->scheduler);
+    free (surface);
 }
 
 // listeners
 static void registry_add_object (void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
+    TRACE_LISTENER (wl_registry, 0, registry);
     if (!strcmp(interface, wl_compositor_interface.name)) {
-        compositor = wl_registry_bind (registry, name, &wl_compositor_interface, 1);
+        // version 4 adds damage_buffer
+        compositor = wl_registry_bind (registry, name, &wl_compositor_interface, version < 4 ? version : 4);
     }
     if (!strcmp(interface, wl_subcompositor_interface.name)) {
         subcompositor = wl_registry_bind (registry, name, &wl_subcompositor_interface, 1);
@@ -48,84 +274,389 @@ static void registry_add_object (void *data, struct wl_registry *registry, uint3
     else if (!strcmp(interface, zwlr_layer_shell_v1_interface.name)) {
         layer_shell = wl_registry_bind (registry, name, &zwlr_layer_shell_v1_interface, 1);
     }
+    else if (!strcmp(interface, wl_shm_interface.name)) {
+        shm = wl_registry_bind (registry, name, &wl_shm_interface, 1);
+    }
+    else if (!strcmp(interface, wp_viewporter_interface.name)) {
+        viewporter = wl_registry_bind (registry, name, &wp_viewporter_interface, 1);
+    }
+    else if (!strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name)) {
+        single_pixel_buffer_manager = wl_registry_bind (registry, name, &wp_single_pixel_buffer_manager_v1_interface, 1);
+    }
+    else if (!strcmp(interface, wp_presentation_interface.name)) {
+        frame_stats_set_presentation (wl_registry_bind (registry, name, &wp_presentation_interface, 1));
+    }
 }
 static void registry_remove_object (void *data, struct wl_registry *registry, uint32_t name) {}
 static struct wl_registry_listener registry_listener = {&registry_add_object, &registry_remove_object};
 
 void layer_surface_configure (void *data, struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1, uint32_t serial, uint32_t width, uint32_t height) {
+    TRACE_LISTENER (zwlr_layer_surface_v1, 0, zwlr_layer_surface_v1);
     struct window *window = data;
-    zwlr_layer_surface_v1_ack_configure (window->main.layer_surface, serial);
-    wl_egl_window_resize (window->main.egl_window, width, height, 0, 0);
-    draw_surface (window->main.egl_surface, 0.0, 0.5, 1.0);
+    // Drawn by draw_window() once the scheduled time comes, a configure that arrives before
+    // then replaces this one
+    window->main.configure_pending = 1;
+    window->main.configure_serial = serial;
+    window->main.pending_width = width;
+    window->main.pending_height = height;
+}
+void layer_surface_closed (void *data, struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1) {
+    TRACE_LISTENER (zwlr_layer_surface_v1, 1, zwlr_layer_surface_v1);
+    running = 0;
 }
-void layer_surface_closed (void *data, struct zwlr_layer_surface_v1 *zwlr_layer_surface_v1) {}
 
 static struct zwlr_layer_surface_v1_listener layer_surface_listener = {&layer_surface_configure, &layer_surface_closed};
 
+static void handle_terminate (void *data, int signal_number) {
+    running = 0;
+}
+
+static void widget_stats_dump (FILE *file) {
+    fprintf (file, "widgets: %llu widget commits, %llu panel commits, %llu mode switches\n",
+        (unsigned long long)widget_stats.widget_commits,
+        (unsigned long long)widget_stats.panel_commits,
+        (unsigned long long)widget_stats.mode_switches);
+    fflush (file);
+}
+
+static void handle_dump_stats (void *data, int signal_number) {
+    frame_stats_dump (stderr);
+    frame_scheduler_dump (stderr);
+    rect_renderer_dump (stderr);
+    widget_stats_dump (stderr);
+}
+
+static void handle_toggle_trace (void *data, int signal_number) {
+    trace_toggle ();
+}
+
+// draw_window() runs after every dispatch, the timer only has to wake the loop up
+static void handle_draw_timer (void *data) {
+}
+
+static uint64_t monotonic_ns (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns (void) {
+    struct timespec ts;
+    clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void widget_frame_done (void *data, struct wl_callback *callback, uint32_t time) {
+    TRACE_LISTENER (wl_callback, 0, callback);
+    struct widget *widget = data;
+    wl_callback_destroy (callback);
+    widget->frame_callback = NULL;
+}
+static struct wl_callback_listener widget_frame_listener = {&widget_frame_done};
+
+// Square-ish grid inside the margin, widgets that moved need a commit of the layer surface and
+// widgets that changed size are redrawn
+static void layout_widgets (struct window *window) {
+    struct surface *main = window->main.surface;
+    int columns = 1;
+    while (columns * columns < window->widget_count)
+        columns++;
+    int rows = (window->widget_count + columns - 1) / columns;
+    int cell_width = (main->width - 2 * WIDGET_MARGIN + WIDGET_GAP) / columns;
+    int cell_height = (main->height - 2 * WIDGET_MARGIN + WIDGET_GAP) / rows;
+    int width = cell_width - WIDGET_GAP > 1 ? cell_width - WIDGET_GAP : 1;
+    int height = cell_height - WIDGET_GAP > 1 ? cell_height - WIDGET_GAP : 1;
+    for (int i = 0; i < window->widget_count; i++) {
+        struct widget *widget = &window->widgets[i];
+        int x = WIDGET_MARGIN + i % columns * cell_width;
+        int y = WIDGET_MARGIN + i / columns * cell_height;
+        if (x != widget->x || y != widget->y) {
+            wl_subsurface_set_position (widget->subsurface, x, y);
+            widget->x = x;
+            widget->y = y;
+            window->layout_changed = 1;
+        }
+        if (width != widget->surface->width || height != widget->surface->height) {
+            resize_surface (widget->surface, width, height);
+            widget->resized = 1;
+        }
+    }
+}
+
+// Added widgets start out sync, like every subsurface, and are drawn on the next pass
+static void add_widgets (struct window *window, int count) {
+    static const uint64_t periods[] = {8000000, 16000000, 33000000, 100000000, 250000000, 1000000000};
+    uint64_t now = monotonic_ns ();
+    while (window->widget_count < count) {
+        struct widget *widget = &window->widgets[window->widget_count];
+        memset (widget, 0, sizeof (struct widget));
+        widget->surface = create_surface (1, 1);
+        widget->subsurface = wl_subcompositor_get_subsurface (subcompositor, widget->surface->surface, window->main.surface->surface);
+        // Not placed yet, layout_widgets() always sets the position
+        widget->x = widget->y = -1;
+        widget->dirty = 1;
+        widget->period = periods[window->widget_count % (sizeof (periods) / sizeof (periods[0]))];
+        widget->next_update = now + widget->period;
+        window->widget_count++;
+    }
+    layout_widgets (window);
+}
+
+// Called with every draw, the mode follows how often the widget has been changing lately
+static void update_widget_mode (struct widget *widget, uint64_t now) {
+    if (widget->last_drawn) {
+        uint64_t gap = now - widget->last_drawn;
+        widget->interval = widget->interval ? (widget->interval * 3 + gap) / 4 : gap;
+    }
+    widget->last_drawn = now;
+    if (!widget->desync && widget->interval && widget->interval < DESYNC_BELOW_NS) {
+        wl_subsurface_set_desync (widget->subsurface);
+        widget->desync = 1;
+        widget_stats.mode_switches++;
+    } else if (widget->desync && widget->interval > SYNC_ABOVE_NS) {
+        wl_subsurface_set_sync (widget->subsurface);
+        widget->desync = 0;
+        widget_stats.mode_switches++;
+    }
+}
+
+// Returns 0 if nothing was committed, because the widget already shows what it should or
+// has no free buffer to draw into
+static int draw_widget (struct widget *widget, uint64_t now) {
+    static const float colors[2][3] = {{0.0, 1.0, 0.5}, {1.0, 0.5, 0.0}};
+    const float *color = colors[(int)widget->phase];
+    struct surface *surface = widget->surface;
+    if (widget->dirty)
+        update_widget_mode (widget, now);
+    widget->dirty = 0;
+    widget->resized = 0;
+    // Flipped back before the last change was drawn
+    if (!memcmp (surface->color, color, sizeof (surface->color)) && rect_empty (surface->damage.pending))
+        return 0;
+    widget->frame_callback = wl_surface_frame (surface->surface);
+    wl_callback_add_listener (widget->frame_callback, &widget_frame_listener, widget);
+    if (!draw_surface (surface, color[0], color[1], color[2])) {
+        // No shm buffer was free, so the callback never went out with a commit. The widget is
+        // left to be drawn after the dispatch that brings the release, without counting the
+        // change towards its mode a second time.
+        wl_callback_destroy (widget->frame_callback);
+        widget->frame_callback = NULL;
+        widget->resized = 1;
+        return 0;
+    }
+    widget_stats.widget_commits++;
+    return 1;
+}
+
+// Stress mode, flips the widgets whose time has come and sleeps until the next one is due
+static void handle_update_timer (void *data) {
+    struct window *window = data;
+    uint64_t now = monotonic_ns ();
+    uint64_t next = 0;
+    for (int i = 0; i < window->widget_count; i++) {
+        struct widget *widget = &window->widgets[i];
+        if (widget->next_update <= now) {
+            widget->phase = !widget->phase;
+            widget->dirty = 1;
+            // Updates missed while the loop was busy are skipped, not caught up on
+            widget->next_update += (now - widget->next_update) / widget->period * widget->period + widget->period;
+        }
+        if (!next || widget->next_update < next)
+            next = widget->next_update;
+    }
+    event_source_timer_update (update_timer, next > now ? next - now : 1);
+}
+
+// Stress mode, reports the step that just ended and doubles the widget count for the next one
+static void handle_stress_timer (void *data) {
+    struct window *window = data;
+    uint64_t now = monotonic_ns ();
+    uint64_t cpu = cpu_ns ();
+    double seconds = (now - widget_stats.step_start) / 1e9;
+    uint64_t widget_commits = widget_stats.widget_commits - widget_stats.step_widget_commits;
+    uint64_t panel_commits = widget_stats.panel_commits - widget_stats.step_panel_commits;
+    int desync = 0;
+    for (int i = 0; i < window->widget_count; i++)
+        desync += window->widgets[i].desync;
+    fprintf (stderr, "stress: %d widgets (%d desync), %.0f commits/s (%.0f widget, %.0f panel), %.2f ms cpu/s\n",
+        window->widget_count,
+        desync,
+        (widget_commits + panel_commits) / seconds,
+        widget_commits / seconds,
+        panel_commits / seconds,
+        (cpu - widget_stats.step_cpu) / 1e6 / seconds);
+    fflush (stderr);
+    widget_stats.step_start = now;
+    widget_stats.step_cpu = cpu;
+    widget_stats.step_widget_commits = widget_stats.widget_commits;
+    widget_stats.step_panel_commits = widget_stats.panel_commits;
+    if (window->widget_count < max_widgets && window->configured) {
+        add_widgets (window, window->widget_count * 2 < max_widgets ? window->widget_count * 2 : max_widgets);
+        handle_update_timer (window);
+    }
+    event_source_timer_update (stress_timer, STRESS_STEP_NS);
+}
+
+// Acks and applies the newest configure just before the compositor's deadline for the refresh
+// it can still make, returns 1 if it did
+static int apply_configure (struct window *window, uint64_t now) {
+    if (!window->main.configure_pending)
+        return 0;
+    struct surface *surface = window->main.surface;
+    if (!window->main.draw_at)
+        window->main.draw_at = now + frame_scheduler_delay (surface->scheduler, now);
+    if (window->main.draw_at > now) {
+        event_source_timer_update (draw_timer, window->main.draw_at - now);
+        return 0;
+    }
+    window->main.draw_at = 0;
+    window->main.configure_pending = 0;
+    window->configured = 1;
+    zwlr_layer_surface_v1_ack_configure (window->main.layer_surface, window->main.configure_serial);
+    resize_surface (surface, window->main.pending_width, window->main.pending_height);
+    layout_widgets (window);
+    return 1;
+}
+
+// Runs after every dispatch. Only widgets that changed and are not waiting for a frame are
+// drawn. Desync widgets show up on their own commit; sync ones, along with a configure and any
+// moved subsurfaces, are all applied by one commit of the layer surface.
+static void draw_window (struct window *window) {
+    struct surface *main = window->main.surface;
+    uint64_t now = monotonic_ns ();
+    char configure = apply_configure (window, now);
+    if (!window->configured)
+        return;
+    if (configure)
+        frame_scheduler_begin (main->scheduler, now);
+    char panel_commit = window->layout_changed;
+    window->layout_changed = 0;
+    for (int i = 0; i < window->widget_count; i++) {
+        struct widget *widget = &window->widgets[i];
+        if (!(widget->dirty || widget->resized) || widget->frame_callback)
+            continue;
+        if (draw_widget (widget, now) && !widget->desync)
+            panel_commit = 1;
+    }
+    if (configure || window->main.redraw) {
+        // Its commit applies the sync widgets drawn above as well. If no buffer was free the
+        // ack goes out with the plain commit below instead, and the panel is drawn later.
+        window->main.redraw = !draw_surface (main, 0.0, 0.5, 1.0);
+        if (window->main.redraw) {
+            panel_commit |= configure;
+        } else {
+            panel_commit = 0;
+            widget_stats.panel_commits++;
+        }
+        if (configure)
+            frame_scheduler_end (main->scheduler, monotonic_ns ());
+    }
+    if (panel_commit) {
+        wl_surface_commit (main->surface);
+        widget_stats.panel_commits++;
+    }
+}
+
+// Nothing waits for the compositor here, the first configure is drawn by draw_window()
 static void create_window (struct window *window, int32_t width, int32_t height) {
-    window->main.surface = wl_compositor_create_surface (compositor);
+    window->main.surface = create_surface (width, height);
+    if (rect_count)
+        window->main.surface->rects = rect_batch_create (rect_count);
     window->main.layer_surface = zwlr_layer_shell_v1_get_layer_surface (
         layer_shell,
-        window->main.surface,
+        window->main.surface->surface,
         NULL,
         ZWLR_LAYER_SHELL_V1_LAYER_TOP,
         "example");
     zwlr_layer_surface_v1_set_size (window->main.layer_surface, width, height);
     zwlr_layer_surface_v1_add_listener (window->main.layer_surface, &layer_surface_listener, window);
-    window->main.egl_window = wl_egl_window_create (window->main.surface, width, height);
-    window->main.egl_surface = eglCreateWindowSurface (egl_display, egl_config, window->main.egl_window, NULL);
-    wl_surface_commit (window->main.surface);
-
-    window->subsurface.surface = wl_compositor_create_surface (compositor);
-    window->subsurface.subsurface = wl_subcompositor_get_subsurface (
-        subcompositor,
-        window->subsurface.surface,
-        window->main.surface);
-    wl_subsurface_set_desync (window->subsurface.subsurface);
-    wl_subsurface_set_position (window->subsurface.subsurface, 100, 100);
-    window->subsurface.egl_window = wl_egl_window_create (window->subsurface.surface, width - 40, height - 40);
-    window->subsurface.egl_surface = eglCreateWindowSurface (egl_display, egl_config, window->subsurface.egl_window, NULL);
-    wl_surface_commit (window->subsurface.surface);
-    wl_display_roundtrip(display);
-    draw_surface (window->subsurface.egl_surface, 0.0, 1.0, 0.5);
-    wl_display_roundtrip(display);
+    wl_surface_commit (window->main.surface->surface);
+
+    window->widgets = malloc (max_widgets * sizeof (struct widget));
+    add_widgets (window, stress ? 1 : max_widgets);
 }
 static void delete_window (struct window *window) {
-    eglDestroySurface (egl_display, window->main.egl_surface);
-    wl_egl_window_destroy (window->main.egl_window);
+    for (int i = 0; i < window->widget_count; i++) {
+        struct widget *widget = &window->widgets[i];
+        if (widget->frame_callback)
+            wl_callback_destroy (widget->frame_callback);
+        wl_subsurface_destroy (widget->subsurface);
+        destroy_surface (widget->surface);
+    }
+    free (window->widgets);
     zwlr_layer_surface_v1_destroy (window->main.layer_surface);
-    wl_surface_destroy (window->main.surface);
+    destroy_surface (window->main.surface);
 }
 
 int main () {
+    trace_init ();
     display = wl_display_connect (NULL);
+    enum backend backend = backend_from_env ();
+    // EGL comes up while the registry round trip runs, started on the chance that it is
+    // needed unless the user asked for shm
+    struct egl_startup *egl_startup = backend != BACKEND_SHM ? egl_startup_begin (display) : NULL;
     struct wl_registry *registry = wl_display_get_registry (display);
     wl_registry_add_listener (registry, &registry_listener, NULL);
     wl_display_roundtrip (display);
 
-    egl_display = eglGetDisplay (display);
-    eglInitialize (egl_display, NULL, NULL);
+    rect_count = rect_count_from_env ();
+    const char *widgets = getenv ("HELLO_WAYLAND_WIDGETS");
+    const char *stress_env = getenv ("HELLO_WAYLAND_STRESS");
+    stress = stress_env && atoi (stress_env);
+    max_widgets = widgets ? atoi (widgets) : stress ? 64 : 1;
+    if (max_widgets < 1)
+        max_widgets = 1;
+    if (max_widgets > MAX_WIDGETS)
+        max_widgets = MAX_WIDGETS;
+    // A single-pixel buffer can only show the background
+    use_single_pixel = backend == BACKEND_AUTO && viewporter && single_pixel_buffer_manager && !rect_count;
+    use_shm = backend == BACKEND_SHM;
+    if (use_shm && !shm) {
+        fprintf (stderr, "compositor has no wl_shm, falling back to EGL\n");
+        use_shm = 0;
+        egl_startup = egl_startup_begin (display);
+    }
+
+    if (egl_startup) {
+        // Joined even when EGL turned out not to be needed, it is torn down again at exit
+        egl_startup_finish (egl_startup, &egl_display, &egl_config, &egl_context);
+        damage_init_egl (egl_display);
+    }
 
-    eglBindAPI (EGL_OPENGL_API);
-    EGLint attributes[] = {
-        EGL_RED_SIZE, 8,
-        EGL_GREEN_SIZE, 8,
-        EGL_BLUE_SIZE, 8,
-    EGL_NONE};
-    EGLint num_config;
-    eglChooseConfig (egl_display, attributes, &egl_config, 1, &num_config);
-    egl_context = eglCreateContext (egl_display, egl_config, EGL_NO_CONTEXT, NULL);
+    struct event_loop *loop = event_loop_create (display);
+    event_loop_add_signal (loop, SIGINT, &handle_terminate, NULL);
+    event_loop_add_signal (loop, SIGTERM, &handle_terminate, NULL);
+    event_loop_add_signal (loop, SIGUSR1, &handle_dump_stats, NULL);
+    event_loop_add_signal (loop, SIGUSR2, &handle_toggle_trace, NULL);
+    draw_timer = event_loop_add_timer (loop, &handle_draw_timer, NULL);
 
     struct window window;
+    memset (&window, 0, sizeof (window));
     create_window (&window, 300, 300);
-
-    while (running) {
-        wl_display_dispatch_pending (display);
+    if (stress) {
+        update_timer = event_loop_add_timer (loop, &handle_update_timer, &window);
+        stress_timer = event_loop_add_timer (loop, &handle_stress_timer, &window);
+        handle_update_timer (&window);
+        widget_stats.step_start = monotonic_ns ();
+        widget_stats.step_cpu = cpu_ns ();
+        event_source_timer_update (stress_timer, STRESS_STEP_NS);
     }
 
+    while (running && event_loop_dispatch (loop, -1) != -1)
+        draw_window (&window);
+
+    frame_stats_dump (stderr);
+    frame_scheduler_dump (stderr);
+    rect_renderer_dump (stderr);
+    widget_stats_dump (stderr);
     delete_window (&window);
-    eglDestroyContext (egl_display, egl_context);
-    eglTerminate (egl_display);
+    event_loop_destroy (loop);
+    frame_stats_destroy ();
+    if (egl_display != EGL_NO_DISPLAY) {
+        eglDestroyContext (egl_display, egl_context);
+        eglTerminate (egl_display);
+    }
+    trace_finish ();
     wl_display_disconnect (display);
     return 0;
 }
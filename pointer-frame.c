@@ -0,0 +1,180 @@
+#include "pointer-frame.h"
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+struct pointer_tracker {
+    struct wl_pointer *pointer;
+    pointer_frame_func_t func;
+    void *data;
+    // Set when the seat sends wl_pointer.frame, otherwise every event is flushed on its own
+    char has_frames;
+    // Set when the current frame has events that have not been handed over yet
+    char pending;
+    struct pointer_frame frame;
+    // Storage behind frame.motions and frame.buttons, kept between frames so a steady stream
+    // of motion does not allocate
+    struct pointer_motion *motions;
+    int motion_capacity;
+    struct pointer_button *buttons;
+    int button_capacity;
+};
+
+static void *grow(void *array, int *capacity, int count, size_t size) {
+    if (count < *capacity)
+        return array;
+    *capacity = *capacity ? *capacity * 2 : 16;
+    return realloc(array, *capacity * size);
+}
+
+// Hands the finished frame over and starts the next one, keeping focus and position
+static void flush(struct pointer_tracker *tracker) {
+    if (!tracker->pending)
+        return;
+    tracker->frame.motions = tracker->motions;
+    tracker->frame.buttons = tracker->buttons;
+    tracker->func(tracker->data, tracker->pointer, &tracker->frame);
+
+    struct pointer_frame *frame = &tracker->frame;
+    frame->entered = 0;
+    frame->left = NULL;
+    frame->moved = 0;
+    frame->motion_count = 0;
+    frame->button_count = 0;
+    frame->axis_mask = 0;
+    memset(frame->axis, 0, sizeof(frame->axis));
+    memset(frame->axis_discrete, 0, sizeof(frame->axis_discrete));
+    memset(frame->axis_stop, 0, sizeof(frame->axis_stop));
+    tracker->pending = 0;
+}
+
+// Seats older than version 5 never send wl_pointer.frame, so each event ends its own frame
+static void event_done(struct pointer_tracker *tracker) {
+    tracker->pending = 1;
+    if (!tracker->has_frames)
+        flush(tracker);
+}
+
+static void add_motion(struct pointer_tracker *tracker, uint32_t time, wl_fixed_t x, wl_fixed_t y) {
+    struct pointer_frame *frame = &tracker->frame;
+    tracker->motions = grow(tracker->motions, &tracker->motion_capacity, frame->motion_count, sizeof(struct pointer_motion));
+    tracker->motions[frame->motion_count++] = (struct pointer_motion){time, x, y};
+    frame->moved = 1;
+    frame->time = time;
+    frame->x = x;
+    frame->y = y;
+}
+
+static void pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface, wl_fixed_t surface_x, wl_fixed_t surface_y) {
+    TRACE_LISTENER(wl_pointer, 0, wl_pointer);
+    struct pointer_tracker *tracker = data;
+    tracker->frame.focus = surface;
+    tracker->frame.entered = 1;
+    tracker->frame.enter_serial = serial;
+    // Positions from earlier in the frame belong to the surface that was left, enter itself
+    // carries no timestamp so it reuses the last one
+    tracker->frame.motion_count = 0;
+    add_motion(tracker, tracker->frame.time, surface_x, surface_y);
+    event_done(tracker);
+}
+
+static void pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface) {
+    TRACE_LISTENER(wl_pointer, 1, wl_pointer);
+    struct pointer_tracker *tracker = data;
+    // surface is NULL if it was destroyed, there is only one focus either way
+    tracker->frame.left = surface;
+    tracker->frame.focus = NULL;
+    event_done(tracker);
+}
+
+static void pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time, wl_fixed_t surface_x, wl_fixed_t surface_y) {
+    TRACE_LISTENER(wl_pointer, 2, wl_pointer);
+    struct pointer_tracker *tracker = data;
+    add_motion(tracker, time, surface_x, surface_y);
+    event_done(tracker);
+}
+
+static void pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state) {
+    TRACE_LISTENER(wl_pointer, 3, wl_pointer);
+    struct pointer_tracker *tracker = data;
+    struct pointer_frame *frame = &tracker->frame;
+    tracker->buttons = grow(tracker->buttons, &tracker->button_capacity, frame->button_count, sizeof(struct pointer_button));
+    tracker->buttons[frame->button_count++] = (struct pointer_button){serial, time, button, state};
+    event_done(tracker);
+}
+
+static void pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis, wl_fixed_t value) {
+    TRACE_LISTENER(wl_pointer, 4, wl_pointer);
+    struct pointer_tracker *tracker = data;
+    if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+        return;
+    tracker->frame.axis_mask |= 1 << axis;
+    tracker->frame.axis[axis] += value;
+    event_done(tracker);
+}
+
+static void pointer_frame(void *data, struct wl_pointer *wl_pointer) {
+    TRACE_LISTENER(wl_pointer, 5, wl_pointer);
+    struct pointer_tracker *tracker = data;
+    flush(tracker);
+}
+
+static void pointer_axis_source(void *data, struct wl_pointer *wl_pointer, uint32_t axis_source) {
+    TRACE_LISTENER(wl_pointer, 6, wl_pointer);
+    struct pointer_tracker *tracker = data;
+    tracker->frame.axis_source = axis_source;
+}
+
+static void pointer_axis_stop(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis) {
+    TRACE_LISTENER(wl_pointer, 7, wl_pointer);
+    struct pointer_tracker *tracker = data;
+    if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+        return;
+    tracker->frame.axis_mask |= 1 << axis;
+    tracker->frame.axis_stop[axis] = 1;
+    event_done(tracker);
+}
+
+static void pointer_axis_discrete(void *data, struct wl_pointer *wl_pointer, uint32_t axis, int32_t discrete) {
+    TRACE_LISTENER(wl_pointer, 8, wl_pointer);
+    struct pointer_tracker *tracker = data;
+    if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+        return;
+    tracker->frame.axis_discrete[axis] += discrete;
+}
+
+// Named so the listener builds against any libwayland header, older ones end at axis_discrete.
+// axis_value120 and axis_relative_direction need seat versions above POINTER_FRAME_SEAT_VERSION
+// and stay NULL.
+static struct wl_pointer_listener pointer_listener = {
+    .enter = &pointer_enter,
+    .leave = &pointer_leave,
+    .motion = &pointer_motion,
+    .button = &pointer_button,
+    .axis = &pointer_axis,
+    .frame = &pointer_frame,
+    .axis_source = &pointer_axis_source,
+    .axis_stop = &pointer_axis_stop,
+    .axis_discrete = &pointer_axis_discrete,
+};
+
+struct pointer_tracker *pointer_tracker_create(struct wl_seat *seat, pointer_frame_func_t func, void *data) {
+    struct pointer_tracker *tracker = malloc(sizeof(struct pointer_tracker));
+    memset(tracker, 0, sizeof(struct pointer_tracker));
+    tracker->func = func;
+    tracker->data = data;
+    tracker->has_frames = wl_seat_get_version(seat) >= WL_POINTER_FRAME_SINCE_VERSION;
+    tracker->pointer = wl_seat_get_pointer(seat);
+    wl_pointer_add_listener(tracker->pointer, &pointer_listener, tracker);
+    return tracker;
+}
+
+void pointer_tracker_destroy(struct pointer_tracker *tracker) {
+    if (wl_pointer_get_version(tracker->pointer) >= WL_POINTER_RELEASE_SINCE_VERSION)
+        wl_pointer_release(tracker->pointer);
+    else
+        wl_pointer_destroy(tracker->pointer);
+    free(tracker->motions);
+    free(tracker->buttons);
+    free(tracker);
+}
@@ -0,0 +1,64 @@
+#ifndef POINTER_FRAME_H
+#define POINTER_FRAME_H
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+// Groups wl_pointer events into the logical frames wl_seat version 5 delimits with
+// wl_pointer.frame, so a 1000 Hz mouse costs one callback per frame instead of one per
+// event. On older seats every event is a frame of its own.
+
+// The highest wl_seat version the tracker understands, bind the seat at most at this
+#define POINTER_FRAME_SEAT_VERSION 5
+
+struct pointer_motion {
+    uint32_t time;
+    wl_fixed_t x, y;
+};
+
+struct pointer_button {
+    uint32_t serial;
+    uint32_t time;
+    uint32_t button;
+    uint32_t state;
+};
+
+struct pointer_frame {
+    // The surface the pointer is over at the end of the frame, NULL if none
+    struct wl_surface *focus;
+    // Set if focus was entered during the frame, enter_serial is what wl_pointer.set_cursor needs
+    char entered;
+    uint32_t enter_serial;
+    // The surface the pointer left during the frame, NULL if none
+    struct wl_surface *left;
+    // Newest position on focus, moved is set if it changed during the frame
+    char moved;
+    uint32_t time;
+    wl_fixed_t x, y;
+    // Every position reported during the frame, oldest first, for consumers that need the
+    // whole path rather than just where it ended
+    const struct pointer_motion *motions;
+    int motion_count;
+    // Buttons in the order they happened, a click can be a press and a release in one frame
+    const struct pointer_button *buttons;
+    int button_count;
+    // Scroll summed per wl_pointer_axis, axis_mask has bit 1 << axis set for axes that scrolled
+    // or stopped
+    uint32_t axis_mask;
+    wl_fixed_t axis[2];
+    int32_t axis_discrete[2];
+    char axis_stop[2];
+    // A wl_pointer_axis_source, only meaningful when axis_mask is non-zero
+    uint32_t axis_source;
+};
+
+struct pointer_tracker;
+
+typedef void (*pointer_frame_func_t)(void *data, struct wl_pointer *pointer, const struct pointer_frame *frame);
+
+// Gets the seat's pointer and calls func once per logical frame. The frame and everything it
+// points to is only valid during the call.
+struct pointer_tracker *pointer_tracker_create(struct wl_seat *seat, pointer_frame_func_t func, void *data);
+void pointer_tracker_destroy(struct pointer_tracker *tracker);
+
+#endif // POINTER_FRAME_H
@@ -0,0 +1,345 @@
+#define GL_GLEXT_PROTOTYPES
+#include "rect-renderer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include "shm-buffer.h"
+
+enum stream {
+    STREAM_GEOMETRY,
+    STREAM_COLOR,
+    STREAM_COUNT,
+};
+
+// Rectangles in [begin, end) changed since the last upload
+struct dirty_range {
+    int begin, end;
+};
+
+struct rect_batch {
+    int count;
+    // x, y, width and height of every rectangle, in surface pixels from the top left
+    int16_t (*geometry)[4];
+    uint32_t *colors;
+    struct rect damage;
+
+    // Created by the first draw, on the thread that has the context. Each array has a buffer
+    // and a buffer texture the vertex shader reads it through.
+    char gl_ready;
+    GLuint vbo[STREAM_COUNT], texture[STREAM_COUNT];
+    struct dirty_range dirty[STREAM_COUNT];
+};
+
+struct rect_stats {
+    uint64_t draws;
+    uint64_t rects;
+    uint64_t uploaded_bytes;
+    // Uploads that replaced a whole buffer, and ones that only wrote the changed range
+    uint64_t orphaned;
+    uint64_t partial;
+};
+
+static struct rect_stats stats;
+
+// One program for every batch, 0 until the first draw and -1 if it could not be built. The
+// shader has no vertex attributes, so one empty vertex array serves every batch.
+static GLint program = 0;
+static GLint viewport_location;
+static GLuint empty_vao;
+// GL_MAX_TEXTURE_BUFFER_SIZE, one texel of each array per rectangle
+static GLint max_rects;
+
+// Six vertices per rectangle, which the shader fetches from the arrays itself. Instancing
+// would upload the same data, but llvmpipe runs its whole vertex pipeline once per instance,
+// which for small rectangles costs three times as much as the one draw.
+static const char *vertex_shader_source =
+    "#version 330\n"
+    "uniform isamplerBuffer geometry;\n"
+    "uniform samplerBuffer colors;\n"
+    "uniform vec2 viewport;\n"
+    "out vec4 fragment_color;\n"
+    "const vec2 corners[6] = vec2[6](vec2(0, 0), vec2(1, 0), vec2(0, 1), vec2(0, 1), vec2(1, 0), vec2(1, 1));\n"
+    "void main() {\n"
+    "    int index = gl_VertexID / 6;\n"
+    "    vec4 rect = vec4(texelFetch(geometry, index));\n"
+    "    vec2 position = rect.xy + corners[gl_VertexID - index * 6] * rect.zw;\n"
+    "    // XRGB8888 is B, G, R, X in memory on little-endian hosts\n"
+    "    fragment_color = vec4(texelFetch(colors, index).bgr, 1.0);\n"
+    "    gl_Position = vec4(position / viewport * vec2(2.0, -2.0) + vec2(-1.0, 1.0), 0.0, 1.0);\n"
+    "}\n";
+
+static const char *fragment_shader_source =
+    "#version 330\n"
+    "in vec4 fragment_color;\n"
+    "out vec4 out_color;\n"
+    "void main() {\n"
+    "    out_color = fragment_color;\n"
+    "}\n";
+
+static void dirty_reset(struct dirty_range *dirty) {
+    dirty->begin = dirty->end = 0;
+}
+
+static void dirty_add(struct dirty_range *dirty, int index) {
+    if (dirty->begin == dirty->end) {
+        dirty->begin = index;
+        dirty->end = index + 1;
+        return;
+    }
+    if (index < dirty->begin)
+        dirty->begin = index;
+    if (index >= dirty->end)
+        dirty->end = index + 1;
+}
+
+struct rect_batch *rect_batch_create(int count) {
+    if (count > RECT_MAX_COUNT)
+        count = RECT_MAX_COUNT;
+    struct rect_batch *batch = calloc(1, sizeof(struct rect_batch));
+    if (!batch)
+        return NULL;
+    batch->count = count;
+    batch->geometry = calloc(count, sizeof(*batch->geometry));
+    batch->colors = calloc(count, sizeof(*batch->colors));
+    if (count && (!batch->geometry || !batch->colors)) {
+        fprintf(stderr, "not enough memory for %d rectangles\n", count);
+        rect_batch_destroy(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+void rect_batch_destroy(struct rect_batch *batch) {
+    free(batch->geometry);
+    free(batch->colors);
+    free(batch);
+}
+
+int rect_batch_count(const struct rect_batch *batch) {
+    return batch->count;
+}
+
+static struct rect batch_rect(const struct rect_batch *batch, int index) {
+    const int16_t *geometry = batch->geometry[index];
+    return (struct rect){geometry[0], geometry[1], geometry[2], geometry[3]};
+}
+
+static void damage_rect(struct rect_batch *batch, int index) {
+    struct rect rect = batch_rect(batch, index);
+    if (!rect_empty(rect))
+        batch->damage = rect_empty(batch->damage) ? rect : rect_union(batch->damage, rect);
+}
+
+static int16_t clamp_coordinate(int value) {
+    return value < -RECT_MAX_COORDINATE ? -RECT_MAX_COORDINATE : value > RECT_MAX_COORDINATE ? RECT_MAX_COORDINATE : value;
+}
+
+void rect_batch_set_rect(struct rect_batch *batch, int index, struct rect rect) {
+    int16_t geometry[4] = {clamp_coordinate(rect.x), clamp_coordinate(rect.y), clamp_coordinate(rect.width), clamp_coordinate(rect.height)};
+    if (!memcmp(batch->geometry[index], geometry, sizeof(geometry)))
+        return;
+    // Both where it was and where it is now have to be repainted
+    damage_rect(batch, index);
+    memcpy(batch->geometry[index], geometry, sizeof(geometry));
+    damage_rect(batch, index);
+    dirty_add(&batch->dirty[STREAM_GEOMETRY], index);
+}
+
+void rect_batch_set_color(struct rect_batch *batch, int index, uint32_t pixel) {
+    if (batch->colors[index] == pixel)
+        return;
+    batch->colors[index] = pixel;
+    damage_rect(batch, index);
+    dirty_add(&batch->dirty[STREAM_COLOR], index);
+}
+
+struct rect rect_batch_take_damage(struct rect_batch *batch) {
+    struct rect damage = batch->damage;
+    batch->damage = (struct rect){0, 0, 0, 0};
+    return damage;
+}
+
+static GLuint compile_shader(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        char log[512];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "rect shader failed to compile: %s\n", log);
+    }
+    return shader;
+}
+
+static int init_program(void) {
+    int major = 0, minor = 0;
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (!version || sscanf(version, "%d.%d", &major, &minor) != 2 || major * 10 + minor < 33) {
+        fprintf(stderr, "rectangles need OpenGL 3.3, the context has %s\n", version ? version : "none");
+        return -1;
+    }
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_shader_source);
+    GLuint linked = glCreateProgram();
+    glAttachShader(linked, vertex_shader);
+    glAttachShader(linked, fragment_shader);
+    glLinkProgram(linked);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    GLint status;
+    glGetProgramiv(linked, GL_LINK_STATUS, &status);
+    if (!status) {
+        fprintf(stderr, "rect shader failed to link\n");
+        glDeleteProgram(linked);
+        return -1;
+    }
+    viewport_location = glGetUniformLocation(linked, "viewport");
+    glUseProgram(linked);
+    glUniform1i(glGetUniformLocation(linked, "geometry"), 0);
+    glUniform1i(glGetUniformLocation(linked, "colors"), 1);
+    glGenVertexArrays(1, &empty_vao);
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_rects);
+    return linked;
+}
+
+static void init_stream(struct rect_batch *batch, enum stream stream, GLenum format, const void *data, size_t size) {
+    glBindBuffer(GL_TEXTURE_BUFFER, batch->vbo[stream]);
+    glBufferData(GL_TEXTURE_BUFFER, batch->count * size, data, GL_DYNAMIC_DRAW);
+    glBindTexture(GL_TEXTURE_BUFFER, batch->texture[stream]);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, batch->vbo[stream]);
+}
+
+static void init_batch(struct rect_batch *batch) {
+    glGenBuffers(STREAM_COUNT, batch->vbo);
+    glGenTextures(STREAM_COUNT, batch->texture);
+    init_stream(batch, STREAM_GEOMETRY, GL_RGBA16I, batch->geometry, sizeof(*batch->geometry));
+    init_stream(batch, STREAM_COLOR, GL_RGBA8, batch->colors, sizeof(*batch->colors));
+    stats.uploaded_bytes += batch->count * (sizeof(*batch->geometry) + sizeof(*batch->colors));
+    dirty_reset(&batch->dirty[STREAM_GEOMETRY]);
+    dirty_reset(&batch->dirty[STREAM_COLOR]);
+}
+
+// Writes the changed range of one array into its buffer. When most of it changed, the old
+// storage is orphaned so the write does not have to wait for a draw that still reads it.
+static void upload(struct rect_batch *batch, enum stream stream, const void *data, size_t size) {
+    struct dirty_range *dirty = &batch->dirty[stream];
+    if (dirty->begin == dirty->end)
+        return;
+    glBindBuffer(GL_TEXTURE_BUFFER, batch->vbo[stream]);
+    int changed = dirty->end - dirty->begin;
+    if (changed * 2 >= batch->count) {
+        glBufferData(GL_TEXTURE_BUFFER, batch->count * size, NULL, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, batch->count * size, data);
+        stats.uploaded_bytes += batch->count * size;
+        stats.orphaned++;
+    } else {
+        glBufferSubData(GL_TEXTURE_BUFFER, dirty->begin * size, changed * size, (const char *)data + dirty->begin * size);
+        stats.uploaded_bytes += changed * size;
+        stats.partial++;
+    }
+    dirty_reset(dirty);
+}
+
+void rect_batch_draw_gl(struct rect_batch *batch, int width, int height) {
+    if (!batch->count)
+        return;
+    if (!program)
+        program = init_program();
+    if (program < 0)
+        return;
+    glUseProgram(program);
+    glUniform2f(viewport_location, width, height);
+    if (!batch->gl_ready) {
+        init_batch(batch);
+        batch->gl_ready = 1;
+    } else {
+        upload(batch, STREAM_GEOMETRY, batch->geometry, sizeof(*batch->geometry));
+        upload(batch, STREAM_COLOR, batch->colors, sizeof(*batch->colors));
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, batch->texture[STREAM_GEOMETRY]);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, batch->texture[STREAM_COLOR]);
+    glActiveTexture(GL_TEXTURE0);
+    glViewport(0, 0, width, height);
+    glBindVertexArray(empty_vao);
+    int count = batch->count < max_rects ? batch->count : max_rects;
+    glDrawArrays(GL_TRIANGLES, 0, count * 6);
+    glBindVertexArray(0);
+    glUseProgram(0);
+    stats.draws++;
+    stats.rects += count;
+}
+
+void rect_batch_draw_shm(const struct rect_batch *batch, uint32_t *data, int stride, struct rect clip) {
+    for (int i = 0; i < batch->count; i++) {
+        struct rect rect = rect_intersect(batch_rect(batch, i), clip);
+        if (!rect_empty(rect))
+            shm_fill(data, stride, rect.x, rect.y, rect.width, rect.height, batch->colors[i]);
+    }
+    stats.draws++;
+    stats.rects += batch->count;
+}
+
+// Columns and rows for count cells, about as many per pixel across as down
+static void grid_size(int count, int width, int height, int *columns, int *rows) {
+    int c = 1;
+    while (c * c * height < count * width && c < count)
+        c++;
+    *columns = c;
+    *rows = (count + c - 1) / c;
+}
+
+void rect_grid_layout(struct rect_batch *batch, int width, int height) {
+    if (!batch->count || width <= 0 || height <= 0)
+        return;
+    int columns, rows;
+    grid_size(batch->count, width, height, &columns, &rows);
+    int cell_width = width / columns > 0 ? width / columns : 1;
+    int cell_height = height / rows > 0 ? height / rows : 1;
+    // A pixel of background between cells, once they are big enough to spare it
+    int gap = cell_width > 2 && cell_height > 2;
+    for (int i = 0; i < batch->count; i++) {
+        struct rect cell = {(i % columns) * cell_width, (i / columns) * cell_height, cell_width - gap, cell_height - gap};
+        rect_batch_set_rect(batch, i, cell);
+    }
+}
+
+int rect_grid_cell(const struct rect_batch *batch, int width, int height, int x, int y) {
+    if (!batch->count || x < 0 || y < 0 || width <= 0 || height <= 0)
+        return -1;
+    int columns, rows;
+    grid_size(batch->count, width, height, &columns, &rows);
+    int cell_width = width / columns > 0 ? width / columns : 1;
+    int cell_height = height / rows > 0 ? height / rows : 1;
+    if (x / cell_width >= columns)
+        return -1;
+    int index = y / cell_height * columns + x / cell_width;
+    return index < batch->count ? index : -1;
+}
+
+int rect_count_from_env(void) {
+    const char *value = getenv("HELLO_WAYLAND_RECTS");
+    long count = value ? strtol(value, NULL, 10) : 0;
+    if (count > RECT_MAX_COUNT) {
+        fprintf(stderr, "HELLO_WAYLAND_RECTS is limited to %d\n", RECT_MAX_COUNT);
+        return RECT_MAX_COUNT;
+    }
+    return count > 0 ? count : 0;
+}
+
+void rect_renderer_dump(FILE *file) {
+    if (!stats.draws)
+        return;
+    fprintf(file, "rects: %llu draws of %llu rectangles, %llu KiB uploaded, %llu buffers orphaned, %llu partial uploads\n",
+        (unsigned long long)stats.draws,
+        (unsigned long long)stats.rects,
+        (unsigned long long)stats.uploaded_bytes / 1024,
+        (unsigned long long)stats.orphaned,
+        (unsigned long long)stats.partial);
+    fflush(file);
+}
@@ -0,0 +1,53 @@
+#ifndef RECT_RENDERER_H
+#define RECT_RENDERER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "damage.h"
+
+// Retained solid rectangles, drawn over a surface's background colour. A rect_batch keeps one
+// surface's rectangles as a struct of arrays, one array of geometry and one of colours, and
+// the GPU copy in one buffer per array. Setters compare against what is already there, so a
+// caller can set every rectangle on every frame and only the ones that changed are uploaded
+// and damaged. All batches share one shader program and draw with one call each.
+//
+// HELLO_WAYLAND_RECTS=N fills the main surface of every example with a grid of N of them.
+
+// Surfaces are at most this big in either direction, geometry is kept as 16-bit integers
+#define RECT_MAX_COORDINATE 32767
+// Far more than fit on any surface, and small enough that six vertices per rectangle still fit
+// in an int
+#define RECT_MAX_COUNT (1 << 20)
+
+struct rect_batch;
+
+// count is at most RECT_MAX_COUNT. Returns NULL if the arrays cannot be allocated.
+struct rect_batch *rect_batch_create(int count);
+// The GL objects are left to be freed along with the context
+void rect_batch_destroy(struct rect_batch *batch);
+
+int rect_batch_count(const struct rect_batch *batch);
+void rect_batch_set_rect(struct rect_batch *batch, int index, struct rect rect);
+// pixel is XRGB8888, as returned by shm_pixel()
+void rect_batch_set_color(struct rect_batch *batch, int index, uint32_t pixel);
+// Everything that changed on screen since the last call, in surface coordinates
+struct rect rect_batch_take_damage(struct rect_batch *batch);
+
+// Draws every rectangle into the current context with one draw call, the caller has
+// cleared the background and set the scissor to what needs repainting. Only as many as the
+// context's buffer textures can hold are drawn.
+void rect_batch_draw_gl(struct rect_batch *batch, int width, int height);
+// Fills the parts of the rectangles inside clip into an XRGB8888 buffer
+void rect_batch_draw_shm(const struct rect_batch *batch, uint32_t *data, int stride, struct rect clip);
+
+// Lays the batch out as a grid of cells, roughly square, that fills a width by height surface
+void rect_grid_layout(struct rect_batch *batch, int width, int height);
+// The cell of a grid laid out for width by height at the given position, -1 if none
+int rect_grid_cell(const struct rect_batch *batch, int width, int height, int x, int y);
+
+// The number of rectangles HELLO_WAYLAND_RECTS asks for, 0 if unset, at most RECT_MAX_COUNT
+int rect_count_from_env(void);
+
+void rect_renderer_dump(FILE *file);
+
+#endif // RECT_RENDERER_H
@@ -0,0 +1,174 @@
+#include "render-thread.h"
+#include <EGL/egl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "trace.h"
+
+// Triple buffer: the producer and consumer each own one slot and swap it with the shared
+// middle slot, a flag on the middle index tells the consumer it holds something new
+#define MAILBOX_FRESH 4
+
+struct mailbox {
+    size_t size;
+    char *slots;
+    atomic_uint middle;
+    unsigned back, front;
+};
+
+struct render_thread {
+    struct wl_display *display;
+    struct wl_event_queue *queue;
+    // The surface as seen from the render thread, requests made on it create objects on our queue
+    struct wl_surface *surface_wrapper;
+    struct wl_callback *frame_callback;
+    render_thread_draw_func_t draw;
+    void *data;
+    struct mailbox mailbox;
+    int wake_fd;
+    atomic_bool quit;
+    pthread_t thread;
+};
+
+static void mailbox_init(struct mailbox *mailbox, size_t size) {
+    mailbox->size = size;
+    mailbox->slots = calloc(3, size);
+    atomic_init(&mailbox->middle, 1);
+    mailbox->back = 0;
+    mailbox->front = 2;
+}
+
+static void mailbox_publish(struct mailbox *mailbox) {
+    unsigned old = atomic_exchange_explicit(&mailbox->middle, mailbox->back | MAILBOX_FRESH, memory_order_acq_rel);
+    mailbox->back = old & ~MAILBOX_FRESH;
+}
+
+// Returns the newest snapshot if one arrived since the last fetch, NULL otherwise
+static const void *mailbox_fetch(struct mailbox *mailbox) {
+    if (!(atomic_load_explicit(&mailbox->middle, memory_order_relaxed) & MAILBOX_FRESH))
+        return NULL;
+    unsigned old = atomic_exchange_explicit(&mailbox->middle, mailbox->front, memory_order_acq_rel);
+    mailbox->front = old & ~MAILBOX_FRESH;
+    return mailbox->slots + mailbox->front * mailbox->size;
+}
+
+int render_thread_requested(void) {
+    const char *value = getenv("HELLO_WAYLAND_RENDER_THREAD");
+    return value && !strcmp(value, "1");
+}
+
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+    TRACE_LISTENER(wl_callback, 0, callback);
+    struct render_thread *thread = data;
+    wl_callback_destroy(callback);
+    thread->frame_callback = NULL;
+}
+
+static struct wl_callback_listener frame_listener = {&frame_done};
+
+static void draw_if_ready(struct render_thread *thread) {
+    if (thread->frame_callback)
+        return;
+    const void *state = mailbox_fetch(&thread->mailbox);
+    if (!state)
+        return;
+    thread->frame_callback = wl_surface_frame(thread->surface_wrapper);
+    wl_callback_add_listener(thread->frame_callback, &frame_listener, thread);
+    thread->draw(thread->data, state);
+}
+
+static void *render_thread_main(void *data) {
+    struct render_thread *thread = data;
+    struct wl_display *display = thread->display;
+    struct pollfd fds[2] = {
+        {.fd = wl_display_get_fd(display), .events = POLLIN},
+        {.fd = thread->wake_fd, .events = POLLIN},
+    };
+
+    while (!atomic_load(&thread->quit)) {
+        draw_if_ready(thread);
+
+        while (wl_display_prepare_read_queue(display, thread->queue) != 0)
+            wl_display_dispatch_queue_pending(display, thread->queue);
+        wl_display_flush(display);
+
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            wl_display_cancel_read(display);
+            break;
+        }
+        // Whichever thread reads last does the actual read, the other one waits for it here
+        if (fds[0].revents & POLLIN) {
+            if (wl_display_read_events(display) < 0)
+                break;
+        } else {
+            wl_display_cancel_read(display);
+        }
+        if (wl_display_dispatch_queue_pending(display, thread->queue) < 0)
+            break;
+
+        if (fds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(thread->wake_fd, &count, sizeof(count)) < 0) {}
+        }
+    }
+
+    if (thread->frame_callback)
+        wl_callback_destroy(thread->frame_callback);
+    // Hands the context back so the main thread can destroy it
+    eglReleaseThread();
+    return NULL;
+}
+
+struct render_thread *render_thread_create(struct wl_display *display, struct wl_surface *surface, size_t state_size, render_thread_draw_func_t draw, void *data) {
+    struct render_thread *thread = malloc(sizeof(struct render_thread));
+    memset(thread, 0, sizeof(struct render_thread));
+    thread->display = display;
+    thread->queue = wl_display_create_queue(display);
+    thread->surface_wrapper = wl_proxy_create_wrapper(surface);
+    wl_proxy_set_queue((struct wl_proxy *)thread->surface_wrapper, thread->queue);
+    thread->draw = draw;
+    thread->data = data;
+    mailbox_init(&thread->mailbox, state_size);
+    thread->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    atomic_init(&thread->quit, 0);
+    // Started with every signal blocked, whatever the caller has set up so far, so signals
+    // always reach the main thread's event loop instead of their default action here
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    pthread_create(&thread->thread, NULL, &render_thread_main, thread);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return thread;
+}
+
+static void wake(struct render_thread *thread) {
+    uint64_t one = 1;
+    if (write(thread->wake_fd, &one, sizeof(one)) < 0) {}
+}
+
+void render_thread_destroy(struct render_thread *thread) {
+    atomic_store(&thread->quit, 1);
+    wake(thread);
+    pthread_join(thread->thread, NULL);
+    wl_proxy_wrapper_destroy(thread->surface_wrapper);
+    wl_event_queue_destroy(thread->queue);
+    close(thread->wake_fd);
+    free(thread->mailbox.slots);
+    free(thread);
+}
+
+void *render_thread_state(struct render_thread *thread) {
+    return thread->mailbox.slots + thread->mailbox.back * thread->mailbox.size;
+}
+
+void render_thread_publish(struct render_thread *thread) {
+    mailbox_publish(&thread->mailbox);
+    wake(thread);
+}
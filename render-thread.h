@@ -0,0 +1,32 @@
+#ifndef RENDER_THREAD_H
+#define RENDER_THREAD_H
+
+#include <stddef.h>
+#include <wayland-client.h>
+
+// Runs all drawing for one wl_surface on its own thread with a private wl_event_queue, so a
+// slow eglSwapBuffers can never delay input or shell events on the main thread.
+//
+// The main thread hands state over through a lock-free single-producer/single-consumer
+// mailbox. It always publishes a complete snapshot, and the render thread only ever sees
+// the newest one, so a burst of updates within one frame is drawn once.
+
+struct render_thread;
+
+// Called on the render thread with the newest state once the compositor is ready for a
+// frame. The frame callback is already requested, the function only has to draw and commit.
+typedef void (*render_thread_draw_func_t)(void *data, const void *state);
+
+// True if the user asked for threaded rendering with HELLO_WAYLAND_RENDER_THREAD=1
+int render_thread_requested(void);
+
+// The caller must not have the EGL context current on any thread when this is called
+struct render_thread *render_thread_create(struct wl_display *display, struct wl_surface *surface, size_t state_size, render_thread_draw_func_t draw, void *data);
+// Stops and joins the thread, which releases the EGL context on its way out
+void render_thread_destroy(struct render_thread *thread);
+
+// Main thread only: the snapshot being written, fill in every field then publish it
+void *render_thread_state(struct render_thread *thread);
+void render_thread_publish(struct render_thread *thread);
+
+#endif // RENDER_THREAD_H
@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include "shm-buffer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+struct shm_pool {
+    struct wl_shm *shm;
+    struct wl_shm_pool *pool;
+    int fd;
+    void *data;
+    size_t slot_size;
+    int next_slot;
+    uint64_t frame_count;
+    struct shm_buffer *slots[SHM_POOL_SLOTS];
+};
+
+static void destroy_buffer(struct shm_buffer *buffer) {
+    wl_buffer_destroy(buffer->buffer);
+    free(buffer);
+}
+
+static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
+    struct shm_buffer *buffer = data;
+    buffer->busy = 0;
+    if (!buffer->pool)
+        destroy_buffer(buffer);
+}
+
+static struct wl_buffer_listener buffer_listener = {&buffer_release};
+
+struct shm_pool *shm_pool_create(struct wl_shm *shm) {
+    struct shm_pool *pool = malloc(sizeof(struct shm_pool));
+    memset(pool, 0, sizeof(struct shm_pool));
+    pool->shm = shm;
+    pool->fd = -1;
+    return pool;
+}
+
+// Forgets every buffer, ones the compositor still holds are destroyed when it releases them
+static void orphan_buffers(struct shm_pool *pool) {
+    for (int i = 0; i < SHM_POOL_SLOTS; i++) {
+        struct shm_buffer *buffer = pool->slots[i];
+        if (!buffer)
+            continue;
+        if (buffer->busy)
+            buffer->pool = NULL;
+        else
+            destroy_buffer(buffer);
+        pool->slots[i] = NULL;
+    }
+}
+
+static void release_memory(struct shm_pool *pool) {
+    if (pool->pool)
+        wl_shm_pool_destroy(pool->pool);
+    if (pool->data)
+        munmap(pool->data, pool->slot_size * SHM_POOL_SLOTS);
+    if (pool->fd >= 0)
+        close(pool->fd);
+    pool->pool = NULL;
+    pool->data = NULL;
+    pool->fd = -1;
+    pool->slot_size = 0;
+}
+
+// Busy buffers keep the old memory alive on the compositor side, so a fresh memfd can be
+// handed out right away without waiting for them
+static int allocate_memory(struct shm_pool *pool, size_t slot_size) {
+    orphan_buffers(pool);
+    release_memory(pool);
+
+    size_t size = slot_size * SHM_POOL_SLOTS;
+    int fd = memfd_create("hello-wayland-shm", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    pool->fd = fd;
+    pool->data = data;
+    pool->slot_size = slot_size;
+    pool->pool = wl_shm_create_pool(pool->shm, fd, size);
+    return 0;
+}
+
+struct shm_buffer *shm_pool_acquire(struct shm_pool *pool, int width, int height) {
+    int stride = width * 4;
+    size_t size = (size_t)stride * height;
+    if (size > pool->slot_size) {
+        // Grow with headroom so a window being dragged larger does not reallocate every frame
+        size_t slot_size = pool->slot_size + pool->slot_size / 2;
+        if (allocate_memory(pool, size > slot_size ? size : slot_size) < 0)
+            return NULL;
+    }
+
+    for (int n = 0; n < SHM_POOL_SLOTS; n++) {
+        int i = (pool->next_slot + n) % SHM_POOL_SLOTS;
+        struct shm_buffer *buffer = pool->slots[i];
+        if (buffer && buffer->busy)
+            continue;
+        if (buffer && (buffer->width != width || buffer->height != height)) {
+            destroy_buffer(buffer);
+            buffer = NULL;
+        }
+        if (!buffer) {
+            buffer = malloc(sizeof(struct shm_buffer));
+            memset(buffer, 0, sizeof(struct shm_buffer));
+            buffer->pool = pool;
+            buffer->width = width;
+            buffer->height = height;
+            buffer->stride = stride;
+            buffer->data = (uint32_t *)((char *)pool->data + i * pool->slot_size);
+            buffer->buffer = wl_shm_pool_create_buffer(pool->pool, i * pool->slot_size, width, height, stride, WL_SHM_FORMAT_XRGB8888);
+            wl_buffer_add_listener(buffer->buffer, &buffer_listener, buffer);
+            pool->slots[i] = buffer;
+        }
+        pool->frame_count++;
+        buffer->age = buffer->frame ? pool->frame_count - buffer->frame : 0;
+        buffer->frame = pool->frame_count;
+        buffer->busy = 1;
+        pool->next_slot = (i + 1) % SHM_POOL_SLOTS;
+        return buffer;
+    }
+    return NULL;
+}
+
+int shm_pool_ready(const struct shm_pool *pool, int width, int height) {
+    // A larger size gets fresh memory, with every slot free
+    if ((size_t)width * 4 * height > pool->slot_size)
+        return 1;
+    for (int i = 0; i < SHM_POOL_SLOTS; i++) {
+        if (!pool->slots[i] || !pool->slots[i]->busy)
+            return 1;
+    }
+    return 0;
+}
+
+void shm_pool_destroy(struct shm_pool *pool) {
+    orphan_buffers(pool);
+    release_memory(pool);
+    free(pool);
+}
+
+uint32_t shm_pixel(float r, float g, float b) {
+    return 0xff000000 |
+        (uint32_t)(r * 255.0f + 0.5f) << 16 |
+        (uint32_t)(g * 255.0f + 0.5f) << 8 |
+        (uint32_t)(b * 255.0f + 0.5f);
+}
+
+static void fill_row_scalar(uint32_t *row, int count, uint32_t pixel) {
+    for (int i = 0; i < count; i++)
+        row[i] = pixel;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void fill_row_sse2(uint32_t *row, int count, uint32_t pixel) {
+    __m128i v = _mm_set1_epi32(pixel);
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm_storeu_si128((__m128i *)(row + i), v);
+        _mm_storeu_si128((__m128i *)(row + i + 4), v);
+        _mm_storeu_si128((__m128i *)(row + i + 8), v);
+        _mm_storeu_si128((__m128i *)(row + i + 12), v);
+    }
+    for (; i + 4 <= count; i += 4)
+        _mm_storeu_si128((__m128i *)(row + i), v);
+    fill_row_scalar(row + i, count - i, pixel);
+}
+
+__attribute__((target("avx2")))
+static void fill_row_avx2(uint32_t *row, int count, uint32_t pixel) {
+    __m256i v = _mm256_set1_epi32(pixel);
+    int i = 0;
+    for (; i + 32 <= count; i += 32) {
+        _mm256_storeu_si256((__m256i *)(row + i), v);
+        _mm256_storeu_si256((__m256i *)(row + i + 8), v);
+        _mm256_storeu_si256((__m256i *)(row + i + 16), v);
+        _mm256_storeu_si256((__m256i *)(row + i + 24), v);
+    }
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_si256((__m256i *)(row + i), v);
+    fill_row_scalar(row + i, count - i, pixel);
+}
+#endif
+
+static void (*fill_row)(uint32_t *row, int count, uint32_t pixel) = NULL;
+
+static void select_fill_row(void) {
+    fill_row = &fill_row_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        fill_row = &fill_row_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        fill_row = &fill_row_sse2;
+#endif
+}
+
+void shm_fill(uint32_t *data, int stride, int x, int y, int width, int height, uint32_t pixel) {
+    if (!fill_row)
+        select_fill_row();
+    int pitch = stride / 4;
+    uint32_t *row = data + y * pitch + x;
+    // Full-width rectangles are one contiguous run, which keeps the vector loop busy
+    if (x == 0 && width == pitch) {
+        fill_row(row, width * height, pixel);
+        return;
+    }
+    for (int i = 0; i < height; i++, row += pitch)
+        fill_row(row, width, pixel);
+}
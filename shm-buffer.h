@@ -0,0 +1,40 @@
+#ifndef SHM_BUFFER_H
+#define SHM_BUFFER_H
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+// Software rendering backend: one memfd shared with the compositor through a single
+// wl_shm_pool, cut into a small ring of equally sized slots that are reused as soon as the
+// compositor sends wl_buffer.release
+
+#define SHM_POOL_SLOTS 3
+
+struct shm_pool;
+
+struct shm_buffer {
+    // NULL once the pool has been reallocated, the buffer is then freed on release
+    struct shm_pool *pool;
+    struct wl_buffer *buffer;
+    uint32_t *data;
+    int width, height, stride;
+    char busy;
+    // Frames since this buffer was last handed out, 0 for a fresh buffer with undefined
+    // contents, the same meaning as EGL_EXT_buffer_age
+    int age;
+    uint64_t frame;
+};
+
+struct shm_pool *shm_pool_create(struct wl_shm *shm);
+// Returns a buffer of the given size that the compositor is not using, marked busy until it
+// is released again. Returns NULL if every slot is still held by the compositor.
+struct shm_buffer *shm_pool_acquire(struct shm_pool *pool, int width, int height);
+// Returns 0 if shm_pool_acquire() would find every slot still held by the compositor
+int shm_pool_ready(const struct shm_pool *pool, int width, int height);
+void shm_pool_destroy(struct shm_pool *pool);
+
+// Fills a rectangle of XRGB8888 pixels, using AVX2 or SSE2 when the CPU has them
+void shm_fill(uint32_t *data, int stride, int x, int y, int width, int height, uint32_t pixel);
+uint32_t shm_pixel(float r, float g, float b);
+
+#endif // SHM_BUFFER_H
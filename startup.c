@@ -0,0 +1,94 @@
+#include "startup.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const char *phase_names[STARTUP_PHASES] = {
+    [STARTUP_MAIN] = "main",
+    [STARTUP_CONNECTED] = "connected",
+    [STARTUP_REGISTRY] = "registry",
+    [STARTUP_EGL_READY] = "egl ready",
+    [STARTUP_FIRST_CONFIGURE] = "first configure",
+    [STARTUP_FIRST_FRAME] = "first frame",
+};
+
+// CLOCK_MONOTONIC in ns, 0 until the phase is reached
+static _Atomic uint64_t phase_times[STARTUP_PHASES];
+
+struct egl_startup {
+    struct wl_display *wl_display;
+    pthread_t thread;
+    EGLDisplay display;
+    EGLConfig config;
+    EGLContext context;
+};
+
+void startup_mark(enum startup_phase phase) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t expected = 0;
+    atomic_compare_exchange_strong(&phase_times[phase], &expected, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+void startup_dump(FILE *file) {
+    uint64_t base = atomic_load(&phase_times[STARTUP_MAIN]);
+    fprintf(file, "startup:");
+    for (int phase = STARTUP_CONNECTED; phase < STARTUP_PHASES; phase++) {
+        uint64_t time = atomic_load(&phase_times[phase]);
+        if (!time) {
+            fprintf(file, " %s -", phase_names[phase]);
+            continue;
+        }
+        fprintf(file, " %s +%.1f ms", phase_names[phase], (time - base) / 1e6);
+    }
+    fprintf(file, "\n");
+    fflush(file);
+}
+
+static void *egl_startup_run(void *data) {
+    struct egl_startup *startup = data;
+    // Mesa does its own round trips for this on a private event queue, so it can run next to
+    // the main thread's registry round trip
+    startup->display = eglGetDisplay(startup->wl_display);
+    eglInitialize(startup->display, NULL, NULL);
+
+    eglBindAPI(EGL_OPENGL_API);
+    EGLint attributes[] = {
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+    EGL_NONE};
+    EGLint num_config;
+    eglChooseConfig(startup->display, attributes, &startup->config, 1, &num_config);
+    startup->context = eglCreateContext(startup->display, startup->config, EGL_NO_CONTEXT, NULL);
+    // Frees the per-thread EGL state, the context was never current here
+    eglReleaseThread();
+    startup_mark(STARTUP_EGL_READY);
+    return NULL;
+}
+
+struct egl_startup *egl_startup_begin(struct wl_display *display) {
+    struct egl_startup *startup = malloc(sizeof(struct egl_startup));
+    startup->wl_display = display;
+    // Started with every signal blocked, and so are the threads Mesa starts from it, so
+    // signals always reach the main thread's event loop
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    pthread_create(&startup->thread, NULL, &egl_startup_run, startup);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    return startup;
+}
+
+void egl_startup_finish(struct egl_startup *startup, EGLDisplay *display, EGLConfig *config, EGLContext *context) {
+    pthread_join(startup->thread, NULL);
+    *display = startup->display;
+    *config = startup->config;
+    *context = startup->context;
+    free(startup);
+    // The bound API is per thread, the one that makes the context current needs it as well
+    eglBindAPI(EGL_OPENGL_API);
+}
@@ -0,0 +1,34 @@
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <stdio.h>
+#include <EGL/egl.h>
+#include <wayland-client.h>
+
+// Time to first frame. eglInitialize() alone can take tens of milliseconds with Mesa, so
+// egl_startup_begin() brings up the EGL display, config and context on a helper thread while
+// the main thread runs the registry round trip and sets up its surfaces. Whatever first needs
+// EGL waits for it with egl_startup_finish().
+
+enum startup_phase {
+    STARTUP_MAIN,
+    STARTUP_CONNECTED,
+    STARTUP_REGISTRY,
+    STARTUP_EGL_READY,
+    STARTUP_FIRST_CONFIGURE,
+    STARTUP_FIRST_FRAME,
+    STARTUP_PHASES,
+};
+
+// Records when a phase was reached, only the first call per phase counts. Safe from any thread.
+void startup_mark(enum startup_phase phase);
+void startup_dump(FILE *file);
+
+struct egl_startup;
+
+// Starts initialising EGL for the display with the RGB888 desktop GL config every example uses
+struct egl_startup *egl_startup_begin(struct wl_display *display);
+// Joins the helper thread, frees the handle and binds the OpenGL API on the calling thread
+void egl_startup_finish(struct egl_startup *startup, EGLDisplay *display, EGLConfig *config, EGLContext *context);
+
+#endif // STARTUP_H
@@ -0,0 +1,74 @@
+// Preloaded into benchmark clients by mock-compositor --count-allocations. Counts calls to the
+// malloc family and writes the totals to the file descriptor in MOCK_ALLOC_FD when the client
+// exits, so they include startup as well as every frame.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// glibc's own entry points, which the wrappers below forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *pointer);
+
+static _Atomic uint64_t allocations;
+static _Atomic uint64_t allocated_bytes;
+
+static void count_allocation(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocated_bytes, size, memory_order_relaxed);
+}
+
+void *malloc(size_t size) {
+    count_allocation(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_allocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    count_allocation(size);
+    return __libc_realloc(pointer, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    count_allocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **pointer, size_t alignment, size_t size) {
+    void *result = memalign(alignment, size);
+    if (!result)
+        return ENOMEM;
+    *pointer = result;
+    return 0;
+}
+
+void free(void *pointer) {
+    __libc_free(pointer);
+}
+
+__attribute__((destructor)) static void report(void) {
+    const char *value = getenv("MOCK_ALLOC_FD");
+    if (!value)
+        return;
+    char line[64];
+    int length = snprintf(line, sizeof(line), "%llu %llu\n",
+        (unsigned long long)atomic_load(&allocations),
+        (unsigned long long)atomic_load(&allocated_bytes));
+    if (write(atoi(value), line, length) < 0)
+        return;
+}
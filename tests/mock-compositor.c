@@ -0,0 +1,1295 @@
+// A headless compositor for tests and benchmarks. It starts one client on a private socket,
+// plays a scripted timeline of configures, input and frame callbacks at it, and checks what
+// the client sent back against the limits given on the command line.
+//
+//     mock-compositor [--script FILE] [--duration MS] [--refresh HZ] [limits] -- CLIENT [ARGS]
+//
+// The script has one event per line, "<ms> <command> [arguments]", times are relative to the
+// start of the client and must not go backwards. "<ms> repeat <count> <interval> <command>
+// [arguments]" sends the command count times, interval milliseconds apart:
+//
+//     configure W H [suspended|activated|maximized|fullscreen ...]
+//                            sent to every toplevel and layer surface, 0 leaves the size to the client
+//     enter X Y              pointer enters the first mapped toplevel or layer surface
+//     motion X Y
+//     click                  press and release of the left button
+//     leave
+//     frames off|on          stops or resumes frame callbacks, like an occluded window
+//     releases off|on        holds on to committed buffers, and releases them all again
+//     text-enter             text-input focus enters the first mapped toplevel
+//     text-leave
+//     preedit TEXT           each text event is followed by a done for the newest commit
+//     commit TEXT
+//     delete BEFORE AFTER
+//     close                  asks every toplevel and layer surface to close
+//
+// When the duration is up every toplevel and layer surface is closed, and a client that has
+// not exited two seconds later gets SIGTERM.
+//
+// For benchmarks, --json FILE writes the frame rate and the requests, CPU time and, with
+// --count-allocations pointing at alloc-counter.so, allocations per frame as JSON.
+
+#define _GNU_SOURCE
+#include <wayland-server.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "xdg-shell-server.h"
+#include "wlr-layer-shell-unstable-v1-server.h"
+#include "text-input-unstable-v3-server.h"
+
+#define BTN_LEFT 0x110
+#define MAX_EVENTS 16384
+#define MAX_MESSAGE_COUNTS 256
+// How long the client gets to exit on its own before SIGTERM, and after it before SIGKILL
+#define EXIT_GRACE_MS 2000
+
+enum role {
+    ROLE_NONE,
+    ROLE_TOPLEVEL,
+    ROLE_LAYER_SURFACE,
+    ROLE_SUBSURFACE,
+    ROLE_CURSOR,
+};
+
+struct surface {
+    struct wl_list link;
+    struct wl_resource *resource;
+    enum role role;
+    // The xdg_toplevel or zwlr_layer_surface_v1, and the xdg_surface for toplevels
+    struct wl_resource *role_resource;
+    struct wl_resource *xdg_surface;
+    // Layer surfaces only, what the client asked for
+    uint32_t requested_width, requested_height;
+    // Set once the initial configure went out
+    char configured;
+    // Set once a buffer was committed
+    char mapped;
+    struct wl_resource *pending_buffer;
+    char pending_attach;
+    // Frame callbacks requested since the last commit, and the committed ones waiting for the
+    // next refresh
+    struct wl_list pending_callbacks;
+    struct wl_list callbacks;
+    // Subsurfaces only. In sync mode a commit is cached and its frame callbacks wait for the
+    // parent's next commit to apply it.
+    struct wl_resource *subsurface;
+    struct surface *parent;
+    char sync;
+    struct wl_list cached_callbacks;
+};
+
+// A resource kept in a list, the wrapper is the resource's user data
+struct tracked {
+    struct wl_list link;
+    struct wl_resource *resource;
+};
+
+// A committed buffer not released yet, wl_shm owns the resource so it is watched for
+// destruction instead
+struct held_buffer {
+    struct wl_list link;
+    struct wl_resource *resource;
+    struct wl_listener destroy;
+};
+
+struct event {
+    int time;
+    // Position in the script, keeps events with the same time in order
+    int order;
+    char command[32];
+    char argument[128];
+};
+
+struct message_count {
+    const struct wl_message *message;
+    const char *interface;
+    uint64_t count;
+};
+
+struct stats {
+    uint64_t requests;
+    uint64_t commits;
+    uint64_t frames;
+    uint64_t configures;
+    uint64_t acks;
+    uint64_t frame_callbacks;
+    uint64_t text_input_commits;
+    struct message_count messages[MAX_MESSAGE_COUNTS];
+    int message_count;
+};
+
+struct limits {
+    long min_frames, max_frames;
+    long max_requests;
+    long max_cpu_ms;
+};
+
+static struct wl_display *display;
+static struct wl_event_loop *loop;
+static struct wl_client *client = NULL;
+static pid_t client_pid = -1;
+static struct wl_list surfaces;
+static struct wl_list pointers;
+static struct wl_list text_inputs;
+static struct surface *pointer_focus = NULL;
+static struct surface *text_input_focus = NULL;
+static char frames_enabled = 1;
+static char releases_enabled = 1;
+static struct wl_list held_buffers;
+static struct stats stats;
+static struct limits limits = {-1, -1, -1, -1};
+
+static struct event events[MAX_EVENTS];
+static int event_count = 0;
+static int next_event = 0;
+static struct wl_event_source *script_timer;
+static struct wl_event_source *refresh_timer;
+static struct wl_event_source *exit_timer;
+static int duration_ms = 1000;
+static int refresh_ms = 16;
+static char ending = 0;
+static char sent_sigterm = 0;
+
+static uint64_t start_ms;
+// From the start of the client until it was asked to close or exited on its own
+static uint64_t run_ms;
+static int client_status = -1;
+static struct rusage client_usage;
+
+// Read end of the pipe alloc-counter.so reports on, -1 unless allocations are counted
+static int allocation_fd = -1;
+static uint64_t allocations, allocated_bytes;
+static char allocations_counted = 0;
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t event_time(void) {
+    return (uint32_t)monotonic_ms();
+}
+
+static void resource_destroy(struct wl_client *client, struct wl_resource *resource) {
+    wl_resource_destroy(resource);
+}
+
+static void track_destroy(struct wl_resource *resource) {
+    struct tracked *tracked = wl_resource_get_user_data(resource);
+    wl_list_remove(&tracked->link);
+    free(tracked);
+}
+
+static void track(struct wl_list *list, struct wl_resource *resource, const void *implementation) {
+    struct tracked *tracked = malloc(sizeof(struct tracked));
+    tracked->resource = resource;
+    wl_list_insert(list->prev, &tracked->link);
+    wl_resource_set_implementation(resource, implementation, tracked, &track_destroy);
+}
+
+// The first surface with a buffer and a role that takes input
+static struct surface *focus_candidate(void) {
+    struct surface *surface;
+    wl_list_for_each(surface, &surfaces, link) {
+        if (surface->mapped && (surface->role == ROLE_TOPLEVEL || surface->role == ROLE_LAYER_SURFACE))
+            return surface;
+    }
+    return NULL;
+}
+
+// wl_region
+
+static void region_add(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {}
+
+static void region_subtract(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {}
+
+static const struct wl_region_interface region_implementation = {
+    .destroy = &resource_destroy,
+    .add = &region_add,
+    .subtract = &region_subtract,
+};
+
+// wl_surface
+
+static void send_configure(struct surface *surface, int32_t width, int32_t height, const uint32_t *states, int state_count) {
+    uint32_t serial = wl_display_next_serial(display);
+    if (surface->role == ROLE_TOPLEVEL) {
+        struct wl_array array;
+        wl_array_init(&array);
+        for (int i = 0; i < state_count; i++) {
+            // Newer states are only sent to clients that bound a version that knows them
+            if (states[i] == XDG_TOPLEVEL_STATE_SUSPENDED && wl_resource_get_version(surface->role_resource) < 6)
+                continue;
+            *(uint32_t *)wl_array_add(&array, sizeof(uint32_t)) = states[i];
+        }
+        xdg_toplevel_send_configure(surface->role_resource, width, height, &array);
+        wl_array_release(&array);
+        xdg_surface_send_configure(surface->xdg_surface, serial);
+    } else if (surface->role == ROLE_LAYER_SURFACE) {
+        uint32_t layer_width = width > 0 ? (uint32_t)width : surface->requested_width ? surface->requested_width : 300;
+        uint32_t layer_height = height > 0 ? (uint32_t)height : surface->requested_height ? surface->requested_height : 300;
+        zwlr_layer_surface_v1_send_configure(surface->role_resource, serial, layer_width, layer_height);
+    } else {
+        return;
+    }
+    surface->configured = 1;
+    stats.configures++;
+}
+
+static void callback_destroy(struct wl_resource *resource) {
+    struct wl_list *link = wl_resource_get_user_data(resource);
+    wl_list_remove(link);
+    free(link);
+}
+
+static void held_buffer_destroyed(struct wl_listener *listener, void *data) {
+    struct held_buffer *held = wl_container_of(listener, held, destroy);
+    wl_list_remove(&held->link);
+    free(held);
+}
+
+static void release_buffer(struct wl_resource *buffer) {
+    if (releases_enabled) {
+        wl_buffer_send_release(buffer);
+        return;
+    }
+    struct held_buffer *held = malloc(sizeof(struct held_buffer));
+    held->resource = buffer;
+    held->destroy.notify = &held_buffer_destroyed;
+    wl_resource_add_destroy_listener(buffer, &held->destroy);
+    wl_list_insert(held_buffers.prev, &held->link);
+}
+
+static void release_held_buffers(void) {
+    struct held_buffer *held, *tmp;
+    wl_list_for_each_safe(held, tmp, &held_buffers, link) {
+        wl_buffer_send_release(held->resource);
+        wl_list_remove(&held->destroy.link);
+        wl_list_remove(&held->link);
+        free(held);
+    }
+}
+
+static void surface_attach(struct wl_client *client, struct wl_resource *resource, struct wl_resource *buffer, int32_t x, int32_t y) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    surface->pending_buffer = buffer;
+    surface->pending_attach = 1;
+}
+
+static void surface_damage(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {}
+
+static void surface_frame(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    struct tracked *callback = malloc(sizeof(struct tracked));
+    callback->resource = wl_resource_create(client, &wl_callback_interface, 1, id);
+    wl_list_insert(surface->pending_callbacks.prev, &callback->link);
+    wl_resource_set_implementation(callback->resource, NULL, &callback->link, &callback_destroy);
+}
+
+static void surface_set_region(struct wl_client *client, struct wl_resource *resource, struct wl_resource *region) {}
+
+static void apply_cached(struct surface *surface) {
+    wl_list_insert_list(surface->callbacks.prev, &surface->cached_callbacks);
+    wl_list_init(&surface->cached_callbacks);
+}
+
+static void surface_commit(struct wl_client *client, struct wl_resource *resource) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    stats.commits++;
+    if (surface->pending_attach) {
+        if (surface->pending_buffer) {
+            stats.frames++;
+            surface->mapped = 1;
+            // The contents count as copied right away, like a compositor that uploads shm
+            // buffers to a texture on commit
+            release_buffer(surface->pending_buffer);
+        } else {
+            surface->mapped = 0;
+        }
+        surface->pending_buffer = NULL;
+        surface->pending_attach = 0;
+    }
+    if (surface->parent && surface->sync) {
+        wl_list_insert_list(surface->cached_callbacks.prev, &surface->pending_callbacks);
+        wl_list_init(&surface->pending_callbacks);
+        return;
+    }
+    wl_list_insert_list(surface->callbacks.prev, &surface->pending_callbacks);
+    wl_list_init(&surface->pending_callbacks);
+    struct surface *child;
+    wl_list_for_each(child, &surfaces, link) {
+        if (child->parent == surface)
+            apply_cached(child);
+    }
+    // The first commit after a role was given asks for the initial configure
+    if (!surface->configured && (surface->role == ROLE_TOPLEVEL || surface->role == ROLE_LAYER_SURFACE))
+        send_configure(surface, 0, 0, NULL, 0);
+}
+
+static void surface_set_int(struct wl_client *client, struct wl_resource *resource, int32_t value) {}
+
+static void surface_offset(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y) {}
+
+static const struct wl_surface_interface surface_implementation = {
+    .destroy = &resource_destroy,
+    .attach = &surface_attach,
+    .damage = &surface_damage,
+    .frame = &surface_frame,
+    .set_opaque_region = &surface_set_region,
+    .set_input_region = &surface_set_region,
+    .commit = &surface_commit,
+    .set_buffer_transform = &surface_set_int,
+    .set_buffer_scale = &surface_set_int,
+    .damage_buffer = &surface_damage,
+    .offset = &surface_offset,
+};
+
+static void destroy_callbacks(struct wl_list *callbacks) {
+    struct tracked *callback, *tmp;
+    wl_list_for_each_safe(callback, tmp, callbacks, link)
+        wl_resource_destroy(callback->resource);
+}
+
+static void surface_destroy(struct wl_resource *resource) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    if (pointer_focus == surface)
+        pointer_focus = NULL;
+    if (text_input_focus == surface)
+        text_input_focus = NULL;
+    destroy_callbacks(&surface->pending_callbacks);
+    destroy_callbacks(&surface->callbacks);
+    destroy_callbacks(&surface->cached_callbacks);
+    if (surface->subsurface)
+        wl_resource_set_user_data(surface->subsurface, NULL);
+    wl_list_remove(&surface->link);
+    struct surface *child;
+    wl_list_for_each(child, &surfaces, link) {
+        if (child->parent == surface)
+            child->parent = NULL;
+    }
+    free(surface);
+}
+
+// wl_compositor
+
+static void compositor_create_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct surface *surface = calloc(1, sizeof(struct surface));
+    surface->resource = wl_resource_create(client, &wl_surface_interface, wl_resource_get_version(resource), id);
+    wl_list_init(&surface->pending_callbacks);
+    wl_list_init(&surface->callbacks);
+    wl_list_init(&surface->cached_callbacks);
+    wl_list_insert(surfaces.prev, &surface->link);
+    wl_resource_set_implementation(surface->resource, &surface_implementation, surface, &surface_destroy);
+}
+
+static void compositor_create_region(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct wl_resource *region = wl_resource_create(client, &wl_region_interface, 1, id);
+    wl_resource_set_implementation(region, &region_implementation, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_implementation = {
+    .create_surface = &compositor_create_surface,
+    .create_region = &compositor_create_region,
+};
+
+static void bind_compositor(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &wl_compositor_interface, version, id);
+    wl_resource_set_implementation(resource, &compositor_implementation, NULL, NULL);
+}
+
+// wl_subcompositor
+
+static void subsurface_set_position(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y) {}
+
+static void subsurface_place(struct wl_client *client, struct wl_resource *resource, struct wl_resource *sibling) {}
+
+static void subsurface_set_sync(struct wl_client *client, struct wl_resource *resource) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    if (surface)
+        surface->sync = 1;
+}
+
+// Whatever was cached is applied right away, as if the parent had committed
+static void subsurface_set_desync(struct wl_client *client, struct wl_resource *resource) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    if (!surface)
+        return;
+    surface->sync = 0;
+    apply_cached(surface);
+}
+
+static const struct wl_subsurface_interface subsurface_implementation = {
+    .destroy = &resource_destroy,
+    .set_position = &subsurface_set_position,
+    .place_above = &subsurface_place,
+    .place_below = &subsurface_place,
+    .set_sync = &subsurface_set_sync,
+    .set_desync = &subsurface_set_desync,
+};
+
+// The surface goes back to having no parent, with its cached state applied
+static void subsurface_destroy(struct wl_resource *resource) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    if (!surface)
+        return;
+    apply_cached(surface);
+    surface->subsurface = NULL;
+    surface->parent = NULL;
+}
+
+static void subcompositor_get_subsurface(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *surface_resource, struct wl_resource *parent) {
+    struct surface *surface = wl_resource_get_user_data(surface_resource);
+    surface->role = ROLE_SUBSURFACE;
+    // Subsurfaces start out synchronised
+    surface->parent = wl_resource_get_user_data(parent);
+    surface->sync = 1;
+    surface->subsurface = wl_resource_create(client, &wl_subsurface_interface, 1, id);
+    wl_resource_set_implementation(surface->subsurface, &subsurface_implementation, surface, &subsurface_destroy);
+}
+
+static const struct wl_subcompositor_interface subcompositor_implementation = {
+    .destroy = &resource_destroy,
+    .get_subsurface = &subcompositor_get_subsurface,
+};
+
+static void bind_subcompositor(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &wl_subcompositor_interface, version, id);
+    wl_resource_set_implementation(resource, &subcompositor_implementation, NULL, NULL);
+}
+
+// wl_seat, only ever with a pointer
+
+static void pointer_set_cursor(struct wl_client *client, struct wl_resource *resource, uint32_t serial, struct wl_resource *surface_resource, int32_t hotspot_x, int32_t hotspot_y) {
+    if (!surface_resource)
+        return;
+    struct surface *surface = wl_resource_get_user_data(surface_resource);
+    surface->role = ROLE_CURSOR;
+}
+
+static const struct wl_pointer_interface pointer_implementation = {
+    .set_cursor = &pointer_set_cursor,
+    .release = &resource_destroy,
+};
+
+static const struct wl_keyboard_interface keyboard_implementation = {
+    .release = &resource_destroy,
+};
+
+static const struct wl_touch_interface touch_implementation = {
+    .release = &resource_destroy,
+};
+
+static void seat_get_pointer(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct wl_resource *pointer = wl_resource_create(client, &wl_pointer_interface, wl_resource_get_version(resource), id);
+    track(&pointers, pointer, &pointer_implementation);
+}
+
+static void seat_get_keyboard(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct wl_resource *keyboard = wl_resource_create(client, &wl_keyboard_interface, wl_resource_get_version(resource), id);
+    wl_resource_set_implementation(keyboard, &keyboard_implementation, NULL, NULL);
+}
+
+static void seat_get_touch(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct wl_resource *touch = wl_resource_create(client, &wl_touch_interface, wl_resource_get_version(resource), id);
+    wl_resource_set_implementation(touch, &touch_implementation, NULL, NULL);
+}
+
+static const struct wl_seat_interface seat_implementation = {
+    .get_pointer = &seat_get_pointer,
+    .get_keyboard = &seat_get_keyboard,
+    .get_touch = &seat_get_touch,
+    .release = &resource_destroy,
+};
+
+static void bind_seat(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &wl_seat_interface, version, id);
+    wl_resource_set_implementation(resource, &seat_implementation, NULL, NULL);
+    wl_seat_send_capabilities(resource, WL_SEAT_CAPABILITY_POINTER);
+    if (version >= WL_SEAT_NAME_SINCE_VERSION)
+        wl_seat_send_name(resource, "mock");
+}
+
+static void pointer_frame(struct wl_resource *pointer) {
+    if (wl_resource_get_version(pointer) >= WL_POINTER_FRAME_SINCE_VERSION)
+        wl_pointer_send_frame(pointer);
+}
+
+// xdg_wm_base
+
+static void positioner_set_size(struct wl_client *client, struct wl_resource *resource, int32_t width, int32_t height) {}
+
+static void positioner_set_anchor_rect(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {}
+
+static void positioner_set_uint(struct wl_client *client, struct wl_resource *resource, uint32_t value) {}
+
+static void positioner_set_reactive(struct wl_client *client, struct wl_resource *resource) {}
+
+static const struct xdg_positioner_interface positioner_implementation = {
+    .destroy = &resource_destroy,
+    .set_size = &positioner_set_size,
+    .set_anchor_rect = &positioner_set_anchor_rect,
+    .set_anchor = &positioner_set_uint,
+    .set_gravity = &positioner_set_uint,
+    .set_constraint_adjustment = &positioner_set_uint,
+    .set_offset = &positioner_set_size,
+    .set_reactive = &positioner_set_reactive,
+    .set_parent_size = &positioner_set_size,
+    .set_parent_configure = &positioner_set_uint,
+};
+
+static void toplevel_set_parent(struct wl_client *client, struct wl_resource *resource, struct wl_resource *parent) {}
+
+static void toplevel_set_string(struct wl_client *client, struct wl_resource *resource, const char *value) {}
+
+static void toplevel_show_window_menu(struct wl_client *client, struct wl_resource *resource, struct wl_resource *seat, uint32_t serial, int32_t x, int32_t y) {}
+
+static void toplevel_move(struct wl_client *client, struct wl_resource *resource, struct wl_resource *seat, uint32_t serial) {}
+
+static void toplevel_resize(struct wl_client *client, struct wl_resource *resource, struct wl_resource *seat, uint32_t serial, uint32_t edges) {}
+
+static void toplevel_set_size(struct wl_client *client, struct wl_resource *resource, int32_t width, int32_t height) {}
+
+static void toplevel_set_state(struct wl_client *client, struct wl_resource *resource) {}
+
+static void toplevel_set_fullscreen(struct wl_client *client, struct wl_resource *resource, struct wl_resource *output) {}
+
+static const struct xdg_toplevel_interface toplevel_implementation = {
+    .destroy = &resource_destroy,
+    .set_parent = &toplevel_set_parent,
+    .set_title = &toplevel_set_string,
+    .set_app_id = &toplevel_set_string,
+    .show_window_menu = &toplevel_show_window_menu,
+    .move = &toplevel_move,
+    .resize = &toplevel_resize,
+    .set_max_size = &toplevel_set_size,
+    .set_min_size = &toplevel_set_size,
+    .set_maximized = &toplevel_set_state,
+    .unset_maximized = &toplevel_set_state,
+    .set_fullscreen = &toplevel_set_fullscreen,
+    .unset_fullscreen = &toplevel_set_state,
+    .set_minimized = &toplevel_set_state,
+};
+
+static void popup_grab(struct wl_client *client, struct wl_resource *resource, struct wl_resource *seat, uint32_t serial) {}
+
+static void popup_reposition(struct wl_client *client, struct wl_resource *resource, struct wl_resource *positioner, uint32_t token) {}
+
+static const struct xdg_popup_interface popup_implementation = {
+    .destroy = &resource_destroy,
+    .grab = &popup_grab,
+    .reposition = &popup_reposition,
+};
+
+// Role objects keep a pointer to their surface, which is cleared if the surface goes first
+static void role_destroy(struct wl_resource *resource) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    if (surface && surface->role_resource == resource) {
+        surface->role_resource = NULL;
+        surface->configured = 0;
+        if (surface->role != ROLE_CURSOR)
+            surface->role = ROLE_NONE;
+    }
+}
+
+static void xdg_surface_get_toplevel(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    surface->role = ROLE_TOPLEVEL;
+    surface->configured = 0;
+    surface->role_resource = wl_resource_create(client, &xdg_toplevel_interface, wl_resource_get_version(resource), id);
+    wl_resource_set_implementation(surface->role_resource, &toplevel_implementation, surface, &role_destroy);
+}
+
+static void xdg_surface_get_popup(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *parent, struct wl_resource *positioner) {
+    struct wl_resource *popup = wl_resource_create(client, &xdg_popup_interface, wl_resource_get_version(resource), id);
+    wl_resource_set_implementation(popup, &popup_implementation, NULL, NULL);
+}
+
+static void xdg_surface_set_window_geometry(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {}
+
+static void xdg_surface_ack_configure(struct wl_client *client, struct wl_resource *resource, uint32_t serial) {
+    stats.acks++;
+}
+
+static const struct xdg_surface_interface xdg_surface_implementation = {
+    .destroy = &resource_destroy,
+    .get_toplevel = &xdg_surface_get_toplevel,
+    .get_popup = &xdg_surface_get_popup,
+    .set_window_geometry = &xdg_surface_set_window_geometry,
+    .ack_configure = &xdg_surface_ack_configure,
+};
+
+static void xdg_surface_destroy(struct wl_resource *resource) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    if (surface && surface->xdg_surface == resource)
+        surface->xdg_surface = NULL;
+}
+
+static void wm_base_create_positioner(struct wl_client *client, struct wl_resource *resource, uint32_t id) {
+    struct wl_resource *positioner = wl_resource_create(client, &xdg_positioner_interface, wl_resource_get_version(resource), id);
+    wl_resource_set_implementation(positioner, &positioner_implementation, NULL, NULL);
+}
+
+static void wm_base_get_xdg_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *surface_resource) {
+    struct surface *surface = wl_resource_get_user_data(surface_resource);
+    surface->xdg_surface = wl_resource_create(client, &xdg_surface_interface, wl_resource_get_version(resource), id);
+    wl_resource_set_implementation(surface->xdg_surface, &xdg_surface_implementation, surface, &xdg_surface_destroy);
+}
+
+static void wm_base_pong(struct wl_client *client, struct wl_resource *resource, uint32_t serial) {}
+
+static const struct xdg_wm_base_interface wm_base_implementation = {
+    .destroy = &resource_destroy,
+    .create_positioner = &wm_base_create_positioner,
+    .get_xdg_surface = &wm_base_get_xdg_surface,
+    .pong = &wm_base_pong,
+};
+
+static void bind_wm_base(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &xdg_wm_base_interface, version, id);
+    wl_resource_set_implementation(resource, &wm_base_implementation, NULL, NULL);
+}
+
+// zwlr_layer_shell_v1
+
+static void layer_surface_set_size(struct wl_client *client, struct wl_resource *resource, uint32_t width, uint32_t height) {
+    struct surface *surface = wl_resource_get_user_data(resource);
+    if (!surface)
+        return;
+    surface->requested_width = width;
+    surface->requested_height = height;
+}
+
+static void layer_surface_set_uint(struct wl_client *client, struct wl_resource *resource, uint32_t value) {}
+
+static void layer_surface_set_exclusive_zone(struct wl_client *client, struct wl_resource *resource, int32_t zone) {}
+
+static void layer_surface_set_margin(struct wl_client *client, struct wl_resource *resource, int32_t top, int32_t right, int32_t bottom, int32_t left) {}
+
+static void layer_surface_get_popup(struct wl_client *client, struct wl_resource *resource, struct wl_resource *popup) {}
+
+static void layer_surface_ack_configure(struct wl_client *client, struct wl_resource *resource, uint32_t serial) {
+    stats.acks++;
+}
+
+static const struct zwlr_layer_surface_v1_interface layer_surface_implementation = {
+    .set_size = &layer_surface_set_size,
+    .set_anchor = &layer_surface_set_uint,
+    .set_exclusive_zone = &layer_surface_set_exclusive_zone,
+    .set_margin = &layer_surface_set_margin,
+    .set_keyboard_interactivity = &layer_surface_set_uint,
+    .get_popup = &layer_surface_get_popup,
+    .ack_configure = &layer_surface_ack_configure,
+    .destroy = &resource_destroy,
+    .set_layer = &layer_surface_set_uint,
+};
+
+static void layer_shell_get_layer_surface(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *surface_resource, struct wl_resource *output, uint32_t layer, const char *namespace) {
+    struct surface *surface = wl_resource_get_user_data(surface_resource);
+    surface->role = ROLE_LAYER_SURFACE;
+    surface->configured = 0;
+    surface->role_resource = wl_resource_create(client, &zwlr_layer_surface_v1_interface, wl_resource_get_version(resource), id);
+    wl_resource_set_implementation(surface->role_resource, &layer_surface_implementation, surface, &role_destroy);
+}
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_implementation = {
+    .get_layer_surface = &layer_shell_get_layer_surface,
+    .destroy = &resource_destroy,
+};
+
+static void bind_layer_shell(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &zwlr_layer_shell_v1_interface, version, id);
+    wl_resource_set_implementation(resource, &layer_shell_implementation, NULL, NULL);
+}
+
+// zwp_text_input_manager_v3
+
+struct text_input {
+    struct tracked tracked;
+    char enabled;
+    uint32_t commits;
+};
+
+static void text_input_enable(struct wl_client *client, struct wl_resource *resource) {
+    struct text_input *text_input = wl_resource_get_user_data(resource);
+    text_input->enabled = 1;
+}
+
+static void text_input_disable(struct wl_client *client, struct wl_resource *resource) {
+    struct text_input *text_input = wl_resource_get_user_data(resource);
+    text_input->enabled = 0;
+}
+
+static void text_input_set_surrounding_text(struct wl_client *client, struct wl_resource *resource, const char *text, int32_t cursor, int32_t anchor) {}
+
+static void text_input_set_uint(struct wl_client *client, struct wl_resource *resource, uint32_t value) {}
+
+static void text_input_set_content_type(struct wl_client *client, struct wl_resource *resource, uint32_t hint, uint32_t purpose) {}
+
+static void text_input_set_cursor_rectangle(struct wl_client *client, struct wl_resource *resource, int32_t x, int32_t y, int32_t width, int32_t height) {}
+
+static void text_input_commit(struct wl_client *client, struct wl_resource *resource) {
+    struct text_input *text_input = wl_resource_get_user_data(resource);
+    text_input->commits++;
+    stats.text_input_commits++;
+}
+
+static const struct zwp_text_input_v3_interface text_input_implementation = {
+    .destroy = &resource_destroy,
+    .enable = &text_input_enable,
+    .disable = &text_input_disable,
+    .set_surrounding_text = &text_input_set_surrounding_text,
+    .set_text_change_cause = &text_input_set_uint,
+    .set_content_type = &text_input_set_content_type,
+    .set_cursor_rectangle = &text_input_set_cursor_rectangle,
+    .commit = &text_input_commit,
+};
+
+static void text_input_destroy(struct wl_resource *resource) {
+    struct text_input *text_input = wl_resource_get_user_data(resource);
+    wl_list_remove(&text_input->tracked.link);
+    free(text_input);
+}
+
+static void text_input_manager_get_text_input(struct wl_client *client, struct wl_resource *resource, uint32_t id, struct wl_resource *seat) {
+    struct text_input *text_input = calloc(1, sizeof(struct text_input));
+    text_input->tracked.resource = wl_resource_create(client, &zwp_text_input_v3_interface, 1, id);
+    wl_list_insert(text_inputs.prev, &text_input->tracked.link);
+    wl_resource_set_implementation(text_input->tracked.resource, &text_input_implementation, text_input, &text_input_destroy);
+}
+
+static const struct zwp_text_input_manager_v3_interface text_input_manager_implementation = {
+    .destroy = &resource_destroy,
+    .get_text_input = &text_input_manager_get_text_input,
+};
+
+static void bind_text_input_manager(struct wl_client *client, void *data, uint32_t version, uint32_t id) {
+    struct wl_resource *resource = wl_resource_create(client, &zwp_text_input_manager_v3_interface, version, id);
+    wl_resource_set_implementation(resource, &text_input_manager_implementation, NULL, NULL);
+}
+
+// Timeline
+
+static void send_to_pointers(const char *command, int x, int y) {
+    struct surface *focus = pointer_focus;
+    if (!strcmp(command, "enter")) {
+        focus = focus_candidate();
+        if (!focus)
+            return;
+        pointer_focus = focus;
+    }
+    if (!focus)
+        return;
+    struct tracked *pointer;
+    wl_list_for_each(pointer, &pointers, link) {
+        if (!strcmp(command, "enter")) {
+            wl_pointer_send_enter(pointer->resource, wl_display_next_serial(display), focus->resource, wl_fixed_from_int(x), wl_fixed_from_int(y));
+        } else if (!strcmp(command, "motion")) {
+            wl_pointer_send_motion(pointer->resource, event_time(), wl_fixed_from_int(x), wl_fixed_from_int(y));
+        } else if (!strcmp(command, "click")) {
+            wl_pointer_send_button(pointer->resource, wl_display_next_serial(display), event_time(), BTN_LEFT, WL_POINTER_BUTTON_STATE_PRESSED);
+            pointer_frame(pointer->resource);
+            wl_pointer_send_button(pointer->resource, wl_display_next_serial(display), event_time(), BTN_LEFT, WL_POINTER_BUTTON_STATE_RELEASED);
+        } else if (!strcmp(command, "leave")) {
+            wl_pointer_send_leave(pointer->resource, wl_display_next_serial(display), focus->resource);
+        }
+        pointer_frame(pointer->resource);
+    }
+    if (!strcmp(command, "leave"))
+        pointer_focus = NULL;
+}
+
+static void send_to_text_inputs(const char *command, const char *argument) {
+    if (!strcmp(command, "text-enter")) {
+        text_input_focus = focus_candidate();
+        if (!text_input_focus)
+            return;
+    }
+    if (!text_input_focus)
+        return;
+    struct text_input *text_input;
+    wl_list_for_each(text_input, &text_inputs, tracked.link) {
+        struct wl_resource *resource = text_input->tracked.resource;
+        if (!strcmp(command, "text-enter")) {
+            zwp_text_input_v3_send_enter(resource, text_input_focus->resource);
+            continue;
+        }
+        if (!strcmp(command, "text-leave")) {
+            zwp_text_input_v3_send_leave(resource, text_input_focus->resource);
+            continue;
+        }
+        if (!text_input->enabled)
+            continue;
+        if (!strcmp(command, "preedit")) {
+            int length = strlen(argument);
+            zwp_text_input_v3_send_preedit_string(resource, argument, length, length);
+        } else if (!strcmp(command, "commit")) {
+            zwp_text_input_v3_send_commit_string(resource, argument);
+        } else if (!strcmp(command, "delete")) {
+            unsigned before = 0, after = 0;
+            sscanf(argument, "%u %u", &before, &after);
+            zwp_text_input_v3_send_delete_surrounding_text(resource, before, after);
+        }
+        zwp_text_input_v3_send_done(resource, text_input->commits);
+    }
+    if (!strcmp(command, "text-leave"))
+        text_input_focus = NULL;
+}
+
+static void close_surfaces(void) {
+    struct surface *surface;
+    wl_list_for_each(surface, &surfaces, link) {
+        if (surface->role == ROLE_TOPLEVEL && surface->role_resource)
+            xdg_toplevel_send_close(surface->role_resource);
+        else if (surface->role == ROLE_LAYER_SURFACE && surface->role_resource)
+            zwlr_layer_surface_v1_send_closed(surface->role_resource);
+    }
+}
+
+static void configure_surfaces(const char *argument) {
+    int width = 0, height = 0, consumed = 0;
+    sscanf(argument, "%d %d %n", &width, &height, &consumed);
+    uint32_t states[8];
+    int state_count = 0;
+    char name[32];
+    const char *cursor = argument + consumed;
+    int length;
+    while (state_count < 8 && sscanf(cursor, "%31s%n", name, &length) == 1) {
+        cursor += length;
+        if (!strcmp(name, "suspended"))
+            states[state_count++] = XDG_TOPLEVEL_STATE_SUSPENDED;
+        else if (!strcmp(name, "activated"))
+            states[state_count++] = XDG_TOPLEVEL_STATE_ACTIVATED;
+        else if (!strcmp(name, "maximized"))
+            states[state_count++] = XDG_TOPLEVEL_STATE_MAXIMIZED;
+        else if (!strcmp(name, "fullscreen"))
+            states[state_count++] = XDG_TOPLEVEL_STATE_FULLSCREEN;
+    }
+    struct surface *surface;
+    wl_list_for_each(surface, &surfaces, link) {
+        if (surface->role_resource)
+            send_configure(surface, width, height, states, state_count);
+    }
+}
+
+static void run_event(const struct event *event) {
+    const char *command = event->command;
+    if (!strcmp(command, "configure")) {
+        configure_surfaces(event->argument);
+    } else if (!strcmp(command, "enter") || !strcmp(command, "motion") || !strcmp(command, "click") || !strcmp(command, "leave")) {
+        int x = 0, y = 0;
+        sscanf(event->argument, "%d %d", &x, &y);
+        send_to_pointers(command, x, y);
+    } else if (!strcmp(command, "frames")) {
+        frames_enabled = strcmp(event->argument, "off") != 0;
+    } else if (!strcmp(command, "releases")) {
+        releases_enabled = strcmp(event->argument, "off") != 0;
+        if (releases_enabled)
+            release_held_buffers();
+    } else if (!strncmp(command, "text-", 5) || !strcmp(command, "preedit") || !strcmp(command, "commit") || !strcmp(command, "delete")) {
+        send_to_text_inputs(command, event->argument);
+    } else if (!strcmp(command, "close")) {
+        close_surfaces();
+    }
+}
+
+static void end_run(void) {
+    if (ending)
+        return;
+    ending = 1;
+    run_ms = monotonic_ms() - start_ms;
+    close_surfaces();
+    wl_event_source_timer_update(exit_timer, EXIT_GRACE_MS);
+}
+
+static int handle_script_timer(void *data) {
+    int now = monotonic_ms() - start_ms;
+    while (next_event < event_count && events[next_event].time <= now)
+        run_event(&events[next_event++]);
+    if (now >= duration_ms) {
+        end_run();
+        return 0;
+    }
+    int next = duration_ms;
+    if (next_event < event_count && events[next_event].time < next)
+        next = events[next_event].time;
+    wl_event_source_timer_update(script_timer, next - now > 0 ? next - now : 1);
+    return 0;
+}
+
+// Stands in for the display refresh: every committed frame callback is answered
+static int handle_refresh_timer(void *data) {
+    wl_event_source_timer_update(refresh_timer, refresh_ms);
+    if (!frames_enabled)
+        return 0;
+    uint32_t time = event_time();
+    struct surface *surface;
+    wl_list_for_each(surface, &surfaces, link) {
+        struct tracked *callback, *tmp;
+        wl_list_for_each_safe(callback, tmp, &surface->callbacks, link) {
+            wl_callback_send_done(callback->resource, time);
+            wl_resource_destroy(callback->resource);
+            stats.frame_callbacks++;
+        }
+    }
+    return 0;
+}
+
+static int handle_exit_timer(void *data) {
+    if (client_pid <= 0)
+        return 0;
+    if (!sent_sigterm) {
+        fprintf(stderr, "mock-compositor: client did not exit, sending SIGTERM\n");
+        kill(client_pid, SIGTERM);
+        sent_sigterm = 1;
+        wl_event_source_timer_update(exit_timer, EXIT_GRACE_MS);
+    } else {
+        fprintf(stderr, "mock-compositor: client ignored SIGTERM, killing it\n");
+        kill(client_pid, SIGKILL);
+    }
+    return 0;
+}
+
+static int handle_sigchld(int signal_number, void *data) {
+    int status;
+    if (wait4(client_pid, &status, WNOHANG, &client_usage) != client_pid)
+        return 0;
+    client_status = status;
+    client_pid = -1;
+    if (!ending)
+        run_ms = monotonic_ms() - start_ms;
+    wl_display_terminate(display);
+    return 0;
+}
+
+static void count_message(enum wl_protocol_logger_type direction, const struct wl_protocol_logger_message *message) {
+    if (direction != WL_PROTOCOL_LOGGER_REQUEST)
+        return;
+    stats.requests++;
+    for (int i = 0; i < stats.message_count; i++) {
+        if (stats.messages[i].message == message->message) {
+            stats.messages[i].count++;
+            return;
+        }
+    }
+    if (stats.message_count == MAX_MESSAGE_COUNTS)
+        return;
+    struct message_count *count = &stats.messages[stats.message_count++];
+    count->message = message->message;
+    count->interface = wl_resource_get_class(message->resource);
+    count->count = 1;
+}
+
+static void protocol_logger(void *data, enum wl_protocol_logger_type direction, const struct wl_protocol_logger_message *message) {
+    count_message(direction, message);
+}
+
+static int compare_events(const void *a, const void *b) {
+    const struct event *x = a, *y = b;
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int load_script(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "mock-compositor: cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[512];
+    int line_number = 0;
+    int last_time = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = 0;
+        char *start = line + strspn(line, " \t");
+        if (!*start || *start == '#')
+            continue;
+        struct event event;
+        int consumed = 0;
+        if (sscanf(start, "%d %31s %n", &event.time, event.command, &consumed) < 2 || event.time < last_time) {
+            fprintf(stderr, "%s:%d: expected \"<ms> <command>\" with times in order\n", path, line_number);
+            fclose(file);
+            return -1;
+        }
+        last_time = event.time;
+        start += consumed;
+        // "repeat COUNT INTERVAL command ..." expands into COUNT events, which may interleave
+        // with the lines that follow
+        int count = 1, interval = 0;
+        if (!strcmp(event.command, "repeat")) {
+            if (sscanf(start, "%d %d %31s %n", &count, &interval, event.command, &consumed) < 3 || count < 1 || interval < 0) {
+                fprintf(stderr, "%s:%d: expected \"<ms> repeat <count> <interval> <command>\"\n", path, line_number);
+                fclose(file);
+                return -1;
+            }
+            start += consumed;
+        }
+        snprintf(event.argument, sizeof(event.argument), "%s", start);
+        for (int i = 0; i < count; i++) {
+            if (event_count == MAX_EVENTS) {
+                fprintf(stderr, "%s:%d: more than %d events\n", path, line_number, MAX_EVENTS);
+                fclose(file);
+                return -1;
+            }
+            events[event_count] = event;
+            events[event_count].time = event.time + i * interval;
+            events[event_count].order = event_count;
+            event_count++;
+        }
+    }
+    fclose(file);
+    qsort(events, event_count, sizeof(struct event), &compare_events);
+    return 0;
+}
+
+static pid_t spawn_client(char **argv, const char *allocation_counter) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        return -1;
+    int allocation_fds[2] = {-1, -1};
+    if (allocation_counter && pipe2(allocation_fds, O_CLOEXEC) < 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (allocation_counter) {
+            char value[16];
+            snprintf(value, sizeof(value), "%d", dup(allocation_fds[1]));
+            setenv("MOCK_ALLOC_FD", value, 1);
+            setenv("LD_PRELOAD", allocation_counter, 1);
+        }
+        // The signals wl_event_loop_add_signal() blocked must not stay blocked in the client
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        int fd = dup(fds[1]);
+        char value[16];
+        snprintf(value, sizeof(value), "%d", fd);
+        setenv("WAYLAND_SOCKET", value, 1);
+        unsetenv("WAYLAND_DISPLAY");
+        execvp(argv[0], argv);
+        fprintf(stderr, "mock-compositor: cannot run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    close(fds[1]);
+    if (allocation_counter) {
+        close(allocation_fds[1]);
+        allocation_fd = allocation_fds[0];
+    }
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    client = wl_client_create(display, fds[0]);
+    return pid;
+}
+
+// The client has exited, so the report is either in the pipe or was never written
+static void read_allocations(void) {
+    if (allocation_fd < 0)
+        return;
+    char line[64];
+    ssize_t length = read(allocation_fd, line, sizeof(line) - 1);
+    close(allocation_fd);
+    if (length <= 0)
+        return;
+    line[length] = 0;
+    unsigned long long count, bytes;
+    if (sscanf(line, "%llu %llu", &count, &bytes) != 2)
+        return;
+    allocations = count;
+    allocated_bytes = bytes;
+    allocations_counted = 1;
+}
+
+static int compare_counts(const void *a, const void *b) {
+    const struct message_count *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static double cpu_ms(const struct rusage *usage) {
+    return usage->ru_utime.tv_sec * 1e3 + usage->ru_utime.tv_usec / 1e3 + usage->ru_stime.tv_sec * 1e3 + usage->ru_stime.tv_usec / 1e3;
+}
+
+static void print_stats(FILE *file) {
+    fprintf(file, "mock-compositor: %llu frames in %llu commits, %llu frame callbacks, %llu configures and %llu acks, %llu text-input commits\n",
+        (unsigned long long)stats.frames,
+        (unsigned long long)stats.commits,
+        (unsigned long long)stats.frame_callbacks,
+        (unsigned long long)stats.configures,
+        (unsigned long long)stats.acks,
+        (unsigned long long)stats.text_input_commits);
+    fprintf(file, "mock-compositor: %llu requests, client cpu %.1f ms\n",
+        (unsigned long long)stats.requests,
+        cpu_ms(&client_usage));
+    if (allocations_counted)
+        fprintf(file, "mock-compositor: %llu allocations, %llu bytes\n", (unsigned long long)allocations, (unsigned long long)allocated_bytes);
+    qsort(stats.messages, stats.message_count, sizeof(struct message_count), &compare_counts);
+    for (int i = 0; i < stats.message_count && i < 8; i++)
+        fprintf(file, "    %s.%s %llu\n", stats.messages[i].interface, stats.messages[i].message->name, (unsigned long long)stats.messages[i].count);
+    fflush(file);
+}
+
+static double per_frame(double value) {
+    return stats.frames ? value / stats.frames : 0;
+}
+
+// One object per run, for comparing benchmark results between builds
+static int write_json(const char *path, const char *name, char **client_argv) {
+    FILE *file = !strcmp(path, "-") ? stdout : fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "mock-compositor: cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    double seconds = run_ms / 1e3;
+    fprintf(file, "{\n");
+    fprintf(file, "  \"name\": \"%s\",\n", name ? name : client_argv[0]);
+    fprintf(file, "  \"client\": \"%s\",\n", client_argv[0]);
+    fprintf(file, "  \"run_ms\": %llu,\n", (unsigned long long)run_ms);
+    fprintf(file, "  \"refresh_ms\": %d,\n", refresh_ms);
+    fprintf(file, "  \"frames\": %llu,\n", (unsigned long long)stats.frames);
+    fprintf(file, "  \"frames_per_second\": %.2f,\n", seconds > 0 ? stats.frames / seconds : 0);
+    fprintf(file, "  \"commits\": %llu,\n", (unsigned long long)stats.commits);
+    fprintf(file, "  \"requests\": %llu,\n", (unsigned long long)stats.requests);
+    fprintf(file, "  \"requests_per_frame\": %.2f,\n", per_frame(stats.requests));
+    if (allocations_counted) {
+        fprintf(file, "  \"allocations\": %llu,\n", (unsigned long long)allocations);
+        fprintf(file, "  \"allocations_per_frame\": %.2f,\n", per_frame(allocations));
+        fprintf(file, "  \"allocated_bytes_per_frame\": %.0f,\n", per_frame(allocated_bytes));
+    }
+    fprintf(file, "  \"cpu_ms\": %.3f,\n", cpu_ms(&client_usage));
+    fprintf(file, "  \"cpu_ms_per_frame\": %.3f,\n", per_frame(cpu_ms(&client_usage)));
+    fprintf(file, "  \"max_rss_kib\": %ld,\n", client_usage.ru_maxrss);
+    fprintf(file, "  \"messages\": {");
+    for (int i = 0; i < stats.message_count; i++)
+        fprintf(file, "%s\n    \"%s.%s\": %llu", i ? "," : "", stats.messages[i].interface, stats.messages[i].message->name, (unsigned long long)stats.messages[i].count);
+    fprintf(file, "\n  }\n}\n");
+    if (file != stdout)
+        fclose(file);
+    return 0;
+}
+
+// Returns the number of limits the run broke
+static int check_limits(void) {
+    int failures = 0;
+    if (WIFSIGNALED(client_status) && !(sent_sigterm && WTERMSIG(client_status) == SIGTERM)) {
+        fprintf(stderr, "FAIL: client killed by signal %d\n", WTERMSIG(client_status));
+        failures++;
+    } else if (WIFEXITED(client_status) && WEXITSTATUS(client_status) != 0) {
+        fprintf(stderr, "FAIL: client exited with status %d\n", WEXITSTATUS(client_status));
+        failures++;
+    }
+    if (limits.min_frames >= 0 && stats.frames < (uint64_t)limits.min_frames) {
+        fprintf(stderr, "FAIL: %llu frames, expected at least %ld\n", (unsigned long long)stats.frames, limits.min_frames);
+        failures++;
+    }
+    if (limits.max_frames >= 0 && stats.frames > (uint64_t)limits.max_frames) {
+        fprintf(stderr, "FAIL: %llu frames, expected at most %ld\n", (unsigned long long)stats.frames, limits.max_frames);
+        failures++;
+    }
+    if (limits.max_requests >= 0 && stats.requests > (uint64_t)limits.max_requests) {
+        fprintf(stderr, "FAIL: %llu requests, expected at most %ld\n", (unsigned long long)stats.requests, limits.max_requests);
+        failures++;
+    }
+    if (limits.max_cpu_ms >= 0 && cpu_ms(&client_usage) > limits.max_cpu_ms) {
+        fprintf(stderr, "FAIL: client used %.1f ms of cpu, expected at most %ld\n", cpu_ms(&client_usage), limits.max_cpu_ms);
+        failures++;
+    }
+    return failures;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--script FILE] [--duration MS] [--refresh HZ] [--min-frames N] [--max-frames N] [--max-requests N] [--max-cpu-ms N] [--count-allocations alloc-counter.so] [--json FILE] [--name NAME] -- CLIENT [ARGS]\n", name);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        {"script", required_argument, NULL, 's'},
+        {"duration", required_argument, NULL, 'd'},
+        {"refresh", required_argument, NULL, 'r'},
+        {"min-frames", required_argument, NULL, 'f'},
+        {"max-frames", required_argument, NULL, 'F'},
+        {"max-requests", required_argument, NULL, 'R'},
+        {"max-cpu-ms", required_argument, NULL, 'c'},
+        {"count-allocations", required_argument, NULL, 'a'},
+        {"json", required_argument, NULL, 'j'},
+        {"name", required_argument, NULL, 'n'},
+        {0},
+    };
+    const char *script = NULL;
+    const char *allocation_counter = NULL;
+    const char *json = NULL;
+    const char *name = NULL;
+    int option;
+    while ((option = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (option) {
+            case 's': script = optarg; break;
+            case 'd': duration_ms = atoi(optarg); break;
+            case 'r': refresh_ms = 1000 / (atoi(optarg) > 0 ? atoi(optarg) : 60); break;
+            case 'f': limits.min_frames = atol(optarg); break;
+            case 'F': limits.max_frames = atol(optarg); break;
+            case 'R': limits.max_requests = atol(optarg); break;
+            case 'c': limits.max_cpu_ms = atol(optarg); break;
+            case 'a': allocation_counter = optarg; break;
+            case 'j': json = optarg; break;
+            case 'n': name = optarg; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (script && load_script(script) < 0)
+        return 2;
+
+    wl_list_init(&surfaces);
+    wl_list_init(&held_buffers);
+    wl_list_init(&pointers);
+    wl_list_init(&text_inputs);
+    display = wl_display_create();
+    loop = wl_display_get_event_loop(display);
+    wl_display_init_shm(display);
+    wl_global_create(display, &wl_compositor_interface, 4, NULL, &bind_compositor);
+    wl_global_create(display, &wl_subcompositor_interface, 1, NULL, &bind_subcompositor);
+    wl_global_create(display, &wl_seat_interface, 5, NULL, &bind_seat);
+    wl_global_create(display, &xdg_wm_base_interface, xdg_wm_base_interface.version, NULL, &bind_wm_base);
+    wl_global_create(display, &zwlr_layer_shell_v1_interface, zwlr_layer_shell_v1_interface.version, NULL, &bind_layer_shell);
+    wl_global_create(display, &zwp_text_input_manager_v3_interface, 1, NULL, &bind_text_input_manager);
+    wl_display_add_protocol_logger(display, &protocol_logger, NULL);
+
+    wl_event_loop_add_signal(loop, SIGCHLD, &handle_sigchld, NULL);
+    script_timer = wl_event_loop_add_timer(loop, &handle_script_timer, NULL);
+    refresh_timer = wl_event_loop_add_timer(loop, &handle_refresh_timer, NULL);
+    exit_timer = wl_event_loop_add_timer(loop, &handle_exit_timer, NULL);
+
+    start_ms = monotonic_ms();
+    client_pid = spawn_client(argv + optind, allocation_counter);
+    if (client_pid < 0) {
+        fprintf(stderr, "mock-compositor: cannot start %s\n", argv[optind]);
+        return 2;
+    }
+    wl_event_source_timer_update(script_timer, 1);
+    wl_event_source_timer_update(refresh_timer, refresh_ms);
+
+    wl_display_run(display);
+
+    read_allocations();
+    print_stats(stdout);
+    if (json && write_json(json, name, argv + optind) < 0)
+        return 2;
+    int failures = check_limits();
+    wl_display_destroy(display);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,255 @@
+#include "text-buffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct text_buffer {
+    // The text is data[0, gap_start) followed by data[gap_end, capacity), the cursor is at
+    // gap_start
+    char *data;
+    size_t capacity;
+    size_t gap_start, gap_end;
+    // Newlines in the whole text and in front of the cursor, kept up to date by every edit
+    // so nothing ever has to scan the document
+    size_t newlines;
+    size_t cursor_line;
+    char *preedit;
+    int32_t preedit_cursor_begin, preedit_cursor_end;
+    char dirty;
+    struct text_dirty_lines dirty_lines;
+};
+
+static size_t count_newlines(const char *text, size_t length) {
+    size_t count = 0;
+    const char *end = text + length;
+    while ((text = memchr(text, '\n', end - text))) {
+        count++;
+        text++;
+    }
+    return count;
+}
+
+static int is_continuation(char c) {
+    return ((unsigned char)c & 0xc0) == 0x80;
+}
+
+static char byte_at(const struct text_buffer *buffer, size_t position) {
+    if (position < buffer->gap_start)
+        return buffer->data[position];
+    return buffer->data[position + buffer->gap_end - buffer->gap_start];
+}
+
+// Moves a position inside a code point back to where that code point starts
+static size_t snap_back(const struct text_buffer *buffer, size_t position) {
+    size_t length = text_buffer_length(buffer);
+    if (position >= length)
+        return length;
+    while (position > 0 && is_continuation(byte_at(buffer, position)))
+        position--;
+    return position;
+}
+
+static void mark_dirty(struct text_buffer *buffer, size_t first, size_t last, char to_end) {
+    struct text_dirty_lines *lines = &buffer->dirty_lines;
+    if (!buffer->dirty) {
+        lines->first = first;
+        lines->last = last;
+        lines->to_end = to_end;
+        buffer->dirty = 1;
+        return;
+    }
+    if (first < lines->first)
+        lines->first = first;
+    if (last > lines->last)
+        lines->last = last;
+    lines->to_end |= to_end;
+}
+
+struct text_buffer *text_buffer_create(void) {
+    struct text_buffer *buffer = malloc(sizeof(struct text_buffer));
+    memset(buffer, 0, sizeof(struct text_buffer));
+    buffer->preedit_cursor_begin = -1;
+    buffer->preedit_cursor_end = -1;
+    return buffer;
+}
+
+void text_buffer_destroy(struct text_buffer *buffer) {
+    free(buffer->data);
+    free(buffer->preedit);
+    free(buffer);
+}
+
+size_t text_buffer_length(const struct text_buffer *buffer) {
+    return buffer->capacity - (buffer->gap_end - buffer->gap_start);
+}
+
+size_t text_buffer_line_count(const struct text_buffer *buffer) {
+    return buffer->newlines + 1;
+}
+
+size_t text_buffer_cursor(const struct text_buffer *buffer) {
+    return buffer->gap_start;
+}
+
+size_t text_buffer_cursor_line(const struct text_buffer *buffer) {
+    return buffer->cursor_line;
+}
+
+void text_buffer_move_cursor(struct text_buffer *buffer, size_t position) {
+    position = snap_back(buffer, position);
+    size_t old_line = buffer->cursor_line;
+    if (position < buffer->gap_start) {
+        size_t count = buffer->gap_start - position;
+        buffer->cursor_line -= count_newlines(buffer->data + position, count);
+        memmove(buffer->data + buffer->gap_end - count, buffer->data + position, count);
+        buffer->gap_start -= count;
+        buffer->gap_end -= count;
+    } else if (position > buffer->gap_start) {
+        size_t count = position - buffer->gap_start;
+        memmove(buffer->data + buffer->gap_start, buffer->data + buffer->gap_end, count);
+        buffer->cursor_line += count_newlines(buffer->data + buffer->gap_start, count);
+        buffer->gap_start += count;
+        buffer->gap_end += count;
+    }
+    if (buffer->cursor_line != old_line) {
+        mark_dirty(buffer, old_line, old_line, 0);
+        mark_dirty(buffer, buffer->cursor_line, buffer->cursor_line, 0);
+    }
+}
+
+size_t text_buffer_snap(const struct text_buffer *buffer, size_t position) {
+    return snap_back(buffer, position);
+}
+
+size_t text_buffer_line_start(const struct text_buffer *buffer, size_t line) {
+    if (line > buffer->newlines)
+        return text_buffer_length(buffer);
+    if (line <= buffer->cursor_line) {
+        // The line starts after the newline that ends the one before it
+        size_t newlines = buffer->cursor_line - line + 1;
+        for (size_t position = buffer->gap_start; position > 0; position--) {
+            if (buffer->data[position - 1] == '\n' && --newlines == 0)
+                return position;
+        }
+        return 0;
+    }
+    size_t newlines = line - buffer->cursor_line;
+    const char *text = buffer->data + buffer->gap_end;
+    const char *end = buffer->data + buffer->capacity;
+    while ((text = memchr(text, '\n', end - text))) {
+        text++;
+        if (--newlines == 0)
+            break;
+    }
+    return text - buffer->data - (buffer->gap_end - buffer->gap_start);
+}
+
+// Makes the gap at least size bytes, doubling so a long run of typing reallocates rarely
+static void reserve(struct text_buffer *buffer, size_t size) {
+    size_t gap = buffer->gap_end - buffer->gap_start;
+    if (gap >= size)
+        return;
+    size_t length = buffer->capacity - gap;
+    size_t tail = buffer->capacity - buffer->gap_end;
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+    while (capacity - length < size)
+        capacity *= 2;
+    buffer->data = realloc(buffer->data, capacity);
+    memmove(buffer->data + capacity - tail, buffer->data + buffer->gap_end, tail);
+    buffer->gap_end = capacity - tail;
+    buffer->capacity = capacity;
+}
+
+void text_buffer_insert(struct text_buffer *buffer, const char *text, size_t length) {
+    if (!length)
+        return;
+    reserve(buffer, length);
+    memcpy(buffer->data + buffer->gap_start, text, length);
+    size_t newlines = count_newlines(text, length);
+    size_t first = buffer->cursor_line;
+    buffer->gap_start += length;
+    buffer->newlines += newlines;
+    buffer->cursor_line += newlines;
+    mark_dirty(buffer, first, buffer->cursor_line, newlines > 0);
+}
+
+void text_buffer_delete(struct text_buffer *buffer, size_t before, size_t after) {
+    size_t length = text_buffer_length(buffer);
+    size_t cursor = buffer->gap_start;
+    size_t start = cursor - (before < cursor ? before : cursor);
+    size_t end = cursor + (after < length - cursor ? after : length - cursor);
+    // Lengths that end inside a code point delete less rather than leave half of one behind
+    while (start < cursor && is_continuation(byte_at(buffer, start)))
+        start++;
+    while (end > cursor && end < length && is_continuation(byte_at(buffer, end)))
+        end--;
+    if (start == end)
+        return;
+
+    size_t newlines_before = count_newlines(buffer->data + start, cursor - start);
+    size_t newlines_after = count_newlines(buffer->data + buffer->gap_end, end - cursor);
+    buffer->gap_start = start;
+    buffer->gap_end += end - cursor;
+    buffer->cursor_line -= newlines_before;
+    buffer->newlines -= newlines_before + newlines_after;
+    mark_dirty(buffer, buffer->cursor_line, buffer->cursor_line, newlines_before + newlines_after > 0);
+}
+
+size_t text_buffer_copy(const struct text_buffer *buffer, size_t start, size_t end, char *out) {
+    size_t length = text_buffer_length(buffer);
+    if (end > length)
+        end = length;
+    if (start >= end)
+        return 0;
+    size_t copied = 0;
+    if (start < buffer->gap_start) {
+        size_t count = (end < buffer->gap_start ? end : buffer->gap_start) - start;
+        memcpy(out, buffer->data + start, count);
+        copied = count;
+        start += count;
+    }
+    if (start < end) {
+        memcpy(out + copied, buffer->data + start + buffer->gap_end - buffer->gap_start, end - start);
+        copied += end - start;
+    }
+    return copied;
+}
+
+// Clamps an offset into the preedit to a code point boundary inside it
+static int32_t snap_preedit(const char *preedit, int32_t offset) {
+    int32_t length = strlen(preedit);
+    if (offset > length)
+        offset = length;
+    while (offset > 0 && is_continuation(preedit[offset]))
+        offset--;
+    return offset;
+}
+
+void text_buffer_set_preedit(struct text_buffer *buffer, const char *text, int32_t cursor_begin, int32_t cursor_end) {
+    if (text && !*text)
+        text = NULL;
+    if (!buffer->preedit && !text)
+        return;
+    free(buffer->preedit);
+    buffer->preedit = text ? strdup(text) : NULL;
+    buffer->preedit_cursor_begin = -1;
+    buffer->preedit_cursor_end = -1;
+    if (text && cursor_begin >= 0 && cursor_end >= 0) {
+        buffer->preedit_cursor_begin = snap_preedit(text, cursor_begin);
+        buffer->preedit_cursor_end = snap_preedit(text, cursor_end);
+    }
+    mark_dirty(buffer, buffer->cursor_line, buffer->cursor_line, 0);
+}
+
+const char *text_buffer_preedit(const struct text_buffer *buffer, int32_t *cursor_begin, int32_t *cursor_end) {
+    *cursor_begin = buffer->preedit_cursor_begin;
+    *cursor_end = buffer->preedit_cursor_end;
+    return buffer->preedit;
+}
+
+int text_buffer_take_dirty(struct text_buffer *buffer, struct text_dirty_lines *lines) {
+    if (!buffer->dirty)
+        return 0;
+    *lines = buffer->dirty_lines;
+    buffer->dirty = 0;
+    return 1;
+}
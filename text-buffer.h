@@ -0,0 +1,55 @@
+#ifndef TEXT_BUFFER_H
+#define TEXT_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An editable UTF-8 document stored as a gap buffer: the text before the cursor sits at the
+// start of one allocation, the text after it at the end, and edits at the cursor only touch
+// the gap in between. Typing and deleting cost the same on a 500 KiB document as on an
+// empty one, only moving the cursor far away pays for the distance.
+//
+// Offsets and lengths are in bytes, and are snapped to code point boundaries so an edit can
+// never split a character.
+
+struct text_buffer;
+
+// Lines touched since the last text_buffer_take_dirty(), lines are numbered from 0
+struct text_dirty_lines {
+    size_t first, last;
+    // Set when lines were added or removed, every line after first has moved
+    char to_end;
+};
+
+struct text_buffer *text_buffer_create(void);
+void text_buffer_destroy(struct text_buffer *buffer);
+
+size_t text_buffer_length(const struct text_buffer *buffer);
+size_t text_buffer_line_count(const struct text_buffer *buffer);
+// The cursor is where text is inserted, and the line it is on
+size_t text_buffer_cursor(const struct text_buffer *buffer);
+size_t text_buffer_cursor_line(const struct text_buffer *buffer);
+void text_buffer_move_cursor(struct text_buffer *buffer, size_t position);
+// Moves a position back to the start of the code point it falls in, clamped to the length
+size_t text_buffer_snap(const struct text_buffer *buffer, size_t position);
+// Offset of the first byte of a line, the text length for lines past the end. Scans from the
+// cursor, so it is cheap for the lines around it.
+size_t text_buffer_line_start(const struct text_buffer *buffer, size_t line);
+
+// Inserts before the cursor and leaves the cursor after the new text
+void text_buffer_insert(struct text_buffer *buffer, const char *text, size_t length);
+// Deletes up to before bytes in front of the cursor and after bytes behind it
+void text_buffer_delete(struct text_buffer *buffer, size_t before, size_t after);
+// Copies [start, end) to out, which must have room for end - start bytes, and returns the
+// number of bytes copied
+size_t text_buffer_copy(const struct text_buffer *buffer, size_t start, size_t end, char *out);
+
+// The preedit is shown at the cursor but is not part of the text. cursor_begin and
+// cursor_end are byte offsets into it, -1 hides the cursor. NULL removes the preedit.
+void text_buffer_set_preedit(struct text_buffer *buffer, const char *text, int32_t cursor_begin, int32_t cursor_end);
+const char *text_buffer_preedit(const struct text_buffer *buffer, int32_t *cursor_begin, int32_t *cursor_end);
+
+// Returns 0 if nothing changed, otherwise fills in the dirty lines and resets them
+int text_buffer_take_dirty(struct text_buffer *buffer, struct text_dirty_lines *lines);
+
+#endif // TEXT_BUFFER_H
@@ -0,0 +1,227 @@
+#include "text-input-state.h"
+#include <stdlib.h>
+#include <string.h>
+
+enum field {
+    FIELD_ENABLED,
+    FIELD_SURROUNDING_TEXT,
+    FIELD_CURSOR_RECTANGLE,
+    FIELD_CONTENT_TYPE,
+    FIELD_COUNT,
+};
+
+struct fields {
+    char enabled;
+    // NULL until set, like the protocol's initial state
+    char *surrounding_text;
+    int32_t cursor, anchor;
+    size_t surrounding_offset;
+    char has_cursor_rectangle;
+    int32_t cursor_rectangle[4];
+    uint32_t content_hint, content_purpose;
+};
+
+struct text_input_state {
+    struct zwp_text_input_v3 *text_input;
+    // What the application wants, and what the compositor has as of the last commit
+    struct fields pending, current;
+    char focused;
+    // Set by a done event for an older commit, cleared by one for the newest
+    char stale;
+    uint32_t commit_count;
+    // Setter calls that changed a field since the last flush, to tell how many of them
+    // never had to go out
+    uint32_t changes[FIELD_COUNT];
+    uint64_t requests_sent;
+    uint64_t requests_avoided;
+    uint64_t commits_sent;
+    uint64_t stale_done;
+};
+
+static void reset_fields(struct fields *fields) {
+    free(fields->surrounding_text);
+    memset(fields, 0, sizeof(struct fields));
+}
+
+static int field_differs(const struct fields *a, const struct fields *b, enum field field) {
+    switch (field) {
+        case FIELD_ENABLED:
+            return a->enabled != b->enabled;
+        case FIELD_SURROUNDING_TEXT:
+            if (!a->surrounding_text || !b->surrounding_text)
+                return a->surrounding_text != b->surrounding_text;
+            return a->cursor != b->cursor || a->anchor != b->anchor || a->surrounding_offset != b->surrounding_offset || strcmp(a->surrounding_text, b->surrounding_text);
+        case FIELD_CURSOR_RECTANGLE:
+            return a->has_cursor_rectangle != b->has_cursor_rectangle || memcmp(a->cursor_rectangle, b->cursor_rectangle, sizeof(a->cursor_rectangle));
+        case FIELD_CONTENT_TYPE:
+            return a->content_hint != b->content_hint || a->content_purpose != b->content_purpose;
+        default:
+            return 0;
+    }
+}
+
+// Copies one field from src to dst and tells the compositor about it
+static void send_field(struct text_input_state *state, enum field field) {
+    struct fields *src = &state->pending;
+    struct fields *dst = &state->current;
+    switch (field) {
+        case FIELD_ENABLED:
+            // Handled by text_input_state_flush(), enabling resets everything else
+            return;
+        case FIELD_SURROUNDING_TEXT:
+            free(dst->surrounding_text);
+            dst->surrounding_text = strdup(src->surrounding_text);
+            dst->cursor = src->cursor;
+            dst->anchor = src->anchor;
+            dst->surrounding_offset = src->surrounding_offset;
+            zwp_text_input_v3_set_surrounding_text(state->text_input, src->surrounding_text, src->cursor, src->anchor);
+            break;
+        case FIELD_CURSOR_RECTANGLE:
+            dst->has_cursor_rectangle = 1;
+            memcpy(dst->cursor_rectangle, src->cursor_rectangle, sizeof(dst->cursor_rectangle));
+            zwp_text_input_v3_set_cursor_rectangle(state->text_input, src->cursor_rectangle[0], src->cursor_rectangle[1], src->cursor_rectangle[2], src->cursor_rectangle[3]);
+            break;
+        case FIELD_CONTENT_TYPE:
+            dst->content_hint = src->content_hint;
+            dst->content_purpose = src->content_purpose;
+            zwp_text_input_v3_set_content_type(state->text_input, src->content_hint, src->content_purpose);
+            break;
+        default:
+            return;
+    }
+    state->requests_sent++;
+}
+
+struct text_input_state *text_input_state_create(struct zwp_text_input_v3 *text_input) {
+    struct text_input_state *state = malloc(sizeof(struct text_input_state));
+    memset(state, 0, sizeof(struct text_input_state));
+    state->text_input = text_input;
+    return state;
+}
+
+void text_input_state_destroy(struct text_input_state *state) {
+    reset_fields(&state->pending);
+    reset_fields(&state->current);
+    free(state);
+}
+
+// Counts a setter call, one that asks for what is already pending costs nothing right away
+static void note_change(struct text_input_state *state, enum field field, int changed) {
+    if (changed)
+        state->changes[field]++;
+    else
+        state->requests_avoided++;
+}
+
+void text_input_state_set_enabled(struct text_input_state *state, char enabled) {
+    note_change(state, FIELD_ENABLED, state->pending.enabled != enabled);
+    state->pending.enabled = enabled;
+}
+
+void text_input_state_set_surrounding_text(struct text_input_state *state, const char *text, int32_t cursor, int32_t anchor, size_t offset) {
+    struct fields *pending = &state->pending;
+    int changed = !pending->surrounding_text || pending->cursor != cursor || pending->anchor != anchor || pending->surrounding_offset != offset || strcmp(pending->surrounding_text, text);
+    note_change(state, FIELD_SURROUNDING_TEXT, changed);
+    if (!changed)
+        return;
+    free(pending->surrounding_text);
+    pending->surrounding_text = strdup(text);
+    pending->cursor = cursor;
+    pending->anchor = anchor;
+    pending->surrounding_offset = offset;
+}
+
+void text_input_state_set_cursor_rectangle(struct text_input_state *state, int32_t x, int32_t y, int32_t width, int32_t height) {
+    struct fields *pending = &state->pending;
+    int32_t rectangle[4] = {x, y, width, height};
+    note_change(state, FIELD_CURSOR_RECTANGLE, !pending->has_cursor_rectangle || memcmp(pending->cursor_rectangle, rectangle, sizeof(rectangle)));
+    pending->has_cursor_rectangle = 1;
+    memcpy(pending->cursor_rectangle, rectangle, sizeof(rectangle));
+}
+
+void text_input_state_set_content_type(struct text_input_state *state, uint32_t hint, uint32_t purpose) {
+    struct fields *pending = &state->pending;
+    note_change(state, FIELD_CONTENT_TYPE, pending->content_hint != hint || pending->content_purpose != purpose);
+    pending->content_hint = hint;
+    pending->content_purpose = purpose;
+}
+
+void text_input_state_enter(struct text_input_state *state) {
+    state->focused = 1;
+    reset_fields(&state->current);
+}
+
+void text_input_state_leave(struct text_input_state *state) {
+    state->focused = 0;
+    reset_fields(&state->current);
+}
+
+int text_input_state_done(struct text_input_state *state, uint32_t serial) {
+    state->stale = serial != state->commit_count;
+    if (state->stale)
+        state->stale_done++;
+    return !state->stale;
+}
+
+void text_input_state_flush(struct text_input_state *state) {
+    if (!state->focused)
+        return;
+    struct fields *pending = &state->pending;
+    struct fields *current = &state->current;
+    uint64_t sent = state->requests_sent;
+    uint32_t field_sent[FIELD_COUNT] = {0};
+    if (pending->enabled != current->enabled) {
+        if (pending->enabled)
+            zwp_text_input_v3_enable(state->text_input);
+        else
+            zwp_text_input_v3_disable(state->text_input);
+        // Either one resets the rest of the state on the compositor side
+        reset_fields(current);
+        current->enabled = pending->enabled;
+        state->requests_sent++;
+        field_sent[FIELD_ENABLED] = 1;
+    } else if (state->stale || !pending->enabled) {
+        // The protocol wants new state to wait for a done event that matches the last commit,
+        // and a disabled text input has no use for it
+        return;
+    }
+
+    if (pending->enabled) {
+        for (int field = FIELD_SURROUNDING_TEXT; field < FIELD_COUNT; field++) {
+            if (!field_differs(pending, current, field))
+                continue;
+            send_field(state, field);
+            field_sent[field] = 1;
+        }
+    }
+    // Of all the setter calls since the last flush, at most one per field went out
+    for (int field = 0; field < FIELD_COUNT; field++) {
+        if (state->changes[field] > field_sent[field])
+            state->requests_avoided += state->changes[field] - field_sent[field];
+        state->changes[field] = 0;
+    }
+
+    if (state->requests_sent == sent)
+        return;
+    zwp_text_input_v3_commit(state->text_input);
+    state->commit_count++;
+    state->commits_sent++;
+}
+
+int text_input_state_surrounding_window(const struct text_input_state *state, size_t *start, size_t *end) {
+    const struct fields *current = &state->current;
+    if (!current->surrounding_text)
+        return 0;
+    *start = current->surrounding_offset;
+    *end = current->surrounding_offset + strlen(current->surrounding_text);
+    return 1;
+}
+
+void text_input_state_dump(const struct text_input_state *state, FILE *file) {
+    fprintf(file, "text-input: %llu requests in %llu commits, %llu redundant requests avoided, %llu stale done events\n",
+        (unsigned long long)state->requests_sent,
+        (unsigned long long)state->commits_sent,
+        (unsigned long long)state->requests_avoided,
+        (unsigned long long)state->stale_done);
+    fflush(file);
+}
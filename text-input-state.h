@@ -0,0 +1,40 @@
+#ifndef TEXT_INPUT_STATE_H
+#define TEXT_INPUT_STATE_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "text-input-unstable-v3-client.h"
+
+// Client side copy of the zwp_text_input_v3 state. The setters only record what the
+// application wants, text_input_state_flush() then sends the fields that differ from what
+// the compositor already has, all in one commit. Every commit goes through the compositor
+// to the input method, so the ones that would change nothing are the ones worth avoiding.
+
+struct text_input_state;
+
+struct text_input_state *text_input_state_create(struct zwp_text_input_v3 *text_input);
+void text_input_state_destroy(struct text_input_state *state);
+
+void text_input_state_set_enabled(struct text_input_state *state, char enabled);
+// cursor and anchor are byte offsets into text, offset is where text starts in the caller's
+// document and never goes to the compositor
+void text_input_state_set_surrounding_text(struct text_input_state *state, const char *text, int32_t cursor, int32_t anchor, size_t offset);
+void text_input_state_set_cursor_rectangle(struct text_input_state *state, int32_t x, int32_t y, int32_t width, int32_t height);
+void text_input_state_set_content_type(struct text_input_state *state, uint32_t hint, uint32_t purpose);
+
+// Call from zwp_text_input_v3.enter and leave, the compositor forgets the state on either
+void text_input_state_enter(struct text_input_state *state);
+void text_input_state_leave(struct text_input_state *state);
+// Call from zwp_text_input_v3.done. Returns 0 if the serial is stale, the text changes in the
+// event still apply but new state is held back until the compositor has caught up.
+int text_input_state_done(struct text_input_state *state, uint32_t serial);
+
+// Sends what changed since the last flush, if anything, call once per frame
+void text_input_state_flush(struct text_input_state *state);
+// The part of the document the compositor last got as surrounding text, which is what
+// delete_surrounding_text refers to. Returns 0 if it has none.
+int text_input_state_surrounding_window(const struct text_input_state *state, size_t *start, size_t *end);
+void text_input_state_dump(const struct text_input_state *state, FILE *file);
+
+#endif // TEXT_INPUT_STATE_H
@@ -5,25 +5,91 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
 #include "xdg-shell-client.h"
+#include "shm-buffer.h"
+#include "backend.h"
+#include "damage.h"
+#include "viewporter-client.h"
+#include "single-pixel-buffer-v1-client.h"
+#include "render-thread.h"
+#include "pointer-frame.h"
+#include "startup.h"
+#include "text-buffer.h"
+#include "text-renderer.h"
+#include "text-input-state.h"
 #include "text-input-unstable-v3-client.h"
+#include "event-loop.h"
+#include "trace.h"
+#include "rect-renderer.h"
 
 static struct wl_display *display;
 static struct wl_compositor *compositor = NULL;
 static struct wl_seat *seat = NULL;
 static struct zwp_text_input_v3 *text_input = NULL;
-static struct wl_pointer *pointer = NULL;
+static struct text_input_state *text_input_state = NULL;
+static struct pointer_tracker *pointer_tracker = NULL;
 static struct xdg_wm_base *xdg_wm_base = NULL;
+static struct wl_shm *shm = NULL;
+static struct wp_viewporter *viewporter = NULL;
+static struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager = NULL;
 static struct zwp_text_input_manager_v3 *text_input_manager = NULL;
 static EGLDisplay egl_display;
 static EGLContext egl_context;
 static EGLConfig egl_config;
+// Set when surfaces are drawn into wl_shm buffers instead of through EGL
+static char use_shm = 0;
+// Set when solid colours are shown as viewport-scaled single-pixel buffers, with no rendering at all
+static char use_single_pixel = 0;
+// Set when the window is drawn on its own thread, only supported with EGL
+static char use_render_thread = 0;
+// HELLO_WAYLAND_RECTS, the number of grid cells drawn under the text
+static int rect_count = 0;
 static char quit = 0;
+// NULL without a usable font, text is then not drawn
+static struct text_renderer *text_renderer = NULL;
+// One cursor surface, drawn once, so pointer enter only has to set it
+static struct surface *cursor = NULL;
+// Height of one line of text, dirty lines are damaged in multiples of it
+static int line_height = 20;
+
+// The input method sees at most this much of the document around the cursor, well below the
+// 4000 bytes the protocol allows in one request
+#define SURROUNDING_TEXT_MAX 1024
+
+// A cursor is drawn once, so it is set up to avoid EGL
+enum surface_role {
+    SURFACE_ROLE_TOPLEVEL,
+    SURFACE_ROLE_CURSOR,
+};
 
 struct surface {
     struct wl_surface *surface;
     struct wl_egl_window *egl_window;
     EGLSurface egl_surface;
+    struct shm_pool *shm_pool;
+    int width, height;
+    // Only used on the single-pixel path, the buffer is kept until the colour changes
+    struct wp_viewport *viewport;
+    struct wl_buffer *solid_buffer;
+    // What is currently on screen, and what changed since the last frame
+    float color[3];
+    struct damage damage;
+    // Drawn over the colour and the rectangles with the EGL backend, starting from
+    // first_line, NULL for none
+    const struct text_buffer *text;
+    size_t first_line;
+    // Drawn over the colour, NULL for none
+    struct rect_batch *rects;
+};
+
+// What the input method sent since the last done event, applied in one go when it arrives
+struct text_input_pending {
+    char *preedit;
+    int32_t preedit_cursor_begin, preedit_cursor_end;
+    char *commit;
+    uint32_t delete_before, delete_after;
 };
 
 struct window {
@@ -32,26 +98,71 @@ struct window {
     struct xdg_toplevel *xdg_toplevel;
     int width, height;
     char state;
-    struct surface *cursor;
+    struct text_buffer *text;
+    // Held while the text changes and while it is drawn, which in threaded mode happens on
+    // the render thread
+    pthread_mutex_t text_lock;
+    // The first line in view, moved just far enough to keep the cursor visible
+    size_t first_line;
+    // Where the surrounding text offered to the input method starts. What delete_surrounding_text
+    // refers to is what text_input_state actually sent, which can be an older window.
+    size_t surrounding_start;
+    struct text_input_pending pending;
+    // Changed since the last draw. The window is drawn after the dispatch, on the main thread
+    // only once the previous frame is done, or when a release frees a shm buffer.
+    char dirty;
+    struct wl_callback *frame_callback;
+    // Bumped on every change to the text, the render thread repaints when it moves
+    uint32_t text_version;
+    // Threaded mode only: the main thread publishes render_state snapshots to the render
+    // thread, which owns the surfaces and acked_serial
+    struct render_thread *render_thread;
+    uint32_t configure_serial;
+    uint32_t acked_serial;
+    // The lines changed since the newest version the render thread had drawn, which a skipped
+    // snapshot cannot lose
+    struct text_dirty_lines undrawn_lines;
+    // Written by the render thread under text_lock
+    uint32_t drawn_text_version;
 };
 
-static void draw_window(struct window *window);
+// Everything the render thread needs to draw a frame
+struct render_state {
+    int width, height;
+    char state;
+    // The newest configure, acked by the render thread right before the frame that applies it
+    uint32_t configure_serial;
+    uint32_t text_version;
+    struct text_dirty_lines lines;
+    size_t first_line;
+};
+
+static void resize_surface(struct surface *surface, int width, int height);
 static void window_apply_text_input_state(struct window *window);
 
 static void xdg_wm_base_ping(void *data, struct xdg_wm_base *xdg_wm_base, uint32_t serial) {
+    TRACE_LISTENER(xdg_wm_base, 0, xdg_wm_base);
     xdg_wm_base_pong(xdg_wm_base, serial);
 }
 
 static struct xdg_wm_base_listener xdg_wm_base_listener = {&xdg_wm_base_ping};
 
 static void registry_add_object(void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
+    TRACE_LISTENER(wl_registry, 0, registry);
     if (!strcmp(interface, wl_compositor_interface.name)) {
-        compositor = wl_registry_bind(registry, name, &wl_compositor_interface, 1);
+        // version 4 adds damage_buffer
+        compositor = wl_registry_bind(registry, name, &wl_compositor_interface, version < 4 ? version : 4);
     } else if (!strcmp(interface, wl_seat_interface.name)) {
-        seat = wl_registry_bind(registry, name, &wl_seat_interface, 4);
+        seat = wl_registry_bind(registry, name, &wl_seat_interface, version < POINTER_FRAME_SEAT_VERSION ? version : POINTER_FRAME_SEAT_VERSION);
     } else if (!strcmp(interface, xdg_wm_base_interface.name)) {
         xdg_wm_base = wl_registry_bind(registry, name, &xdg_wm_base_interface, 1);
         xdg_wm_base_add_listener(xdg_wm_base, &xdg_wm_base_listener, NULL);
+    } else if (!strcmp(interface, wl_shm_interface.name)) {
+        shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    } else if (!strcmp(interface, wp_viewporter_interface.name)) {
+        viewporter = wl_registry_bind(registry, name, &wp_viewporter_interface, 1);
+    } else if (!strcmp(interface, wp_single_pixel_buffer_manager_v1_interface.name)) {
+        single_pixel_buffer_manager = wl_registry_bind(registry, name, &wp_single_pixel_buffer_manager_v1_interface, 1);
     } else if (!strcmp(interface, zwp_text_input_manager_v3_interface.name)) {
         text_input_manager = wl_registry_bind(registry, name, &zwp_text_input_manager_v3_interface, 1);
     }
@@ -61,37 +172,40 @@ static void registry_remove_object(void *data, struct wl_registry *registry, uin
 
 static struct wl_registry_listener registry_listener = {&registry_add_object, &registry_remove_object};
 
-static void pointer_enter(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface, wl_fixed_t surface_x, wl_fixed_t surface_y) {
-    struct window *window = data;
-    wl_pointer_set_cursor(wl_pointer, serial, window->cursor->surface, 10, 10);
-}
-
-static void pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial, struct wl_surface *surface) {}
-
-static void pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time, wl_fixed_t surface_x, wl_fixed_t surface_y) {}
-
-static void pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial, uint32_t time, uint32_t button, uint32_t state) {
+static void handle_pointer_frame(void *data, struct wl_pointer *wl_pointer, const struct pointer_frame *frame) {
     struct window *window = data;
-    if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
+    if (frame->entered)
+        wl_pointer_set_cursor(wl_pointer, frame->enter_serial, cursor->surface, 10, 10);
+    char pressed = 0;
+    for (int i = 0; i < frame->button_count; i++) {
+        if (frame->buttons[i].state != WL_POINTER_BUTTON_STATE_PRESSED)
+            continue;
         window->state = (window->state + 1) % 4;
-        draw_window(window);
+        pressed = 1;
+    }
+    // However many clicks the frame held, only the state they end in is drawn and sent
+    if (pressed) {
+        window->dirty = 1;
         window_apply_text_input_state(window);
     }
 }
 
-static void pointer_axis(void *data, struct wl_pointer *wl_pointer, uint32_t time, uint32_t axis, wl_fixed_t value) {}
-
-static struct wl_pointer_listener pointer_listener = {&pointer_enter, &pointer_leave, &pointer_motion, &pointer_button, &pointer_axis, NULL, NULL, NULL, NULL};
-
 void xdg_surface_configure(void *data, struct xdg_surface *xdg_surface, uint32_t serial) {
+    TRACE_LISTENER(xdg_surface, 0, xdg_surface);
     struct window *window = data;
+    startup_mark(STARTUP_FIRST_CONFIGURE);
+    window->dirty = 1;
+    if (window->render_thread) {
+        window->configure_serial = serial;
+        return;
+    }
     xdg_surface_ack_configure(xdg_surface, serial);
-    wl_egl_window_resize(window->surface->egl_window, window->width, window->height, 0, 0);
-    draw_window(window);
+    resize_surface(window->surface, window->width, window->height);
 }
 static struct xdg_surface_listener xdg_surface_listener = {&xdg_surface_configure};
 
 void xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height, struct wl_array *states) {
+    TRACE_LISTENER(xdg_toplevel, 0, xdg_toplevel);
     struct window *window = data;
     if (width > 0)
         window->width = width;
@@ -100,47 +214,280 @@ void xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel, int32
 }
 
 void xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel) {
+    TRACE_LISTENER(xdg_toplevel, 1, xdg_toplevel);
     quit = 1;
 }
 
-static struct xdg_toplevel_listener xdg_toplevel_listener = {&xdg_toplevel_configure, &xdg_toplevel_close};
+void xdg_toplevel_configure_bounds(void *data, struct xdg_toplevel *xdg_toplevel, int32_t width, int32_t height) {}
+
+void xdg_toplevel_wm_capabilities(void *data, struct xdg_toplevel *xdg_toplevel, struct wl_array *capabilities) {}
+
+static struct xdg_toplevel_listener xdg_toplevel_listener = {&xdg_toplevel_configure, &xdg_toplevel_close, &xdg_toplevel_configure_bounds, &xdg_toplevel_wm_capabilities};
 
 static void text_input_enter(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, struct wl_surface *surface) {
+    TRACE_LISTENER(zwp_text_input_v3, 0, zwp_text_input_v3);
     struct window *window = data;
+    text_input_state_enter(text_input_state);
     window_apply_text_input_state(window);
 }
 
-static void text_input_leave(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, struct wl_surface *surface) {}
+static void text_input_leave(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, struct wl_surface *surface) {
+    TRACE_LISTENER(zwp_text_input_v3, 1, zwp_text_input_v3);
+    text_input_state_leave(text_input_state);
+}
 
-static void text_input_preedit_string(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, const char *text, int32_t cursor_begin, int32_t cursor_end) {}
+static void text_input_preedit_string(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, const char *text, int32_t cursor_begin, int32_t cursor_end) {
+    TRACE_LISTENER(zwp_text_input_v3, 2, zwp_text_input_v3);
+    struct window *window = data;
+    free(window->pending.preedit);
+    window->pending.preedit = text ? strdup(text) : NULL;
+    window->pending.preedit_cursor_begin = cursor_begin;
+    window->pending.preedit_cursor_end = cursor_end;
+}
 
-static void text_input_commit_string(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, const char *text) {}
+static void text_input_commit_string(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, const char *text) {
+    TRACE_LISTENER(zwp_text_input_v3, 3, zwp_text_input_v3);
+    struct window *window = data;
+    free(window->pending.commit);
+    window->pending.commit = text ? strdup(text) : NULL;
+}
 
-static void text_input_delete_surrounding_text(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, uint32_t before_length, uint32_t after_length) {}
+static void text_input_delete_surrounding_text(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, uint32_t before_length, uint32_t after_length) {
+    TRACE_LISTENER(zwp_text_input_v3, 4, zwp_text_input_v3);
+    struct window *window = data;
+    window->pending.delete_before = before_length;
+    window->pending.delete_after = after_length;
+}
 
-static void text_input_done(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, uint32_t serial) {}
+// Turns dirty lines into surface damage, lines that moved because others were added or
+// removed above them are damaged down to the bottom of the surface
+static void damage_lines(struct surface *surface, size_t first_line, const struct text_dirty_lines *lines) {
+    if (lines->last < first_line && !lines->to_end)
+        return;
+    size_t first = lines->first > first_line ? lines->first - first_line : 0;
+    size_t last = lines->last > first_line ? lines->last - first_line : 0;
+    if (first >= (size_t)(surface->height + line_height - 1) / line_height)
+        return;
+    int y = first * line_height;
+    int height = surface->height - y;
+    if (!lines->to_end && (last - first + 1) * line_height < (size_t)height)
+        height = (last - first + 1) * line_height;
+    damage_add(&surface->damage, 0, y, surface->width, height);
+}
+
+// Takes the lines the last edits touched and scrolls the cursor into view
+static void damage_text(struct window *window) {
+    struct text_dirty_lines lines;
+    if (!text_buffer_take_dirty(window->text, &lines))
+        return;
+    window->text_version++;
+
+    size_t visible = window->height > line_height ? window->height / line_height : 1;
+    size_t cursor_line = text_buffer_cursor_line(window->text);
+    size_t first_line = window->first_line;
+    if (cursor_line < first_line)
+        first_line = cursor_line;
+    else if (cursor_line >= first_line + visible)
+        first_line = cursor_line - visible + 1;
+    // Scrolling moves every line on screen
+    if (first_line != window->first_line) {
+        window->first_line = first_line;
+        lines.first = first_line;
+        lines.to_end = 1;
+    }
+
+    // The render thread owns the surface and damages it when it sees the new version. Until
+    // it has drawn everything before this change, the lines add up.
+    if (window->render_thread) {
+        pthread_mutex_lock(&window->text_lock);
+        uint32_t drawn = window->drawn_text_version;
+        pthread_mutex_unlock(&window->text_lock);
+        struct text_dirty_lines *undrawn = &window->undrawn_lines;
+        if (drawn == window->text_version - 1) {
+            *undrawn = lines;
+        } else {
+            undrawn->first = lines.first < undrawn->first ? lines.first : undrawn->first;
+            undrawn->last = lines.last > undrawn->last ? lines.last : undrawn->last;
+            undrawn->to_end |= lines.to_end;
+        }
+        return;
+    }
+    window->surface->first_line = first_line;
+    damage_lines(window->surface, first_line, &lines);
+}
+
+static void text_input_done(void *data, struct zwp_text_input_v3 *zwp_text_input_v3, uint32_t serial) {
+    TRACE_LISTENER(zwp_text_input_v3, 5, zwp_text_input_v3);
+    struct window *window = data;
+    struct text_input_pending *pending = &window->pending;
+    // Even a stale done carries text that has to be applied, only the state reply waits
+    text_input_state_done(text_input_state, serial);
+    // In the order the protocol prescribes: the old preedit goes, the surrounding text is
+    // deleted, the commit string is inserted and the new preedit is placed after it
+    pthread_mutex_lock(&window->text_lock);
+    text_buffer_set_preedit(window->text, NULL, -1, -1);
+    size_t cursor = text_buffer_cursor(window->text);
+    // Deletions are only valid inside the surrounding text the input method has seen
+    size_t start = cursor, end = cursor;
+    text_input_state_surrounding_window(text_input_state, &start, &end);
+    size_t before = cursor > start ? cursor - start : 0;
+    size_t after = end > cursor ? end - cursor : 0;
+    text_buffer_delete(window->text,
+        pending->delete_before < before ? pending->delete_before : before,
+        pending->delete_after < after ? pending->delete_after : after);
+    if (pending->commit)
+        text_buffer_insert(window->text, pending->commit, strlen(pending->commit));
+    text_buffer_set_preedit(window->text, pending->preedit, pending->preedit_cursor_begin, pending->preedit_cursor_end);
+    pthread_mutex_unlock(&window->text_lock);
+    free(pending->preedit);
+    free(pending->commit);
+    memset(pending, 0, sizeof(struct text_input_pending));
+    damage_text(window);
+    window->dirty = 1;
+    window_apply_text_input_state(window);
+}
 
 static struct zwp_text_input_v3_listener text_input_listener = {&text_input_enter, &text_input_leave, &text_input_preedit_string, &text_input_commit_string, &text_input_delete_surrounding_text, &text_input_done};
 
-static struct surface *create_surface(int width, int height) {
+static struct surface *create_surface(enum surface_role role, int width, int height) {
     struct surface *surface = malloc(sizeof(struct surface));
     memset(surface, 0, sizeof(struct surface));
     surface->surface = wl_compositor_create_surface(compositor);
+    surface->width = width;
+    surface->height = height;
+    damage_add(&surface->damage, 0, 0, width, height);
+    // A cursor is drawn once and never changes, so it skips EGL whenever the compositor can
+    // show it some other way
+    char is_cursor = role == SURFACE_ROLE_CURSOR;
+    if (use_single_pixel || (is_cursor && viewporter && single_pixel_buffer_manager)) {
+        surface->viewport = wp_viewporter_get_viewport(viewporter, surface->surface);
+        return surface;
+    }
+    if (use_shm || (is_cursor && shm)) {
+        surface->shm_pool = shm_pool_create(shm);
+        return surface;
+    }
     surface->egl_window = wl_egl_window_create(surface->surface, width, height);
     surface->egl_surface = eglCreateWindowSurface(egl_display, egl_config, surface->egl_window, NULL);
+    // Pacing comes from frame callbacks, so the swap must never block the event thread
+    eglMakeCurrent(egl_display, surface->egl_surface, surface->egl_surface, egl_context);
+    eglSwapInterval(egl_display, 0);
     return surface;
 }
 
-static void draw_surface(struct surface *surface, float r, float g, float b) {
+static void resize_surface(struct surface *surface, int width, int height) {
+    if (width != surface->width || height != surface->height)
+        damage_add(&surface->damage, 0, 0, width, height);
+    surface->width = width;
+    surface->height = height;
+    if (surface->egl_window)
+        wl_egl_window_resize(surface->egl_window, width, height, 0, 0);
+}
+
+// Maps a colour channel in [0, 1] onto the full 32-bit range single-pixel buffers use
+static uint32_t single_pixel_channel(float value) {
+    return (uint32_t)((double)value * UINT32_MAX);
+}
+
+// The grid follows the surface size, a shade darker than the background so text stays
+// readable over it. Every cell is set on every frame, the batch skips unchanged ones.
+static void update_rects(struct surface *surface, float r, float g, float b) {
+    rect_grid_layout(surface->rects, surface->width, surface->height);
+    uint32_t cell = shm_pixel(r * 0.8f, g * 0.8f, b * 0.8f);
+    for (int i = 0; i < rect_batch_count(surface->rects); i++)
+        rect_batch_set_color(surface->rects, i, cell);
+    struct rect changed = rect_batch_take_damage(surface->rects);
+    if (!rect_empty(changed))
+        damage_add(&surface->damage, changed.x, changed.y, changed.width, changed.height);
+}
+
+// Returns 0 if nothing was committed
+static int draw_surface(struct surface *surface, float r, float g, float b) {
+    char color_changed = surface->color[0] != r || surface->color[1] != g || surface->color[2] != b;
+    if (color_changed) {
+        surface->color[0] = r;
+        surface->color[1] = g;
+        surface->color[2] = b;
+        damage_add(&surface->damage, 0, 0, surface->width, surface->height);
+    }
+    if (surface->rects)
+        update_rects(surface, r, g, b);
+    // Nothing changed on screen, the commit only carries other state such as an acked configure
+    if (rect_empty(surface->damage.pending)) {
+        wl_surface_commit(surface->surface);
+        return 1;
+    }
+    if (surface->viewport) {
+        // Still the surface's current buffer until the commit below replaces it
+        struct wl_buffer *old_buffer = NULL;
+        if (!surface->solid_buffer || color_changed) {
+            old_buffer = surface->solid_buffer;
+            surface->solid_buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+                single_pixel_buffer_manager,
+                single_pixel_channel(r),
+                single_pixel_channel(g),
+                single_pixel_channel(b),
+                UINT32_MAX);
+        }
+        wl_surface_attach(surface->surface, surface->solid_buffer, 0, 0);
+        wp_viewport_set_destination(surface->viewport, surface->width, surface->height);
+        wl_surface_damage(surface->surface, 0, 0, surface->width, surface->height);
+        wl_surface_commit(surface->surface);
+        if (old_buffer)
+            wl_buffer_destroy(old_buffer);
+        damage_submitted(&surface->damage);
+        return 1;
+    }
+    if (surface->shm_pool) {
+        struct shm_buffer *buffer = shm_pool_acquire(surface->shm_pool, surface->width, surface->height);
+        // Every slot is still on screen or queued in the compositor, the damage waits for the next frame
+        if (!buffer)
+            return 0;
+        struct rect repaint = damage_repaint_region(&surface->damage, buffer->age, buffer->width, buffer->height);
+        shm_fill(buffer->data, buffer->stride, repaint.x, repaint.y, repaint.width, repaint.height, shm_pixel(r, g, b));
+        if (surface->rects)
+            rect_batch_draw_shm(surface->rects, buffer->data, buffer->stride, repaint);
+        wl_surface_attach(surface->surface, buffer->buffer, 0, 0);
+        damage_surface(surface->surface, &surface->damage);
+        wl_surface_commit(surface->surface);
+        damage_submitted(&surface->damage);
+        return 1;
+    }
     eglMakeCurrent(egl_display, surface->egl_surface, surface->egl_surface, egl_context);
+    // Only the parts of the reused back buffer that are out of date get painted again
+    struct rect repaint = damage_repaint_region(&surface->damage, damage_egl_buffer_age(egl_display, surface->egl_surface), surface->width, surface->height);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(repaint.x, surface->height - repaint.y - repaint.height, repaint.width, repaint.height);
     glClearColor(r, g, b, 1.0);
     glClear(GL_COLOR_BUFFER_BIT);
-    eglSwapBuffers(egl_display, surface->egl_surface);
+    if (surface->rects)
+        rect_batch_draw_gl(surface->rects, surface->width, surface->height);
+    if (surface->text && text_renderer) {
+        // Dark text on light backgrounds and light text on dark ones
+        static const float dark[3] = {0.0, 0.0, 0.0};
+        static const float light[3] = {1.0, 1.0, 1.0};
+        const float *color = 0.3 * r + 0.59 * g + 0.11 * b > 0.5 ? dark : light;
+        text_renderer_draw(text_renderer, surface->text, surface->first_line, repaint, surface->width, surface->height, color);
+    }
+    glDisable(GL_SCISSOR_TEST);
+    damage_egl_swap(egl_display, surface->egl_surface, &surface->damage, surface->height);
+    damage_submitted(&surface->damage);
+    return 1;
 }
 
 static void destroy_surface(struct surface *surface) {
-    eglDestroySurface(egl_display, surface->egl_surface);
-    wl_egl_window_destroy(surface->egl_window);
+    if (surface->viewport) {
+        if (surface->solid_buffer)
+            wl_buffer_destroy(surface->solid_buffer);
+        wp_viewport_destroy(surface->viewport);
+    } else if (surface->shm_pool) {
+        shm_pool_destroy(surface->shm_pool);
+    } else {
+        eglDestroySurface(egl_display, surface->egl_surface);
+        wl_egl_window_destroy(surface->egl_window);
+    }
+    if (surface->rects)
+        rect_batch_destroy(surface->rects);
     wl_surface_destroy(surface->surface);
     free(surface);
 }
@@ -149,7 +496,9 @@ static struct window *create_window(int width, int height) {
     struct window *window = malloc(sizeof(struct window));
     memset(window, 0, sizeof(struct window));
 
-    window->surface = create_surface(width, height);
+    window->surface = create_surface(SURFACE_ROLE_TOPLEVEL, width, height);
+    if (rect_count)
+        window->surface->rects = rect_batch_create(rect_count);
 
     window->xdg_surface = xdg_wm_base_get_xdg_surface(xdg_wm_base, window->surface->surface);
 
@@ -158,93 +507,239 @@ static struct window *create_window(int width, int height) {
     xdg_toplevel_add_listener(window->xdg_toplevel, &xdg_toplevel_listener, window);
     window->width = width;
     window->height = height;
+    window->text = text_buffer_create();
+    pthread_mutex_init(&window->text_lock, NULL);
+    window->surface->text = window->text;
 
     wl_surface_commit(window->surface->surface);
 
-    window->cursor = create_surface(30, 30);
-    draw_surface(window->cursor, 1.0, 1.0, 1.0);
-
     return window;
 }
 
-static void draw_window(struct window *window) {
-    switch (window->state) {
+static int draw_window_state(struct surface *surface, char state) {
+    int committed = 0;
+    switch (state) {
         case 0:
         case 2:
-            draw_surface(window->surface, 0.2, 0.2, 0.2);
+            committed = draw_surface(surface, 0.2, 0.2, 0.2);
             break;
 
         case 1:
-            draw_surface(window->surface, 1.0, 0.8, 0.0);
+            committed = draw_surface(surface, 1.0, 0.8, 0.0);
             break;
 
         case 3:
-            draw_surface(window->surface, 0.0, 1.0, 0.2);
+            committed = draw_surface(surface, 0.0, 1.0, 0.2);
     }
+    if (committed)
+        startup_mark(STARTUP_FIRST_FRAME);
+    return committed;
 }
 
-static void window_apply_text_input_state(struct window *window) {
-    switch (window->state) {
-        case 0:
-        case 2:
-            zwp_text_input_v3_disable(text_input);
-            zwp_text_input_v3_commit(text_input);
-            break;
+static void frame_done(void *data, struct wl_callback *callback, uint32_t time) {
+    TRACE_LISTENER(wl_callback, 0, callback);
+    struct window *window = data;
+    wl_callback_destroy(callback);
+    window->frame_callback = NULL;
+}
 
-        case 1:
-            zwp_text_input_v3_enable(text_input);
-            zwp_text_input_v3_commit(text_input);
-            break;
+static struct wl_callback_listener frame_listener = {&frame_done};
 
-        case 3:
-            zwp_text_input_v3_enable(text_input);
-            zwp_text_input_v3_commit(text_input);
-            zwp_text_input_v3_enable(text_input);
-            zwp_text_input_v3_commit(text_input);
+// Runs after every dispatch that left the window dirty, so a burst of input method events
+// is drawn once
+static void draw_window(struct window *window) {
+    if (window->render_thread) {
+        window->dirty = 0;
+        struct render_state *state = render_thread_state(window->render_thread);
+        state->width = window->width;
+        state->height = window->height;
+        state->state = window->state;
+        state->configure_serial = window->configure_serial;
+        state->text_version = window->text_version;
+        state->lines = window->undrawn_lines;
+        state->first_line = window->first_line;
+        render_thread_publish(window->render_thread);
+        return;
+    }
+    if (window->frame_callback)
+        return;
+    window->dirty = 0;
+    // Requested before the swap so it is part of the commit eglSwapBuffers makes
+    window->frame_callback = wl_surface_frame(window->surface->surface);
+    wl_callback_add_listener(window->frame_callback, &frame_listener, window);
+    if (!draw_window_state(window->surface, window->state)) {
+        // No shm buffer was free, so the callback never went out with a commit
+        wl_callback_destroy(window->frame_callback);
+        window->frame_callback = NULL;
+        window->dirty = 1;
     }
 }
 
+// Runs on the render thread, which already requested the frame callback
+static void render_window(void *data, const void *snapshot) {
+    struct window *window = data;
+    const struct render_state *state = snapshot;
+    if (state->configure_serial != window->acked_serial) {
+        xdg_surface_ack_configure(window->xdg_surface, state->configure_serial);
+        window->acked_serial = state->configure_serial;
+        resize_surface(window->surface, state->width, state->height);
+    }
+    struct surface *surface = window->surface;
+    char text_changed = state->text_version != window->drawn_text_version;
+    // Scrolling moves every line on screen
+    if (text_changed && state->first_line != surface->first_line)
+        damage_add(&surface->damage, 0, 0, surface->width, surface->height);
+    else if (text_changed)
+        damage_lines(surface, state->first_line, &state->lines);
+    surface->first_line = state->first_line;
+    pthread_mutex_lock(&window->text_lock);
+    draw_window_state(surface, state->state);
+    window->drawn_text_version = state->text_version;
+    pthread_mutex_unlock(&window->text_lock);
+}
+
+// Records the state the input method should see, text_input_state_flush() sends whatever
+// of it changed once the current batch of events has been handled
+static void window_apply_text_input_state(struct window *window) {
+    // States 1 and 3 have the input method on, 0 and 2 off
+    text_input_state_set_enabled(text_input_state, window->state % 2);
+    text_input_state_set_content_type(text_input_state, ZWP_TEXT_INPUT_V3_CONTENT_HINT_NONE, ZWP_TEXT_INPUT_V3_CONTENT_PURPOSE_NORMAL);
+
+    // The surrounding text is a window into the document that only moves once the cursor
+    // leaves it, so while typing its start stays put and unchanged text compares equal
+    struct text_buffer *text = window->text;
+    size_t cursor = text_buffer_cursor(text);
+    if (cursor < window->surrounding_start || cursor > window->surrounding_start + SURROUNDING_TEXT_MAX)
+        window->surrounding_start = text_buffer_snap(text, cursor > SURROUNDING_TEXT_MAX / 2 ? cursor - SURROUNDING_TEXT_MAX / 2 : 0);
+    size_t surrounding_end = text_buffer_snap(text, window->surrounding_start + SURROUNDING_TEXT_MAX);
+    char surrounding[SURROUNDING_TEXT_MAX + 1];
+    surrounding[text_buffer_copy(text, window->surrounding_start, surrounding_end, surrounding)] = '\0';
+    int32_t surrounding_cursor = cursor - window->surrounding_start;
+    text_input_state_set_surrounding_text(text_input_state, surrounding, surrounding_cursor, surrounding_cursor, window->surrounding_start);
+
+    size_t line = text_buffer_cursor_line(text);
+
+    // Without per-glyph positions the rectangle spans the cursor's line, which is enough for
+    // the input method to place its popup below it
+    int y = (line - window->first_line) * line_height;
+    text_input_state_set_cursor_rectangle(text_input_state, 0, y, window->width, line_height);
+}
+
 static void destroy_window(struct window *window) {
+    if (window->render_thread)
+        render_thread_destroy(window->render_thread);
+    if (window->frame_callback)
+        wl_callback_destroy(window->frame_callback);
     xdg_toplevel_destroy(window->xdg_toplevel);
     xdg_surface_destroy(window->xdg_surface);
     destroy_surface(window->surface);
-    destroy_surface(window->cursor);
+    text_buffer_destroy(window->text);
+    pthread_mutex_destroy(&window->text_lock);
+    free(window->pending.preedit);
+    free(window->pending.commit);
     free(window);
 }
 
+static void handle_terminate(void *data, int signal_number) {
+    quit = 1;
+}
+
+static void handle_dump_stats(void *data, int signal_number) {
+    startup_dump(stderr);
+    text_input_state_dump(text_input_state, stderr);
+    rect_renderer_dump(stderr);
+}
+
+static void handle_toggle_trace(void *data, int signal_number) {
+    trace_toggle();
+}
+
 int main() {
+    startup_mark(STARTUP_MAIN);
+    trace_init();
     display = wl_display_connect(NULL);
+    startup_mark(STARTUP_CONNECTED);
+    enum backend backend = backend_from_env();
+    // EGL comes up while the registry round trip and the font lookup run, started on the
+    // chance that it is needed unless the user asked for shm
+    struct egl_startup *egl_startup = backend != BACKEND_SHM ? egl_startup_begin(display) : NULL;
     struct wl_registry *registry = wl_display_get_registry(display);
     wl_registry_add_listener(registry, &registry_listener, NULL);
     wl_display_roundtrip(display);
+    startup_mark(STARTUP_REGISTRY);
+
+    text_renderer = text_renderer_create();
+    if (text_renderer)
+        line_height = text_renderer_line_height(text_renderer);
+
+    rect_count = rect_count_from_env();
+    // Single-pixel buffers cannot show text or rectangles, so they are only picked when there
+    // is none to show
+    use_single_pixel = backend == BACKEND_AUTO && viewporter && single_pixel_buffer_manager && !text_renderer && !rect_count;
+    use_shm = backend == BACKEND_SHM;
+    if (use_shm && !shm) {
+        fprintf(stderr, "compositor has no wl_shm, falling back to EGL\n");
+        use_shm = 0;
+        egl_startup = egl_startup_begin(display);
+    }
+    if (use_shm && text_renderer)
+        fprintf(stderr, "text is only drawn with the EGL backend\n");
+    use_render_thread = render_thread_requested();
+    if (use_render_thread && (use_shm || use_single_pixel)) {
+        fprintf(stderr, "render thread needs the EGL backend, drawing on the main thread\n");
+        use_render_thread = 0;
+    }
 
-    egl_display = eglGetDisplay(display);
-    eglInitialize(egl_display, NULL, NULL);
-
-    eglBindAPI(EGL_OPENGL_API);
-    EGLint attributes[] = {
-        EGL_RED_SIZE, 8,
-        EGL_GREEN_SIZE, 8,
-        EGL_BLUE_SIZE, 8,
-    EGL_NONE};
-    EGLint num_config;
-    eglChooseConfig(egl_display, attributes, &egl_config, 1, &num_config);
-    egl_context = eglCreateContext(egl_display, egl_config, EGL_NO_CONTEXT, NULL);
+    if (egl_startup) {
+        // Joined even when EGL turned out not to be needed, it is torn down again at exit
+        egl_startup_finish(egl_startup, &egl_display, &egl_config, &egl_context);
+        damage_init_egl(egl_display);
+    }
 
+    cursor = create_surface(SURFACE_ROLE_CURSOR, 30, 30);
+    draw_surface(cursor, 1.0, 1.0, 1.0);
     struct window *window = create_window(300, 300);
+    if (use_render_thread) {
+        // The context can only be current on one thread, from here on that is the render thread
+        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        window->render_thread = render_thread_create(display, window->surface->surface, sizeof(struct render_state), &render_window, window);
+    }
 
-    pointer = wl_seat_get_pointer(seat);
-    wl_pointer_add_listener(pointer, &pointer_listener, window);
+    pointer_tracker = pointer_tracker_create(seat, &handle_pointer_frame, window);
 
     text_input = zwp_text_input_manager_v3_get_text_input(text_input_manager, seat);
     zwp_text_input_v3_add_listener(text_input, &text_input_listener, window);
+    text_input_state = text_input_state_create(text_input);
+
+    struct event_loop *loop = event_loop_create(display);
+    event_loop_add_signal(loop, SIGINT, &handle_terminate, NULL);
+    event_loop_add_signal(loop, SIGTERM, &handle_terminate, NULL);
+    event_loop_add_signal(loop, SIGUSR1, &handle_dump_stats, NULL);
+    event_loop_add_signal(loop, SIGUSR2, &handle_toggle_trace, NULL);
+
+    // Everything one dispatch changed goes out as a single text-input commit
+    while (event_loop_dispatch(loop, -1) != -1 && !quit) {
+        if (window->dirty)
+            draw_window(window);
+        text_input_state_flush(text_input_state);
+    }
+    event_loop_destroy(loop);
 
-    while (wl_display_dispatch(display) != -1 && !quit) {}
+    startup_dump(stderr);
+    text_input_state_dump(text_input_state, stderr);
+    rect_renderer_dump(stderr);
+    text_input_state_destroy(text_input_state);
 
-    wl_pointer_destroy(pointer);
+    pointer_tracker_destroy(pointer_tracker);
     destroy_window(window);
-    eglDestroyContext(egl_display, egl_context);
-    eglTerminate(egl_display);
+    destroy_surface(cursor);
+    if (text_renderer)
+        text_renderer_destroy(text_renderer);
+    if (egl_display != EGL_NO_DISPLAY) {
+        eglDestroyContext(egl_display, egl_context);
+        eglTerminate(egl_display);
+    }
+    trace_finish();
     wl_display_disconnect(display);
     return 0;
 }
@@ -0,0 +1,478 @@
+#define GL_GLEXT_PROTOTYPES
+#include "text-renderer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <fontconfig/fontconfig.h>
+
+#define FONT_PIXEL_SIZE 16
+#define ATLAS_SIZE 1024
+// Buckets in the codepoint to slot table, a power of two
+#define GLYPH_HASH_SIZE 4096
+#define TAB_WIDTH 4
+#define MARGIN 4
+
+// One cell of the atlas. Every cell has the same size, so evicting a glyph frees exactly
+// the room the next one needs.
+struct glyph {
+    uint32_t codepoint;
+    char used;
+    // Bitmap size and its offset from the pen position on the baseline, in pixels
+    int left, top, width, height;
+    int advance;
+    // Slot indices, -1 for none
+    int hash_next;
+    int lru_prev, lru_next;
+    // The last draw that needed this glyph, which must not evict it
+    uint64_t frame;
+};
+
+// Per-quad attributes, one instance per glyph or rectangle. Positions are in surface pixels
+// from the top left, uv in atlas texels.
+struct instance {
+    float rect[4];
+    float uv[4];
+    uint8_t color[4];
+};
+
+struct text_renderer {
+    FT_Library library;
+    FT_Face face;
+    int line_height, ascent;
+    int cell_width, cell_height, columns;
+    // Slot 0 is solid white and draws the cursor and underlines, it is never evicted
+    int slot_count;
+    struct glyph *slots;
+    int hash[GLYPH_HASH_SIZE];
+    // Most and least recently used slot
+    int lru_head, lru_tail;
+    uint64_t frame;
+
+    // Created by the first draw, on the thread that has the context
+    char gl_ready, gl_failed;
+    GLuint program, vao, vbo, texture;
+    GLint viewport_location;
+
+    struct instance *instances;
+    int instance_count, instance_capacity;
+    char *scratch;
+    size_t scratch_capacity;
+};
+
+static const char *vertex_shader_source =
+    "#version 330\n"
+    "layout(location = 0) in vec4 rect;\n"
+    "layout(location = 1) in vec4 uv_rect;\n"
+    "layout(location = 2) in vec4 color;\n"
+    "uniform vec2 viewport;\n"
+    "out vec2 uv;\n"
+    "out vec4 fragment_color;\n"
+    "void main() {\n"
+    "    vec2 corner = vec2(gl_VertexID & 1, gl_VertexID >> 1);\n"
+    "    vec2 position = rect.xy + corner * rect.zw;\n"
+    "    uv = uv_rect.xy + corner * uv_rect.zw;\n"
+    "    fragment_color = color;\n"
+    "    gl_Position = vec4(position / viewport * vec2(2.0, -2.0) + vec2(-1.0, 1.0), 0.0, 1.0);\n"
+    "}\n";
+
+static const char *fragment_shader_source =
+    "#version 330\n"
+    "in vec2 uv;\n"
+    "in vec4 fragment_color;\n"
+    "uniform sampler2D atlas;\n"
+    "out vec4 out_color;\n"
+    "void main() {\n"
+    "    out_color = vec4(fragment_color.rgb, fragment_color.a * texture(atlas, uv / vec2(textureSize(atlas, 0))).r);\n"
+    "}\n";
+
+static char *find_font(void) {
+    if (!FcInit())
+        return NULL;
+    FcPattern *pattern = FcNameParse((const FcChar8 *)"monospace");
+    FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+    FcDefaultSubstitute(pattern);
+    FcResult result;
+    FcPattern *match = FcFontMatch(NULL, pattern, &result);
+    char *path = NULL;
+    FcChar8 *file;
+    if (match && FcPatternGetString(match, FC_FILE, 0, &file) == FcResultMatch)
+        path = strdup((const char *)file);
+    if (match)
+        FcPatternDestroy(match);
+    FcPatternDestroy(pattern);
+    return path;
+}
+
+static void lru_remove(struct text_renderer *renderer, int index) {
+    struct glyph *glyph = &renderer->slots[index];
+    if (glyph->lru_prev >= 0)
+        renderer->slots[glyph->lru_prev].lru_next = glyph->lru_next;
+    else
+        renderer->lru_head = glyph->lru_next;
+    if (glyph->lru_next >= 0)
+        renderer->slots[glyph->lru_next].lru_prev = glyph->lru_prev;
+    else
+        renderer->lru_tail = glyph->lru_prev;
+}
+
+static void lru_push_front(struct text_renderer *renderer, int index) {
+    struct glyph *glyph = &renderer->slots[index];
+    glyph->lru_prev = -1;
+    glyph->lru_next = renderer->lru_head;
+    if (renderer->lru_head >= 0)
+        renderer->slots[renderer->lru_head].lru_prev = index;
+    else
+        renderer->lru_tail = index;
+    renderer->lru_head = index;
+}
+
+static int *hash_bucket(struct text_renderer *renderer, uint32_t codepoint) {
+    return &renderer->hash[(codepoint * 2654435761u) & (GLYPH_HASH_SIZE - 1)];
+}
+
+static void hash_remove(struct text_renderer *renderer, int index) {
+    int *link = hash_bucket(renderer, renderer->slots[index].codepoint);
+    while (*link != index)
+        link = &renderer->slots[*link].hash_next;
+    *link = renderer->slots[index].hash_next;
+}
+
+struct text_renderer *text_renderer_create(void) {
+    char *path = find_font();
+    if (!path) {
+        fprintf(stderr, "no monospace font found, text is not drawn\n");
+        return NULL;
+    }
+    struct text_renderer *renderer = malloc(sizeof(struct text_renderer));
+    memset(renderer, 0, sizeof(struct text_renderer));
+    if (FT_Init_FreeType(&renderer->library)) {
+        free(path);
+        free(renderer);
+        return NULL;
+    }
+    if (FT_New_Face(renderer->library, path, 0, &renderer->face) || FT_Set_Pixel_Sizes(renderer->face, 0, FONT_PIXEL_SIZE)) {
+        fprintf(stderr, "failed to load %s, text is not drawn\n", path);
+        if (renderer->face)
+            FT_Done_Face(renderer->face);
+        FT_Done_FreeType(renderer->library);
+        free(path);
+        free(renderer);
+        return NULL;
+    }
+    free(path);
+
+    FT_Size_Metrics *metrics = &renderer->face->size->metrics;
+    renderer->ascent = (metrics->ascender + 63) >> 6;
+    renderer->line_height = (metrics->height + 63) >> 6;
+    // One pixel of padding around every cell keeps neighbours from bleeding in
+    renderer->cell_width = ((metrics->max_advance + 63) >> 6) + 2;
+    renderer->cell_height = renderer->line_height + 2;
+    renderer->columns = ATLAS_SIZE / renderer->cell_width;
+    renderer->slot_count = renderer->columns * (ATLAS_SIZE / renderer->cell_height);
+    renderer->slots = calloc(renderer->slot_count, sizeof(struct glyph));
+    for (int i = 0; i < GLYPH_HASH_SIZE; i++)
+        renderer->hash[i] = -1;
+    renderer->lru_head = -1;
+    renderer->lru_tail = -1;
+    for (int i = 1; i < renderer->slot_count; i++)
+        lru_push_front(renderer, i);
+    return renderer;
+}
+
+void text_renderer_destroy(struct text_renderer *renderer) {
+    // The GL objects belong to the shared context and go away with it
+    FT_Done_Face(renderer->face);
+    FT_Done_FreeType(renderer->library);
+    free(renderer->slots);
+    free(renderer->instances);
+    free(renderer->scratch);
+    free(renderer);
+}
+
+int text_renderer_line_height(const struct text_renderer *renderer) {
+    return renderer->line_height;
+}
+
+static void slot_origin(const struct text_renderer *renderer, int index, int *x, int *y) {
+    *x = (index % renderer->columns) * renderer->cell_width + 1;
+    *y = (index / renderer->columns) * renderer->cell_height + 1;
+}
+
+static void rasterise(struct text_renderer *renderer, int index, uint32_t codepoint) {
+    struct glyph *glyph = &renderer->slots[index];
+    glyph->codepoint = codepoint;
+    glyph->used = 1;
+    glyph->width = 0;
+    glyph->height = 0;
+    glyph->advance = renderer->cell_width - 2;
+    if (FT_Load_Char(renderer->face, codepoint, FT_LOAD_RENDER))
+        return;
+    FT_GlyphSlot slot = renderer->face->glyph;
+    glyph->advance = (slot->advance.x + 32) >> 6;
+    if (slot->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY || slot->bitmap.pitch <= 0)
+        return;
+    glyph->left = slot->bitmap_left;
+    glyph->top = slot->bitmap_top;
+    // Anything wider or taller than the font's own metrics is cut to the cell
+    glyph->width = slot->bitmap.width < (unsigned)renderer->cell_width - 2 ? (int)slot->bitmap.width : renderer->cell_width - 2;
+    glyph->height = slot->bitmap.rows < (unsigned)renderer->cell_height - 2 ? (int)slot->bitmap.rows : renderer->cell_height - 2;
+    if (!glyph->width || !glyph->height)
+        return;
+    int x, y;
+    slot_origin(renderer, index, &x, &y);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, slot->bitmap.pitch);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, glyph->width, glyph->height, GL_RED, GL_UNSIGNED_BYTE, slot->bitmap.buffer);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+// Returns the glyph from the atlas, rasterising it into the least recently used slot if
+// needed. NULL only if every slot holds a glyph this same draw already uses.
+static struct glyph *get_glyph(struct text_renderer *renderer, uint32_t codepoint) {
+    int *bucket = hash_bucket(renderer, codepoint);
+    int index;
+    for (index = *bucket; index >= 0; index = renderer->slots[index].hash_next) {
+        if (renderer->slots[index].codepoint == codepoint)
+            break;
+    }
+    if (index < 0) {
+        index = renderer->lru_tail;
+        struct glyph *victim = &renderer->slots[index];
+        if (victim->used && victim->frame == renderer->frame)
+            return NULL;
+        if (victim->used)
+            hash_remove(renderer, index);
+        rasterise(renderer, index, codepoint);
+        renderer->slots[index].hash_next = *bucket;
+        *bucket = index;
+    }
+    lru_remove(renderer, index);
+    lru_push_front(renderer, index);
+    renderer->slots[index].frame = renderer->frame;
+    return &renderer->slots[index];
+}
+
+static GLuint compile_shader(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        char log[512];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        fprintf(stderr, "text shader failed to compile: %s\n", log);
+    }
+    return shader;
+}
+
+static int init_gl(struct text_renderer *renderer) {
+    int major = 0, minor = 0;
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (!version || sscanf(version, "%d.%d", &major, &minor) != 2 || major * 10 + minor < 33) {
+        fprintf(stderr, "text rendering needs OpenGL 3.3, the context has %s\n", version ? version : "none");
+        return -1;
+    }
+
+    GLuint vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
+    GLuint fragment_shader = compile_shader(GL_FRAGMENT_SHADER, fragment_shader_source);
+    renderer->program = glCreateProgram();
+    glAttachShader(renderer->program, vertex_shader);
+    glAttachShader(renderer->program, fragment_shader);
+    glLinkProgram(renderer->program);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(fragment_shader);
+    GLint status;
+    glGetProgramiv(renderer->program, GL_LINK_STATUS, &status);
+    if (!status) {
+        fprintf(stderr, "text shader failed to link\n");
+        glDeleteProgram(renderer->program);
+        return -1;
+    }
+    renderer->viewport_location = glGetUniformLocation(renderer->program, "viewport");
+    glUseProgram(renderer->program);
+    glUniform1i(glGetUniformLocation(renderer->program, "atlas"), 0);
+
+    glGenVertexArrays(1, &renderer->vao);
+    glBindVertexArray(renderer->vao);
+    glGenBuffers(1, &renderer->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer->vbo);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(struct instance), (void *)offsetof(struct instance, rect));
+    glVertexAttribDivisor(0, 1);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(struct instance), (void *)offsetof(struct instance, uv));
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(struct instance), (void *)offsetof(struct instance, color));
+    glVertexAttribDivisor(2, 1);
+
+    glGenTextures(1, &renderer->texture);
+    glBindTexture(GL_TEXTURE_2D, renderer->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, ATLAS_SIZE, ATLAS_SIZE, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    // The solid slot only needs one texel, rectangles stretch it
+    uint8_t white = 0xff;
+    int x, y;
+    slot_origin(renderer, 0, &x, &y);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, 1, 1, GL_RED, GL_UNSIGNED_BYTE, &white);
+    return 0;
+}
+
+static void push_instance(struct text_renderer *renderer, int x, int y, int width, int height, int index, int uv_width, int uv_height, const uint8_t color[4]) {
+    if (renderer->instance_count == renderer->instance_capacity) {
+        renderer->instance_capacity = renderer->instance_capacity ? renderer->instance_capacity * 2 : 256;
+        renderer->instances = realloc(renderer->instances, renderer->instance_capacity * sizeof(struct instance));
+    }
+    int u, v;
+    slot_origin(renderer, index, &u, &v);
+    struct instance *instance = &renderer->instances[renderer->instance_count++];
+    instance->rect[0] = x;
+    instance->rect[1] = y;
+    instance->rect[2] = width;
+    instance->rect[3] = height;
+    instance->uv[0] = u;
+    instance->uv[1] = v;
+    instance->uv[2] = uv_width;
+    instance->uv[3] = uv_height;
+    memcpy(instance->color, color, 4);
+}
+
+static void push_rect(struct text_renderer *renderer, int x, int y, int width, int height, const uint8_t color[4]) {
+    push_instance(renderer, x, y, width, height, 0, 1, 1, color);
+}
+
+static uint32_t decode_utf8(const char **text, const char *end) {
+    const unsigned char *s = (const unsigned char *)*text;
+    uint32_t codepoint = *s++;
+    int extra = codepoint >= 0xf0 ? 3 : codepoint >= 0xe0 ? 2 : codepoint >= 0xc0 ? 1 : 0;
+    if (extra)
+        codepoint &= 0x3f >> extra;
+    while (extra-- && s < (const unsigned char *)end && (*s & 0xc0) == 0x80)
+        codepoint = codepoint << 6 | (*s++ & 0x3f);
+    *text = (const char *)s;
+    return codepoint;
+}
+
+// Lays out a run of text starting at x on the line at y and returns where it ends. Only
+// glyphs that end up on the surface are emitted, everything past its right edge is skipped.
+static int layout_run(struct text_renderer *renderer, const char *text, size_t length, int x, int y, int width, const uint8_t color[4], char emit) {
+    const char *end = text + length;
+    while (text < end && x < width) {
+        uint32_t codepoint = decode_utf8(&text, end);
+        if (codepoint == '\t') {
+            struct glyph *space = get_glyph(renderer, ' ');
+            x += (space ? space->advance : renderer->cell_width - 2) * TAB_WIDTH;
+            continue;
+        }
+        if (codepoint < 0x20)
+            continue;
+        struct glyph *glyph = get_glyph(renderer, codepoint);
+        if (!glyph)
+            continue;
+        if (emit && glyph->width)
+            push_instance(renderer, x + glyph->left, y + renderer->ascent - glyph->top, glyph->width, glyph->height, glyph - renderer->slots, glyph->width, glyph->height, color);
+        x += glyph->advance;
+    }
+    return x;
+}
+
+// The preedit is drawn underlined at the cursor, with its own cursor or selection on top
+static int layout_preedit(struct text_renderer *renderer, const struct text_buffer *text, int x, int y, int width, const uint8_t color[4]) {
+    int32_t cursor_begin, cursor_end;
+    const char *preedit = text_buffer_preedit(text, &cursor_begin, &cursor_end);
+    if (!preedit) {
+        push_rect(renderer, x, y, 1, renderer->line_height, color);
+        return x;
+    }
+    int start = x;
+    x = layout_run(renderer, preedit, strlen(preedit), x, y, width, color, 1);
+    push_rect(renderer, start, y + renderer->ascent + 2, x - start, 1, color);
+    if (cursor_begin >= 0) {
+        int begin = layout_run(renderer, preedit, cursor_begin, start, y, width, color, 0);
+        int end = layout_run(renderer, preedit, cursor_end, start, y, width, color, 0);
+        if (end > begin)
+            push_rect(renderer, begin, y + renderer->ascent + 1, end - begin, 2, color);
+        else
+            push_rect(renderer, begin, y, 1, renderer->line_height, color);
+    }
+    return x;
+}
+
+void text_renderer_draw(struct text_renderer *renderer, const struct text_buffer *text, size_t first_line, struct rect clip, int width, int height, const float color[3]) {
+    if (renderer->gl_failed)
+        return;
+    if (!renderer->gl_ready) {
+        if (init_gl(renderer) < 0) {
+            renderer->gl_failed = 1;
+            return;
+        }
+        renderer->gl_ready = 1;
+    }
+    clip = rect_intersect(clip, (struct rect){0, 0, width, height});
+    if (rect_empty(clip))
+        return;
+
+    // Only the lines that overlap the clip are laid out at all
+    size_t first = first_line + clip.y / renderer->line_height;
+    size_t last = first_line + (clip.y + clip.height - 1) / renderer->line_height;
+    if (first >= text_buffer_line_count(text))
+        return;
+    if (last >= text_buffer_line_count(text))
+        last = text_buffer_line_count(text) - 1;
+    size_t start = text_buffer_line_start(text, first);
+    size_t end = text_buffer_line_start(text, last + 1);
+    if (end - start > renderer->scratch_capacity) {
+        renderer->scratch_capacity = end - start;
+        renderer->scratch = realloc(renderer->scratch, renderer->scratch_capacity);
+    }
+    size_t length = text_buffer_copy(text, start, end, renderer->scratch);
+    size_t cursor = text_buffer_cursor(text);
+    uint8_t rgba[4] = {color[0] * 255.0f + 0.5f, color[1] * 255.0f + 0.5f, color[2] * 255.0f + 0.5f, 255};
+
+    glBindTexture(GL_TEXTURE_2D, renderer->texture);
+    renderer->frame++;
+    renderer->instance_count = 0;
+    const char *line = renderer->scratch;
+    const char *scratch_end = renderer->scratch + length;
+    for (size_t i = first; i <= last; i++) {
+        const char *line_end = memchr(line, '\n', scratch_end - line);
+        if (!line_end)
+            line_end = scratch_end;
+        int y = (i - first_line) * renderer->line_height;
+        size_t line_start = start + (line - renderer->scratch);
+        if (cursor >= line_start && cursor <= line_start + (line_end - line)) {
+            size_t column = cursor - line_start;
+            int x = layout_run(renderer, line, column, MARGIN, y, width, rgba, 1);
+            x = layout_preedit(renderer, text, x, y, width, rgba);
+            layout_run(renderer, line + column, line_end - line - column, x, y, width, rgba, 1);
+        } else {
+            layout_run(renderer, line, line_end - line, MARGIN, y, width, rgba, 1);
+        }
+        if (line_end == scratch_end)
+            break;
+        line = line_end + 1;
+    }
+    if (!renderer->instance_count)
+        return;
+
+    glViewport(0, 0, width, height);
+    glUseProgram(renderer->program);
+    glUniform2f(renderer->viewport_location, width, height);
+    glBindVertexArray(renderer->vao);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer->vbo);
+    glBufferData(GL_ARRAY_BUFFER, renderer->instance_count * sizeof(struct instance), renderer->instances, GL_STREAM_DRAW);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, renderer->instance_count);
+    glDisable(GL_BLEND);
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
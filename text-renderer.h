@@ -0,0 +1,28 @@
+#ifndef TEXT_RENDERER_H
+#define TEXT_RENDERER_H
+
+#include <stddef.h>
+#include "damage.h"
+#include "text-buffer.h"
+
+// Draws a text_buffer with OpenGL. Glyphs are rasterised with FreeType the first time they
+// are needed and kept in one texture atlas shared by every surface, least recently used
+// glyphs make room when it is full. Everything a repaint needs, glyphs as well as the
+// cursor and the preedit underline, goes out as a single instanced draw.
+
+struct text_renderer;
+
+// Loads the system monospace font, returns NULL if there is none. Needs no GL context, the
+// GL objects are created on first use by whichever thread draws.
+struct text_renderer *text_renderer_create(void);
+// The GL objects are left to be freed along with the context
+void text_renderer_destroy(struct text_renderer *renderer);
+
+int text_renderer_line_height(const struct text_renderer *renderer);
+
+// Draws the lines of text that fall inside clip, with first_line at the top of a width by
+// height surface. clip is in the top-left origin coordinates of struct damage, the caller
+// has already cleared it.
+void text_renderer_draw(struct text_renderer *renderer, const struct text_buffer *text, size_t first_line, struct rect clip, int width, int height, const float color[3]);
+
+#endif // TEXT_RENDERER_H
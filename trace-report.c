@@ -0,0 +1,285 @@
+// Reads the dumps trace.c writes and prints per-message counts and latencies:
+//
+//     trace-report hello-wayland-1234.trace
+//
+// or turns them into a Chrome trace for chrome://tracing or Perfetto:
+//
+//     trace-report --chrome hello-wayland-1234.trace > trace.json
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+struct message {
+    char *name;
+    enum trace_kind kind;
+    uint64_t count;
+    // Listener or marshalling time of every record, sorted before printing
+    uint32_t *durations;
+    uint64_t capacity;
+};
+
+struct entry {
+    struct trace_record record;
+    uint32_t thread;
+    struct message *message;
+};
+
+static struct message *messages = NULL;
+static int message_count = 0;
+static struct entry *entries = NULL;
+static uint64_t entry_count = 0, entry_capacity = 0;
+// Threads are numbered across dumps, a thread that appears in two dumps gets two numbers
+static uint32_t thread_base = 0;
+
+static void *grow(void *array, uint64_t *capacity, uint64_t count, size_t size) {
+    if (count < *capacity)
+        return array;
+    *capacity = *capacity ? *capacity * 2 : 256;
+    return realloc(array, *capacity * size);
+}
+
+static struct message *find_message(const char *interface, const char *name, enum trace_kind kind) {
+    char full_name[256];
+    snprintf(full_name, sizeof(full_name), "%s.%s", interface, name);
+    for (int i = 0; i < message_count; i++) {
+        if (messages[i].kind == kind && !strcmp(messages[i].name, full_name))
+            return &messages[i];
+    }
+    messages = realloc(messages, (message_count + 1) * sizeof(struct message));
+    struct message *message = &messages[message_count++];
+    memset(message, 0, sizeof(struct message));
+    message->name = strdup(full_name);
+    message->kind = kind;
+    return message;
+}
+
+static int read_string(FILE *file, char *buffer, int size) {
+    int length = 0;
+    int c;
+    while ((c = fgetc(file)) > 0) {
+        if (length < size - 1)
+            buffer[length++] = c;
+    }
+    buffer[length] = 0;
+    return c == 0 ? 0 : -1;
+}
+
+static int read_u32(FILE *file, uint32_t *value) {
+    return fread(value, sizeof(*value), 1, file) == 1 ? 0 : -1;
+}
+
+// Where the requests and events of each interface in one dump are in messages. The array
+// moves as it grows, so indices are kept instead of pointers.
+struct interface_table {
+    uint32_t count[2];
+    int *messages[2];
+};
+
+static int read_names(FILE *file, const char *interface, enum trace_kind kind, struct interface_table *table) {
+    uint32_t *count = &table->count[kind];
+    if (read_u32(file, count) < 0)
+        return -1;
+    int *indices = table->messages[kind] = calloc(*count, sizeof(int));
+    char name[128];
+    for (uint32_t i = 0; i < *count; i++) {
+        if (read_string(file, name, sizeof(name)) < 0)
+            return -1;
+        indices[i] = find_message(interface, name, kind) - messages;
+    }
+    return 0;
+}
+
+// Returns 0 at the end of the file, -1 on a broken dump
+static int read_dump(FILE *file, const char *path) {
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    size_t read = fread(magic, 1, sizeof(magic), file);
+    if (read == 0 && feof(file))
+        return 0;
+    if (read != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "%s: not a trace dump\n", path);
+        return -1;
+    }
+    uint32_t interface_count;
+    if (read_u32(file, &interface_count) < 0)
+        return -1;
+    struct interface_table *interfaces = calloc(interface_count, sizeof(struct interface_table));
+    int result = 1;
+    for (uint32_t i = 0; i < interface_count && result > 0; i++) {
+        char name[128];
+        if (read_string(file, name, sizeof(name)) < 0
+            || read_names(file, name, TRACE_REQUEST, &interfaces[i]) < 0
+            || read_names(file, name, TRACE_EVENT, &interfaces[i]) < 0)
+            result = -1;
+    }
+    uint32_t thread_count = 0;
+    if (result > 0 && read_u32(file, &thread_count) < 0)
+        result = -1;
+    for (uint32_t thread = 0; thread < thread_count && result > 0; thread++) {
+        uint32_t record_count;
+        if (read_u32(file, &record_count) < 0) {
+            result = -1;
+            break;
+        }
+        for (uint32_t i = 0; i < record_count; i++) {
+            struct trace_record record;
+            if (fread(&record, sizeof(record), 1, file) != 1) {
+                result = -1;
+                break;
+            }
+            if (record.interface >= interface_count)
+                continue;
+            const struct interface_table *table = &interfaces[record.interface];
+            if (record.kind > TRACE_EVENT || record.opcode >= table->count[record.kind])
+                continue;
+            int index = table->messages[record.kind][record.opcode];
+            entries = grow(entries, &entry_capacity, entry_count, sizeof(struct entry));
+            entries[entry_count].record = record;
+            entries[entry_count].thread = thread_base + thread;
+            // Turned into a pointer once every dump is read
+            entries[entry_count].message = (struct message *)(intptr_t)index;
+            entry_count++;
+        }
+    }
+    thread_base += thread_count;
+    for (uint32_t i = 0; i < interface_count; i++) {
+        free(interfaces[i].messages[TRACE_REQUEST]);
+        free(interfaces[i].messages[TRACE_EVENT]);
+    }
+    free(interfaces);
+    if (result < 0)
+        fprintf(stderr, "%s: dump is truncated\n", path);
+    return result;
+}
+
+static int compare_durations(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_messages(const void *a, const void *b) {
+    const struct message *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : strcmp(x->name, y->name);
+}
+
+static double percentile_us(const struct message *message, double fraction) {
+    uint64_t index = (uint64_t)(fraction * (message->count - 1));
+    return message->durations[index] / 1e3;
+}
+
+struct interface_total {
+    char name[128];
+    uint64_t requests, events;
+    uint64_t listener_ns;
+};
+
+// Requests and events summed up per interface, busiest first
+static void print_interfaces(void) {
+    struct interface_total *totals = calloc(message_count, sizeof(struct interface_total));
+    int count = 0;
+    for (int i = 0; i < message_count; i++) {
+        const struct message *message = &messages[i];
+        int length = strcspn(message->name, ".");
+        int j = 0;
+        while (j < count && (strncmp(totals[j].name, message->name, length) || totals[j].name[length]))
+            j++;
+        if (j == count)
+            snprintf(totals[count++].name, sizeof(totals[j].name), "%.*s", length, message->name);
+        if (message->kind == TRACE_REQUEST) {
+            totals[j].requests += message->count;
+            continue;
+        }
+        totals[j].events += message->count;
+        for (uint64_t k = 0; k < message->count; k++)
+            totals[j].listener_ns += message->durations[k];
+    }
+    printf("\n%-32s %9s %9s %12s\n", "interface", "requests", "events", "listener us");
+    while (count > 0) {
+        int busiest = 0;
+        for (int i = 1; i < count; i++) {
+            if (totals[i].requests + totals[i].events > totals[busiest].requests + totals[busiest].events)
+                busiest = i;
+        }
+        printf("%-32s %9llu %9llu %12.1f\n", totals[busiest].name, (unsigned long long)totals[busiest].requests, (unsigned long long)totals[busiest].events, totals[busiest].listener_ns / 1e3);
+        totals[busiest] = totals[--count];
+    }
+    free(totals);
+}
+
+static void print_report(void) {
+    for (uint64_t i = 0; i < entry_count; i++) {
+        struct message *message = entries[i].message;
+        message->durations = grow(message->durations, &message->capacity, message->count, sizeof(uint32_t));
+        message->durations[message->count++] = entries[i].record.duration_ns;
+    }
+    qsort(messages, message_count, sizeof(struct message), &compare_messages);
+    uint64_t first = UINT64_MAX, last = 0;
+    for (uint64_t i = 0; i < entry_count; i++) {
+        if (entries[i].record.time_ns < first)
+            first = entries[i].record.time_ns;
+        if (entries[i].record.time_ns > last)
+            last = entries[i].record.time_ns;
+    }
+    printf("%llu records over %.1f ms on %u threads\n\n", (unsigned long long)entry_count, entry_count ? (last - first) / 1e6 : 0.0, thread_base);
+    printf("%-48s %-7s %9s %10s %9s %9s %9s %9s\n", "message", "kind", "count", "total us", "mean us", "p50 us", "p99 us", "max us");
+    for (int i = 0; i < message_count; i++) {
+        struct message *message = &messages[i];
+        if (!message->count)
+            continue;
+        qsort(message->durations, message->count, sizeof(uint32_t), &compare_durations);
+        uint64_t total = 0;
+        for (uint64_t j = 0; j < message->count; j++)
+            total += message->durations[j];
+        printf("%-48s %-7s %9llu %10.1f %9.2f %9.2f %9.2f %9.2f\n",
+            message->name,
+            message->kind == TRACE_REQUEST ? "request" : "event",
+            (unsigned long long)message->count,
+            total / 1e3,
+            total / 1e3 / message->count,
+            percentile_us(message, 0.5),
+            percentile_us(message, 0.99),
+            message->durations[message->count - 1] / 1e3);
+    }
+    print_interfaces();
+}
+
+static void print_chrome_trace(void) {
+    printf("{\"traceEvents\": [\n");
+    for (uint64_t i = 0; i < entry_count; i++) {
+        const struct entry *entry = &entries[i];
+        printf("%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u, \"args\": {\"id\": %u}}",
+            i ? ",\n" : "",
+            entry->message->name,
+            entry->record.kind == TRACE_REQUEST ? "request" : "event",
+            entry->record.time_ns / 1e3,
+            entry->record.duration_ns / 1e3,
+            entry->thread,
+            entry->record.object_id);
+    }
+    printf("\n], \"displayTimeUnit\": \"ns\"}\n");
+}
+
+int main(int argc, char **argv) {
+    int chrome = argc > 1 && !strcmp(argv[1], "--chrome");
+    if (argc != 2 + chrome) {
+        fprintf(stderr, "usage: %s [--chrome] FILE\n", argv[0]);
+        return 2;
+    }
+    const char *path = argv[1 + chrome];
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+    int result;
+    while ((result = read_dump(file, path)) > 0) {}
+    fclose(file);
+    for (uint64_t i = 0; i < entry_count; i++)
+        entries[i].message = &messages[(intptr_t)entries[i].message];
+    if (chrome)
+        print_chrome_trace();
+    else
+        print_report();
+    return result < 0 ? 1 : 0;
+}
@@ -0,0 +1,221 @@
+#include "trace.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// libwayland's limit for arguments in one message
+#define MAX_ARGUMENTS 20
+
+// The record as it is kept in memory, with the interface not yet turned into a table index
+struct ring_record {
+    uint64_t time_ns;
+    const struct wl_interface *interface;
+    uint32_t duration_ns;
+    uint32_t object_id;
+    uint16_t opcode;
+    uint8_t kind;
+};
+
+struct ring {
+    struct ring *next;
+    // Only ever advanced by the owning thread
+    _Atomic uint64_t head;
+    // Only touched by the thread writing dumps, everything before dumped is in a dump already
+    // and everything before dumping goes into the one being written
+    uint64_t dumped, dumping;
+    struct ring_record records[TRACE_RING_SIZE];
+};
+
+static _Atomic char recording = 0;
+static char path[256];
+static _Thread_local struct ring *thread_ring = NULL;
+// Rings are only added, and only ever freed at exit
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ring *rings = NULL;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct ring *get_ring(void) {
+    if (thread_ring)
+        return thread_ring;
+    thread_ring = calloc(1, sizeof(struct ring));
+    pthread_mutex_lock(&rings_lock);
+    thread_ring->next = rings;
+    rings = thread_ring;
+    pthread_mutex_unlock(&rings_lock);
+    return thread_ring;
+}
+
+static void record(enum trace_kind kind, const struct wl_interface *interface, uint16_t opcode, uint32_t object_id, uint64_t start_ns) {
+    struct ring *ring = get_ring();
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    struct ring_record *record = &ring->records[head % TRACE_RING_SIZE];
+    record->time_ns = start_ns;
+    record->interface = interface;
+    record->duration_ns = monotonic_ns() - start_ns;
+    record->object_id = object_id;
+    record->opcode = opcode;
+    record->kind = kind;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+struct trace_span trace_listener_begin(const struct wl_interface *interface, uint16_t opcode, void *proxy) {
+    struct trace_span span = {interface, 0, 0, opcode};
+    if (!atomic_load_explicit(&recording, memory_order_relaxed))
+        return span;
+    span.object_id = wl_proxy_get_id(proxy);
+    span.start_ns = monotonic_ns();
+    return span;
+}
+
+void trace_listener_end(struct trace_span *span) {
+    if (span->start_ns)
+        record(TRACE_EVENT, span->interface, span->opcode, span->object_id, span->start_ns);
+}
+
+#ifdef TRACE_REQUESTS
+// Replaces libwayland's own wl_proxy_marshal_flags(), the generated request stubs in this
+// program and in the libraries it loads all end up here. There is no va_list variant to pass
+// the arguments on with, so they are unpacked even when not recording.
+struct wl_proxy *wl_proxy_marshal_flags(struct wl_proxy *proxy, uint32_t opcode, const struct wl_interface *interface, uint32_t version, uint32_t flags, ...) {
+    const struct wl_interface *proxy_class = wl_proxy_get_interface(proxy);
+    const char *signature = proxy_class->methods[opcode].signature;
+    union wl_argument arguments[MAX_ARGUMENTS];
+    int count = 0;
+    va_list ap;
+    va_start(ap, flags);
+    for (; *signature && count < MAX_ARGUMENTS; signature++) {
+        switch (*signature) {
+            case 'i': arguments[count++].i = va_arg(ap, int32_t); break;
+            case 'u': arguments[count++].u = va_arg(ap, uint32_t); break;
+            case 'f': arguments[count++].f = va_arg(ap, wl_fixed_t); break;
+            case 's': arguments[count++].s = va_arg(ap, const char *); break;
+            case 'o': arguments[count++].o = va_arg(ap, struct wl_object *); break;
+            case 'n': arguments[count++].o = va_arg(ap, struct wl_object *); break;
+            case 'a': arguments[count++].a = va_arg(ap, struct wl_array *); break;
+            case 'h': arguments[count++].h = va_arg(ap, int32_t); break;
+            // Versions and '?' for nullable arguments
+            default: break;
+        }
+    }
+    va_end(ap);
+
+    if (!atomic_load_explicit(&recording, memory_order_relaxed))
+        return wl_proxy_marshal_array_flags(proxy, opcode, interface, version, flags, arguments);
+    // A destructor frees the proxy, so its id has to be read first
+    uint32_t object_id = wl_proxy_get_id(proxy);
+    uint64_t start = monotonic_ns();
+    struct wl_proxy *result = wl_proxy_marshal_array_flags(proxy, opcode, interface, version, flags, arguments);
+    record(TRACE_REQUEST, proxy_class, opcode, object_id, start);
+    return result;
+}
+#endif
+
+static void write_names(FILE *file, const struct wl_message *messages, int count) {
+    uint32_t value = count;
+    fwrite(&value, sizeof(value), 1, file);
+    for (int i = 0; i < count; i++)
+        fwrite(messages[i].name, strlen(messages[i].name) + 1, 1, file);
+}
+
+// Records a thread writes while this runs may overwrite ones being dumped, dumps are meant to
+// be taken once recording has stopped
+static void dump(void) {
+    FILE *file = fopen(path, "ab");
+    if (!file) {
+        perror(path);
+        return;
+    }
+    pthread_mutex_lock(&rings_lock);
+    // Every interface the new records mention, in order of first appearance
+    const struct wl_interface **interfaces = NULL;
+    int interface_count = 0;
+    uint32_t thread_count = 0;
+    for (struct ring *ring = rings; ring; ring = ring->next) {
+        ring->dumping = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (ring->dumping - ring->dumped > TRACE_RING_SIZE)
+            ring->dumped = ring->dumping - TRACE_RING_SIZE;
+        for (uint64_t i = ring->dumped; i < ring->dumping; i++) {
+            const struct wl_interface *interface = ring->records[i % TRACE_RING_SIZE].interface;
+            int known = 0;
+            while (known < interface_count && interfaces[known] != interface)
+                known++;
+            if (known < interface_count)
+                continue;
+            interfaces = realloc(interfaces, (interface_count + 1) * sizeof(*interfaces));
+            interfaces[interface_count++] = interface;
+        }
+        thread_count++;
+    }
+
+    fwrite(TRACE_MAGIC, strlen(TRACE_MAGIC), 1, file);
+    uint32_t value = interface_count;
+    fwrite(&value, sizeof(value), 1, file);
+    for (int i = 0; i < interface_count; i++) {
+        fwrite(interfaces[i]->name, strlen(interfaces[i]->name) + 1, 1, file);
+        write_names(file, interfaces[i]->methods, interfaces[i]->method_count);
+        write_names(file, interfaces[i]->events, interfaces[i]->event_count);
+    }
+    fwrite(&thread_count, sizeof(thread_count), 1, file);
+    uint64_t total = 0;
+    for (struct ring *ring = rings; ring; ring = ring->next) {
+        value = ring->dumping - ring->dumped;
+        fwrite(&value, sizeof(value), 1, file);
+        for (uint64_t i = ring->dumped; i < ring->dumping; i++) {
+            const struct ring_record *source = &ring->records[i % TRACE_RING_SIZE];
+            struct trace_record out = {
+                .time_ns = source->time_ns,
+                .duration_ns = source->duration_ns,
+                .object_id = source->object_id,
+                .opcode = source->opcode,
+                .kind = source->kind,
+            };
+            while (out.interface < interface_count && interfaces[out.interface] != source->interface)
+                out.interface++;
+            fwrite(&out, sizeof(out), 1, file);
+        }
+        total += value;
+        ring->dumped = ring->dumping;
+    }
+    pthread_mutex_unlock(&rings_lock);
+    free(interfaces);
+    fclose(file);
+    fprintf(stderr, "trace: wrote %llu records to %s\n", (unsigned long long)total, path);
+}
+
+void trace_init(void) {
+    const char *value = getenv("HELLO_WAYLAND_TRACE");
+    if (value && *value)
+        snprintf(path, sizeof(path), "%s", value);
+    else
+        snprintf(path, sizeof(path), "hello-wayland-%d.trace", (int)getpid());
+    // A dump that is appended to must not start from an older run's
+    if (value && *value) {
+        unlink(path);
+        atomic_store(&recording, 1);
+    }
+}
+
+void trace_toggle(void) {
+    if (!atomic_load(&recording)) {
+        atomic_store(&recording, 1);
+        fprintf(stderr, "trace: recording\n");
+        return;
+    }
+    atomic_store(&recording, 0);
+    dump();
+}
+
+void trace_finish(void) {
+    if (atomic_exchange(&recording, 0))
+        dump();
+}
@@ -0,0 +1,71 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+// Binary protocol tracing, for when WAYLAND_DEBUG=1 is too slow to show the timing that
+// matters. Every request and every traced listener call is recorded as a fixed-size record in
+// a ring buffer owned by the calling thread, so recording takes no locks and formats nothing.
+//
+// HELLO_WAYLAND_TRACE=FILE starts recording at startup, SIGUSR2 starts or stops it while the
+// program runs. Whenever recording stops, and at exit, the records since the last dump are
+// written to FILE (hello-wayland-<pid>.trace by default). trace-report turns a dump into
+// per-message counts and listener latencies, or into a Chrome trace.
+//
+// Events are only recorded for listeners that start with TRACE_LISTENER(). Requests are only
+// recorded in builds with -Dtrace_requests=true, which wrap wl_proxy_marshal_flags(), the
+// function every generated request stub calls.
+
+// Records kept per thread, older ones are overwritten once a thread has this many
+#define TRACE_RING_SIZE 65536
+
+enum trace_kind {
+    TRACE_REQUEST,
+    TRACE_EVENT,
+};
+
+// Dumps are appended to the file one after another. Each is "WLTRACE1", then a uint32_t count
+// of the interfaces its records refer to, each as its name followed by a uint32_t count and
+// the names of its requests, then the same for its events, all names NUL-terminated. Then a
+// uint32_t number of threads, each with a uint32_t record count followed by that many
+// records. Everything is in host byte order.
+#define TRACE_MAGIC "WLTRACE1"
+
+struct trace_record {
+    // CLOCK_MONOTONIC
+    uint64_t time_ns;
+    // Time spent marshalling the request, or in the listener
+    uint32_t duration_ns;
+    uint32_t object_id;
+    // Index into the dump's interface table
+    uint16_t interface;
+    uint16_t opcode;
+    uint8_t kind;
+    uint8_t padding[3];
+};
+
+// Reads HELLO_WAYLAND_TRACE, call once before connecting
+void trace_init(void);
+// Starts recording, or stops it and writes a dump. For SIGUSR2.
+void trace_toggle(void);
+// Writes a dump if recording
+void trace_finish(void);
+
+struct trace_span {
+    const struct wl_interface *interface;
+    uint64_t start_ns;
+    uint32_t object_id;
+    uint16_t opcode;
+};
+
+// start_ns is 0 when not recording, and the span is then ignored
+struct trace_span trace_listener_begin(const struct wl_interface *interface, uint16_t opcode, void *proxy);
+void trace_listener_end(struct trace_span *span);
+
+// Records the listener it is placed at the top of, from there to its return. opcode is the
+// event's index in the protocol XML, which is also its index in the listener struct.
+#define TRACE_LISTENER(interface, opcode, proxy) \
+    struct trace_span trace_span __attribute__((cleanup(trace_listener_end))) = trace_listener_begin(&interface##_interface, opcode, proxy)
+
+#endif // TRACE_H